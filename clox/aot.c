@@ -0,0 +1,584 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+
+#define CALLEES_MAX 32
+
+typedef struct {
+    FILE *out;
+    ObjFunction **functions;
+    int function_count;
+    int function_capacity;
+
+    // Functions the script declares at the top level. A call through the
+    // global of the same name is compiled as a direct C call, guarded in
+    // case the global was reassigned.
+    ObjString **global_names;
+    ObjFunction **globals;
+    int global_count;
+    int global_capacity;
+} Aot;
+
+// Runtime glue shared by every generated file. Each bytecode instruction
+// becomes one of these macros; the stack pointer lives in a C local and is
+// written back to the VM before anything that can look at it.
+static const char *prelude[] = {
+    "#include \"vm.h\"",
+    "",
+    "#define ENTER() \\",
+    "    Value *slots = frame->slots; \\",
+    "    Value *constants = frame->closure->function->chunk.constants.values; \\",
+    "    uint8_t *code = frame->closure->function->chunk.code; \\",
+    "    InlineCache *caches = frame->closure->function->chunk.caches; \\",
+    "    Value *top = vm.stack_top; \\",
+    "    (void) slots; (void) constants; (void) code; (void) caches",
+    "#define SYNC() (vm.stack_top = top)",
+    "#define RELOAD() (top = vm.stack_top)",
+    "#define DO(call) do { SYNC(); call; RELOAD(); } while (false)",
+    "#define TRY(next, call) \\",
+    "    do { \\",
+    "        frame->ip = code + (next); \\",
+    "        SYNC(); \\",
+    "        if (!(call)) return INTERPRET_RUNTIME_ERROR; \\",
+    "        RELOAD(); \\",
+    "    } while (false)",
+    "#define TRY_CALL(next, call) \\",
+    "    do { \\",
+    "        TRY(next, call); \\",
+    "        frame = &vm.frames[vm.frame_count - 1]; \\",
+    "        slots = frame->slots; \\",
+    "    } while (false)",
+    "// A tail call hands the code that carries on back to run_native(), so",
+    "// deep tail recursion runs in constant C stack at any optimization level.",
+    "#define TAIL(next, call) \\",
+    "    do { \\",
+    "        frame->ip = code + (next); \\",
+    "        SYNC(); \\",
+    "        vm.tail_code = (call); \\",
+    "        return INTERPRET_OK; \\",
+    "    } while (false)",
+    "#define STRING(index) AS_STRING(constants[index])",
+    "#define FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))",
+    "",
+    "#define CONSTANT(index) (*top++ = constants[index])",
+    "#define PUSH_NIL() (*top++ = NIL_VAL)",
+    "#define PUSH_TRUE() (*top++ = TRUE_VAL)",
+    "#define PUSH_FALSE() (*top++ = FALSE_VAL)",
+    "#define POP() (top--)",
+    "#define GET_LOCAL(slot) (*top++ = slots[slot])",
+    "#define SET_LOCAL(slot) (slots[slot] = top[-1])",
+    "#define GLOBAL(index) (vm.globals.values[STRING(index)->global])",
+    "#define GET_GLOBAL(index, next) \\",
+    "    do { \\",
+    "        if (IS_UNDEFINED(GLOBAL(index))) TRY(next, runtime_get_global(STRING(index))); \\",
+    "        *top++ = GLOBAL(index); \\",
+    "    } while (false)",
+    "#define DEFINE_GLOBAL(index) (GLOBAL(index) = *--top)",
+    "#define SET_GLOBAL(index, next) \\",
+    "    do { \\",
+    "        if (IS_UNDEFINED(GLOBAL(index))) TRY(next, runtime_set_global(STRING(index))); \\",
+    "        GLOBAL(index) = top[-1]; \\",
+    "    } while (false)",
+    "#define GET_UPVALUE(index) (*top++ = *frame->closure->upvalues[index]->location)",
+    "#define SET_UPVALUE(index) (*frame->closure->upvalues[index]->location = top[-1])",
+    "#define GET_PROPERTY(index, cache, next) \\",
+    "    do { \\",
+    "        Value *field = cached_field(&caches[cache], top[-1]); \\",
+    "        if (field != NULL) { \\",
+    "            top[-1] = *field; \\",
+    "        } else { \\",
+    "            TRY(next, runtime_get_property(STRING(index), &caches[cache], NULL)); \\",
+    "        } \\",
+    "    } while (false)",
+    "#define SET_PROPERTY(index, cache, next) \\",
+    "    do { \\",
+    "        Value *field = cached_field(&caches[cache], top[-2]); \\",
+    "        if (field != NULL) { \\",
+    "            *field = top[-1]; \\",
+    "            top--; \\",
+    "            top[-1] = top[0]; \\",
+    "        } else { \\",
+    "            TRY(next, runtime_set_property(STRING(index), &caches[cache])); \\",
+    "        } \\",
+    "    } while (false)",
+    "#define GET_SUPER(index, next) TRY(next, runtime_get_super(STRING(index)))",
+    "#define EQUAL() (top--, top[-1] = BOOL_VAL(values_equal(top[-1], top[0])))",
+    "#define INT_OP_GREATER(x, y) BOOL_VAL((x) > (y))",
+    "#define INT_OP_LESS(x, y) BOOL_VAL((x) < (y))",
+    "#define INT_OP_ADD(x, y) integer_value((x) + (y))",
+    "#define INT_OP_SUBTRACT(x, y) integer_value((x) - (y))",
+    "#define INT_OP_MULTIPLY(x, y) integer_multiply(x, y)",
+    "#define INT_OP_DIVIDE(x, y) NUMBER_VAL((double) (x) / (double) (y))",
+    "#define NUMBER_OP(op, type, operator, next) \\",
+    "    do { \\",
+    "        Value b = top[-1]; \\",
+    "        Value a = top[-2]; \\",
+    "        if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \\",
+    "            top--; \\",
+    "            top[-1] = type(AS_DOUBLE(a) operator AS_DOUBLE(b)); \\",
+    "        } else if (IS_INT(a) && IS_INT(b)) { \\",
+    "            top--; \\",
+    "            top[-1] = INT_##op(AS_INT(a), AS_INT(b)); \\",
+    "        } else { \\",
+    "            TRY(next, runtime_binary_op(op, NULL)); \\",
+    "        } \\",
+    "    } while (false)",
+    "#define MOD(next) TRY(next, runtime_binary_op(OP_MOD, NULL))",
+    "#define BITWISE(op, next) TRY(next, runtime_binary_op(op, NULL))",
+    "#define NOT() (top[-1] = BOOL_VAL(FALSEY(top[-1])))",
+    "#define NEGATE(next) \\",
+    "    do { \\",
+    "        if (IS_DOUBLE(top[-1])) { \\",
+    "            top[-1] = NUMBER_VAL(-AS_DOUBLE(top[-1])); \\",
+    "        } else { \\",
+    "            TRY(next, runtime_negate()); \\",
+    "        } \\",
+    "    } while (false)",
+    "#define PRINT() DO(runtime_print())",
+    "#define JUMP(label) goto label",
+    "#define JUMP_IF_FALSE(label) if (FALSEY(top[-1])) goto label",
+    "#define JUMP_IF_TRUE(label) if (!FALSEY(top[-1])) goto label",
+    "#define FOR_STEP(step, loop, label, next) \\",
+    "    do { \\",
+    "        frame->ip = code + (next); \\",
+    "        ForStep result = step(loop); \\",
+    "        if (result == FOR_ERROR) return INTERPRET_RUNTIME_ERROR; \\",
+    "        if (result == FOR_NEXT) goto label; \\",
+    "    } while (false)",
+    "#define FOR_RANGE(slot, label, next) \\",
+    "    do { \\",
+    "        Value *loop = &slots[slot]; \\",
+    "        if (IS_INT(loop[0]) && IS_INT(loop[1])) { \\",
+    "            if (AS_INT(loop[0]) < AS_INT(loop[1])) { \\",
+    "                loop[2] = loop[0]; \\",
+    "                loop[0] = INT_VAL(AS_INT(loop[0]) + 1); \\",
+    "                goto label; \\",
+    "            } \\",
+    "        } else { \\",
+    "            FOR_STEP(runtime_for_range, loop, label, next); \\",
+    "        } \\",
+    "    } while (false)",
+    "#define FOR_LIST(slot, label, next) FOR_STEP(runtime_for_list, &slots[slot], label, next)",
+    "#define SWITCH(index) switch (switch_arm(&frame->closure->function->chunk.switches[index], *--top))",
+    "#define CALL(arg_count, next) TRY_CALL(next, runtime_call(arg_count, NULL))",
+    "#define CALL_DIRECT(function, arg_count, next) TRY_CALL(next, call_direct(function, arg_count))",
+    "#define INTRINSIC(intrinsic, arg_count, next) TRY_CALL(next, runtime_intrinsic(intrinsic, arg_count))",
+    "#define CALL_SCOPED(arg_count, next) TRY_CALL(next, runtime_call_scoped(arg_count))",
+    "#define POP_SCOPED() DO(runtime_pop_scoped())",
+    "#define INVOKE(index, arg_count, cache, next) TRY_CALL(next, runtime_invoke(STRING(index), arg_count, NULL, &caches[cache]))",
+    "#define SUPER_INVOKE(index, arg_count, next) TRY_CALL(next, runtime_super_invoke(STRING(index), arg_count))",
+    "#define TAIL_CALL(arg_count, next) TAIL(next, runtime_tail_call(arg_count))",
+    "#define TAIL_INVOKE(index, arg_count, cache, next) TAIL(next, runtime_tail_invoke(STRING(index), arg_count, &caches[cache]))",
+    "#define TAIL_SUPER_INVOKE(index, arg_count, next) TAIL(next, runtime_tail_super_invoke(STRING(index), arg_count))",
+    "#define CLOSURE(index, offset) DO(runtime_closure(frame, AS_FUNCTION(constants[index]), code + (offset) + 2, false))",
+    "#define CLOSURE_LONG(index, offset) DO(runtime_closure(frame, AS_FUNCTION(constants[index]), code + (offset) + 4, true))",
+    "#define CLOSE_UPVALUE() DO(runtime_close_upvalue())",
+    "#define RETURN() do { SYNC(); runtime_return(frame); return INTERPRET_OK; } while (false)",
+    "#define CLASS(index) DO(runtime_class(STRING(index)))",
+    "#define INHERIT(next) TRY(next, runtime_inherit())",
+    "#define METHOD(index) DO(runtime_method(STRING(index)))",
+    "#define NEW_LIST() DO(runtime_new_list())",
+    "#define GET_LIST(next) TRY(next, runtime_get_list())",
+    "#define SET_LIST(next) TRY(next, runtime_set_list())",
+    "",
+    "// Calls a function compiled into this file, or does a regular call if",
+    "// the callee turns out to be something else, the stacks need to grow or",
+    "// the C stack is running out.",
+    "static inline bool call_direct(NativeCode function, int arg_count) {",
+    "    Value *slots = vm.stack_top - arg_count - 1;",
+    "    if (!IS_CLOSURE(*slots) || AS_CLOSURE(*slots)->function->native_code != (void *) function ||",
+    "        vm.frame_count == vm.frame_capacity ||",
+    "        AS_CLOSURE(*slots)->function->max_slots > vm.stack_end - slots ||",
+    "        (uintptr_t) &slots < vm.c_stack_limit) {",
+    "        return runtime_call(arg_count, NULL);",
+    "    }",
+    "",
+    "    CallFrame *frame = &vm.frames[vm.frame_count++];",
+    "    frame->closure = AS_CLOSURE(*slots);",
+    "    frame->ip = frame->closure->function->chunk.code;",
+    "    frame->slots = slots;",
+    "    frame->engine = ENGINE_NATIVE;",
+    "    return run_native(frame) == INTERPRET_OK;",
+    "}",
+};
+
+// Numbers the functions in the same order interpret_native() hands the
+// compiled code back out: the script first, then each function before the
+// ones nested inside it.
+static void collect_functions(Aot *aot, ObjFunction *function) {
+    if (aot->function_capacity < aot->function_count + 1) {
+        aot->function_capacity = GROW_CAPACITY(aot->function_capacity);
+        aot->functions = realloc(aot->functions, aot->function_capacity * sizeof(ObjFunction *));
+        if (aot->functions == NULL) exit(1);
+    }
+    aot->functions[aot->function_count++] = function;
+
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            collect_functions(aot, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+// The constant operand of an instruction, in either of its forms.
+static int constant_operand(uint8_t *code) {
+    switch (code[0]) {
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_CLOSURE_LONG:
+            return read_long(&code[1]);
+        default:
+            return code[1];
+    }
+}
+
+static void collect_globals(Aot *aot, ObjFunction *script) {
+    Chunk *chunk = &script->chunk;
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instruction_length(chunk, offset);
+        if ((chunk->code[offset] == OP_CLOSURE || chunk->code[offset] == OP_CLOSURE_LONG) && next < chunk->count &&
+            (chunk->code[next] == OP_DEFINE_GLOBAL || chunk->code[next] == OP_DEFINE_GLOBAL_LONG)) {
+            if (aot->global_capacity < aot->global_count + 1) {
+                aot->global_capacity = GROW_CAPACITY(aot->global_capacity);
+                aot->global_names = realloc(aot->global_names, aot->global_capacity * sizeof(ObjString *));
+                aot->globals = realloc(aot->globals, aot->global_capacity * sizeof(ObjFunction *));
+                if (aot->global_names == NULL || aot->globals == NULL) exit(1);
+            }
+            aot->global_names[aot->global_count] = AS_STRING(chunk->constants.values[constant_operand(&chunk->code[next])]);
+            aot->globals[aot->global_count++] = AS_FUNCTION(chunk->constants.values[constant_operand(&chunk->code[offset])]);
+        }
+        offset = next;
+    }
+}
+
+static ObjFunction *find_global(Aot *aot, ObjString *name) {
+    for (int i = aot->global_count - 1; i >= 0; i--) {
+        if (aot->global_names[i] == name) return aot->globals[i];
+    }
+    return NULL;
+}
+
+static int function_index(Aot *aot, ObjFunction *function) {
+    for (int i = 0; i < aot->function_count; i++) {
+        if (aot->functions[i] == function) return i;
+    }
+    return -1;
+}
+
+static void emit_instruction(Aot *aot, ObjFunction *function, int offset, int next, ObjFunction *callee) {
+    FILE *out = aot->out;
+    uint8_t *code = &function->chunk.code[offset];
+
+    fprintf(out, "    ");
+    switch (code[0]) {
+        case OP_CONSTANT: fprintf(out, "CONSTANT(%d);", code[1]); break;
+        case OP_NIL: fprintf(out, "PUSH_NIL();"); break;
+        case OP_TRUE: fprintf(out, "PUSH_TRUE();"); break;
+        case OP_FALSE: fprintf(out, "PUSH_FALSE();"); break;
+        case OP_POP: fprintf(out, "POP();"); break;
+        case OP_GET_LOCAL: fprintf(out, "GET_LOCAL(%d);", code[1]); break;
+        case OP_SET_LOCAL: fprintf(out, "SET_LOCAL(%d);", code[1]); break;
+        case OP_GET_GLOBAL: fprintf(out, "GET_GLOBAL(%d, %d);", code[1], next); break;
+        case OP_DEFINE_GLOBAL: fprintf(out, "DEFINE_GLOBAL(%d);", code[1]); break;
+        case OP_SET_GLOBAL: fprintf(out, "SET_GLOBAL(%d, %d);", code[1], next); break;
+        case OP_GET_UPVALUE: fprintf(out, "GET_UPVALUE(%d);", code[1]); break;
+        case OP_SET_UPVALUE: fprintf(out, "SET_UPVALUE(%d);", code[1]); break;
+        case OP_GET_PROPERTY:
+            fprintf(out, "GET_PROPERTY(%d, %d, %d);", code[1], read_cache_index(&code[2]), next);
+            break;
+        case OP_SET_PROPERTY:
+            fprintf(out, "SET_PROPERTY(%d, %d, %d);", code[1], read_cache_index(&code[2]), next);
+            break;
+        case OP_GET_SUPER: fprintf(out, "GET_SUPER(%d, %d);", code[1], next); break;
+        case OP_EQUAL: fprintf(out, "EQUAL();"); break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            fprintf(out, "NUMBER_OP(OP_GREATER, BOOL_VAL, >, %d);", next);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            fprintf(out, "NUMBER_OP(OP_LESS, BOOL_VAL, <, %d);", next);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            fprintf(out, "NUMBER_OP(OP_ADD, NUMBER_VAL, +, %d);", next);
+            break;
+        case OP_SUBTRACT: fprintf(out, "NUMBER_OP(OP_SUBTRACT, NUMBER_VAL, -, %d);", next); break;
+        case OP_MULTIPLY: fprintf(out, "NUMBER_OP(OP_MULTIPLY, NUMBER_VAL, *, %d);", next); break;
+        case OP_DIVIDE: fprintf(out, "NUMBER_OP(OP_DIVIDE, NUMBER_VAL, /, %d);", next); break;
+        case OP_MOD: fprintf(out, "MOD(%d);", next); break;
+        case OP_BIT_AND: fprintf(out, "BITWISE(OP_BIT_AND, %d);", next); break;
+        case OP_BIT_OR: fprintf(out, "BITWISE(OP_BIT_OR, %d);", next); break;
+        case OP_BIT_XOR: fprintf(out, "BITWISE(OP_BIT_XOR, %d);", next); break;
+        case OP_SHIFT_LEFT: fprintf(out, "BITWISE(OP_SHIFT_LEFT, %d);", next); break;
+        case OP_SHIFT_RIGHT: fprintf(out, "BITWISE(OP_SHIFT_RIGHT, %d);", next); break;
+        case OP_NOT: fprintf(out, "NOT();"); break;
+        case OP_NEGATE: fprintf(out, "NEGATE(%d);", next); break;
+        case OP_PRINT: fprintf(out, "PRINT();"); break;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+            fprintf(out, "JUMP(L%d);", jump_target(&function->chunk, offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            fprintf(out, "JUMP_IF_FALSE(L%d);", jump_target(&function->chunk, offset));
+            break;
+        case OP_JUMP_IF_TRUE:
+            fprintf(out, "JUMP_IF_TRUE(L%d);", jump_target(&function->chunk, offset));
+            break;
+        case OP_FOR_RANGE:
+            fprintf(out, "FOR_RANGE(%d, L%d, %d);", code[1], jump_target(&function->chunk, offset), next);
+            break;
+        case OP_FOR_LIST:
+            fprintf(out, "FOR_LIST(%d, L%d, %d);", code[1], jump_target(&function->chunk, offset), next);
+            break;
+        case OP_SWITCH: {
+            // The C compiler makes its own jump table out of the arms.
+            SwitchTable *table = switch_table(&function->chunk, offset);
+            fprintf(out, "SWITCH(%d) {", read_cache_index(&code[1]));
+            for (int arm = 0; arm < table->arm_count; arm++) {
+                if (arm != table->fallback) fprintf(out, " case %d: goto L%d;", arm, table->targets[arm]);
+            }
+            fprintf(out, " default: goto L%d; }", table->targets[table->fallback]);
+            break;
+        }
+        case OP_CALL:
+            if (callee != NULL && callee->arity == code[1]) {
+                fprintf(out, "CALL_DIRECT(function_%d, %d, %d);", function_index(aot, callee), code[1], next);
+            } else {
+                fprintf(out, "CALL(%d, %d);", code[1], next);
+            }
+            break;
+        case OP_CALL_SCOPED: fprintf(out, "CALL_SCOPED(%d, %d);", code[1], next); break;
+        case OP_POP_SCOPED: fprintf(out, "POP_SCOPED();"); break;
+        case OP_INTRINSIC: fprintf(out, "INTRINSIC(%d, %d, %d);", code[1], code[2], next); break;
+        case OP_INVOKE:
+            fprintf(out, "INVOKE(%d, %d, %d, %d);", code[1], code[2], read_cache_index(&code[3]), next);
+            break;
+        case OP_SUPER_INVOKE: fprintf(out, "SUPER_INVOKE(%d, %d, %d);", code[1], code[2], next); break;
+        case OP_TAIL_CALL: fprintf(out, "TAIL_CALL(%d, %d);", code[1], next); break;
+        case OP_TAIL_INVOKE:
+            fprintf(out, "TAIL_INVOKE(%d, %d, %d, %d);", code[1], code[2], read_cache_index(&code[3]), next);
+            break;
+        case OP_TAIL_SUPER_INVOKE: fprintf(out, "TAIL_SUPER_INVOKE(%d, %d, %d);", code[1], code[2], next); break;
+        case OP_CLOSURE: fprintf(out, "CLOSURE(%d, %d);", code[1], offset); break;
+        case OP_CLOSE_UPVALUE: fprintf(out, "CLOSE_UPVALUE();"); break;
+        case OP_RETURN: fprintf(out, "RETURN();"); break;
+        case OP_CLASS: fprintf(out, "CLASS(%d);", code[1]); break;
+        case OP_INHERIT: fprintf(out, "INHERIT(%d);", next); break;
+        case OP_METHOD: fprintf(out, "METHOD(%d);", code[1]); break;
+        case OP_NEW_LIST: fprintf(out, "NEW_LIST();"); break;
+        case OP_GET_LIST:
+        case OP_GET_LIST_NUMIDX:
+            fprintf(out, "GET_LIST(%d);", next);
+            break;
+        case OP_SET_LIST:
+        case OP_SET_LIST_NUMIDX:
+            fprintf(out, "SET_LIST(%d);", next);
+            break;
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            fprintf(out, "GET_LOCAL(%d); GET_LOCAL(%d); NUMBER_OP(OP_ADD, NUMBER_VAL, +, %d);",
+                    code[1], code[2], next);
+            break;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            fprintf(out, "GET_LOCAL(%d); CONSTANT(%d); NUMBER_OP(OP_ADD, NUMBER_VAL, +, %d);",
+                    code[1], code[2], next);
+            break;
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            fprintf(out, "GET_LOCAL(%d); CONSTANT(%d); NUMBER_OP(OP_SUBTRACT, NUMBER_VAL, -, %d);",
+                    code[1], code[2], next);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            fprintf(out, "NUMBER_OP(OP_LESS, BOOL_VAL, <, %d); JUMP_IF_FALSE(L%d);",
+                    next, jump_target(&function->chunk, offset));
+            break;
+        case OP_SET_LOCAL_POP: fprintf(out, "SET_LOCAL(%d); POP();", code[1]); break;
+        case OP_CONSTANT_LONG: fprintf(out, "CONSTANT(%d);", read_long(&code[1])); break;
+        case OP_GET_LOCAL_LONG: fprintf(out, "GET_LOCAL(%d);", read_long(&code[1])); break;
+        case OP_SET_LOCAL_LONG: fprintf(out, "SET_LOCAL(%d);", read_long(&code[1])); break;
+        case OP_GET_GLOBAL_LONG: fprintf(out, "GET_GLOBAL(%d, %d);", read_long(&code[1]), next); break;
+        case OP_DEFINE_GLOBAL_LONG: fprintf(out, "DEFINE_GLOBAL(%d);", read_long(&code[1])); break;
+        case OP_SET_GLOBAL_LONG: fprintf(out, "SET_GLOBAL(%d, %d);", read_long(&code[1]), next); break;
+        case OP_GET_PROPERTY_LONG:
+            fprintf(out, "GET_PROPERTY(%d, %d, %d);", read_long(&code[1]), read_cache_index(&code[4]), next);
+            break;
+        case OP_SET_PROPERTY_LONG:
+            fprintf(out, "SET_PROPERTY(%d, %d, %d);", read_long(&code[1]), read_cache_index(&code[4]), next);
+            break;
+        case OP_GET_SUPER_LONG: fprintf(out, "GET_SUPER(%d, %d);", read_long(&code[1]), next); break;
+        case OP_CLOSURE_LONG: fprintf(out, "CLOSURE_LONG(%d, %d);", read_long(&code[1]), offset); break;
+        case OP_CLASS_LONG: fprintf(out, "CLASS(%d);", read_long(&code[1])); break;
+        case OP_METHOD_LONG: fprintf(out, "METHOD(%d);", read_long(&code[1])); break;
+        case OP_FOR_RANGE_LONG:
+            fprintf(out, "FOR_RANGE(%d, L%d, %d);", read_long(&code[1]), jump_target(&function->chunk, offset), next);
+            break;
+        case OP_FOR_LIST_LONG:
+            fprintf(out, "FOR_LIST(%d, L%d, %d);", read_long(&code[1]), jump_target(&function->chunk, offset), next);
+            break;
+    }
+    fprintf(out, "\n");
+}
+
+static void emit_function(Aot *aot, int index) {
+    ObjFunction *function = aot->functions[index];
+    Chunk *chunk = &function->chunk;
+
+    bool *labels = calloc(chunk->count, sizeof(bool));
+    if (labels == NULL) exit(1);
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        switch (chunk->code[offset]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_LOOP_LONG:
+            case OP_FOR_RANGE:
+            case OP_FOR_LIST:
+            case OP_FOR_RANGE_LONG:
+            case OP_FOR_LIST_LONG:
+                labels[jump_target(chunk, offset)] = true;
+                break;
+            case OP_SWITCH: {
+                SwitchTable *table = switch_table(chunk, offset);
+                for (int arm = 0; arm < table->arm_count; arm++) {
+                    labels[table->targets[arm]] = true;
+                }
+                break;
+            }
+        }
+    }
+
+    if (function->name == NULL) {
+        fprintf(aot->out, "\n// script\n");
+    } else {
+        fprintf(aot->out, "\n// fun %s\n", function->name->chars);
+    }
+    fprintf(aot->out, "static InterpretResult function_%d(CallFrame *frame) {\n", index);
+    fprintf(aot->out, "    ENTER();\n");
+
+    // Which top-level function, if any, each value near the top of the
+    // stack came from, so calls can be made directly.
+    ObjFunction *callees[CALLEES_MAX];
+    int callee_count = 0;
+
+    for (int offset = 0; offset < chunk->count;) {
+        int next = offset + instruction_length(chunk, offset);
+        uint8_t instruction = chunk->code[offset];
+        if (labels[offset]) {
+            fprintf(aot->out, "L%d:\n", offset);
+            callee_count = 0;
+        }
+
+        ObjFunction *callee = NULL;
+        if (instruction == OP_CALL && chunk->code[offset + 1] < callee_count) {
+            callee = callees[callee_count - 1 - chunk->code[offset + 1]];
+        }
+        emit_instruction(aot, function, offset, next, callee);
+
+        int pops;
+        int pushes;
+        stack_effect(chunk, offset, &pops, &pushes);
+        callee_count = pops > callee_count ? 0 : callee_count - pops;
+        if (pushes > 0) {
+            if (callee_count == CALLEES_MAX) {
+                memmove(callees, callees + 1, (CALLEES_MAX - 1) * sizeof(ObjFunction *));
+                callee_count--;
+            }
+            callees[callee_count++] = instruction == OP_GET_GLOBAL || instruction == OP_GET_GLOBAL_LONG
+                ? find_global(aot, AS_STRING(chunk->constants.values[constant_operand(&chunk->code[offset])]))
+                : NULL;
+        }
+        if (instruction == OP_JUMP || instruction == OP_LOOP || instruction == OP_RETURN ||
+            instruction == OP_JUMP_LONG || instruction == OP_LOOP_LONG ||
+            instruction == OP_TAIL_CALL || instruction == OP_TAIL_INVOKE || instruction == OP_TAIL_SUPER_INVOKE) {
+            callee_count = 0;
+        }
+        offset = next;
+    }
+
+    fprintf(aot->out, "}\n");
+    free(labels);
+}
+
+static void emit_source(FILE *out, const char *source) {
+    fprintf(out, "\nstatic const char source[] =\n    \"");
+    for (const char *c = source; *c != '\0'; c++) {
+        switch (*c) {
+            case '\n':
+                fprintf(out, "\\n\"\n    \"");
+                break;
+            case '\\': fprintf(out, "\\\\"); break;
+            case '"': fprintf(out, "\\\""); break;
+            case '?': fprintf(out, "\\?"); break;
+            case '\t': fprintf(out, "\\t"); break;
+            default:
+                if ((unsigned char) *c < ' ' || (unsigned char) *c >= 0x7F) {
+                    fprintf(out, "\\%03o", (unsigned char) *c);
+                } else {
+                    fputc(*c, out);
+                }
+                break;
+        }
+    }
+    fprintf(out, "\";\n");
+}
+
+// Translates the script to a C file that runs it without the bytecode
+// interpreter. The file embeds the source, which the runtime still compiles
+// at startup for its constants and line numbers, and supplies native code
+// for every function.
+InterpretResult emit_c(const char *source, FILE *out) {
+    ObjFunction *script = compile(source);
+    if (script == NULL) return INTERPRET_COMPILE_ERROR;
+
+    Aot aot;
+    memset(&aot, 0, sizeof(aot));
+    aot.out = out;
+    collect_functions(&aot, script);
+    collect_globals(&aot, script);
+
+    fprintf(out, "// Generated by clox --emit-c. Build it against every runtime source\n");
+    fprintf(out, "// except main.c, for example:\n");
+    fprintf(out, "//   cc -O2 -I clox program.c $(ls clox/*.c | grep -v main.c) -lm\n\n");
+    for (size_t i = 0; i < sizeof(prelude) / sizeof(prelude[0]); i++) {
+        fprintf(out, "%s\n", prelude[i]);
+    }
+
+    fprintf(out, "\n");
+    for (int i = 0; i < aot.function_count; i++) {
+        fprintf(out, "static InterpretResult function_%d(CallFrame *frame);\n", i);
+    }
+    for (int i = 0; i < aot.function_count; i++) {
+        emit_function(&aot, i);
+    }
+
+    emit_source(out, source);
+    fprintf(out, "\nstatic NativeCode functions[] = {\n");
+    for (int i = 0; i < aot.function_count; i++) {
+        fprintf(out, "    function_%d,\n", i);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    init_vm();\n");
+    fprintf(out, "    vm.optimize_level = %d;\n", vm.optimize_level);
+    fprintf(out, "    InterpretResult result = interpret_native(source, functions, %d);\n", aot.function_count);
+    fprintf(out, "    free_vm();\n\n");
+    fprintf(out, "    if (result == INTERPRET_COMPILE_ERROR) return 65;\n");
+    fprintf(out, "    if (result == INTERPRET_RUNTIME_ERROR) return 70;\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    free(aot.functions);
+    free(aot.global_names);
+    free(aot.globals);
+    return INTERPRET_OK;
+}
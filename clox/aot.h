@@ -0,0 +1,10 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "vm.h"
+
+InterpretResult emit_c(const char *source, FILE *out);
+
+#endif
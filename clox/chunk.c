@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -10,12 +11,28 @@ void init_chunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;    
     init_value_array(&chunk->constants);
+    chunk->caches = NULL;
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->switches = NULL;
+    chunk->switch_count = 0;
+    chunk->switch_capacity = 0;
 }
 
 void free_chunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
+    for (int i = 0; i < chunk->switch_count; i++) {
+        SwitchTable *table = &chunk->switches[i];
+        FREE_ARRAY(int, table->targets, table->arm_count);
+        FREE_ARRAY(int, table->register_targets, table->arm_count);
+        FREE_ARRAY(int, table->dense, table->dense_count);
+        FREE_ARRAY(SwitchCase, table->numbers, table->number_count);
+        FREE_ARRAY(SwitchCase, table->strings, table->string_capacity);
+    }
+    FREE_ARRAY(SwitchTable, chunk->switches, chunk->switch_capacity);
     init_chunk(chunk);
 }
 
@@ -38,3 +55,312 @@ int add_constant(Chunk *chunk, Value value) {
     pop();
     return chunk->constants.count - 1;
 }
+
+// Sites past the last two byte index share one cache. It starts out
+// megamorphic so they never fill it with entries meant for each other.
+int add_cache(Chunk *chunk) {
+    if (chunk->cache_count > UINT16_MAX) return UINT16_MAX;
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        int old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    
+    InlineCache *cache = &chunk->caches[chunk->cache_count];
+    memset(cache, 0, sizeof(InlineCache));
+    cache->megamorphic = chunk->cache_count == UINT16_MAX;
+    return chunk->cache_count++;
+}
+
+// Returns -1 once the two byte index runs out.
+int add_switch(Chunk *chunk) {
+    if (chunk->switch_count > UINT16_MAX) return -1;
+    if (chunk->switch_capacity < chunk->switch_count + 1) {
+        int old_capacity = chunk->switch_capacity;
+        chunk->switch_capacity = GROW_CAPACITY(old_capacity);
+        chunk->switches = GROW_ARRAY(SwitchTable, chunk->switches, old_capacity, chunk->switch_capacity);
+    }
+    
+    memset(&chunk->switches[chunk->switch_count], 0, sizeof(SwitchTable));
+    return chunk->switch_count++;
+}
+
+static int compare_cases(const void *a, const void *b) {
+    double x = AS_NUMBER(((const SwitchCase*) a)->key);
+    double y = AS_NUMBER(((const SwitchCase*) b)->key);
+    return (x > y) - (x < y);
+}
+
+// Sorts the cases, which have no duplicates, into the table's lookups.
+// Integers get an array when it would be no more than about half empty.
+void fill_switch(SwitchTable *table, SwitchCase *cases, int case_count, int *targets, int arm_count,
+                 int fallback) {
+    table->arm_count = arm_count;
+    table->fallback = fallback;
+    table->targets = ALLOCATE(int, arm_count);
+    memcpy(table->targets, targets, arm_count * sizeof(int));
+    table->register_targets = ALLOCATE(int, arm_count);
+    memset(table->register_targets, 0, arm_count * sizeof(int));
+    
+    int integer_count = 0;
+    int number_count = 0;
+    int string_count = 0;
+    int64_t low = INTEGER_MAX;
+    int64_t high = INTEGER_MIN;
+    for (int i = 0; i < case_count; i++) {
+        int64_t integer;
+        if (IS_STRING(cases[i].key)) {
+            string_count++;
+        } else if (as_integer(cases[i].key, &integer)) {
+            integer_count++;
+            if (integer < low) low = integer;
+            if (integer > high) high = integer;
+        } else {
+            number_count++;
+        }
+    }
+    
+    bool dense = integer_count > 0 && high - low < 2 * (int64_t) integer_count + 8;
+    if (dense) {
+        table->low = low;
+        table->dense_count = (int) (high - low + 1);
+        table->dense = ALLOCATE(int, table->dense_count);
+        for (int i = 0; i < table->dense_count; i++) {
+            table->dense[i] = fallback;
+        }
+    } else {
+        number_count += integer_count;
+    }
+    
+    table->number_count = number_count;
+    table->numbers = ALLOCATE(SwitchCase, number_count);
+    if (string_count > 0) {
+        table->string_capacity = 8;
+        while (table->string_capacity < 2 * string_count) table->string_capacity *= 2;
+        table->strings = ALLOCATE(SwitchCase, table->string_capacity);
+        for (int i = 0; i < table->string_capacity; i++) {
+            table->strings[i].key = NIL_VAL;
+            table->strings[i].arm = fallback;
+        }
+    }
+    
+    int number = 0;
+    for (int i = 0; i < case_count; i++) {
+        int64_t integer;
+        if (IS_STRING(cases[i].key)) {
+            uint32_t index = AS_STRING(cases[i].key)->hash & (table->string_capacity - 1);
+            while (!IS_NIL(table->strings[index].key)) {
+                index = (index + 1) & (table->string_capacity - 1);
+            }
+            table->strings[index] = cases[i];
+        } else if (dense && as_integer(cases[i].key, &integer)) {
+            table->dense[integer - low] = cases[i].arm;
+        } else {
+            table->numbers[number++] = cases[i];
+        }
+    }
+    if (number_count > 1) qsort(table->numbers, number_count, sizeof(SwitchCase), compare_cases);
+}
+
+int instruction_length(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_SCOPED:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_INTRINSIC:
+        case OP_SWITCH:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            return 4;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return 5;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_FOR_RANGE_LONG:
+        case OP_FOR_LIST_LONG:
+            return 6;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalue_count;
+        }
+        case OP_CLOSURE_LONG: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[read_long(&chunk->code[offset + 1])]);
+            return 4 + 3 * function->upvalue_count;
+        }
+        default:
+            return 1;
+    }
+}
+
+// The three byte operand of a long instruction, high byte first.
+int read_long(uint8_t *operand) {
+    return (operand[0] << 16) | (operand[1] << 8) | operand[2];
+}
+
+// The two byte cache index that ends property and invoke instructions.
+int read_cache_index(uint8_t *operand) {
+    return (operand[0] << 8) | operand[1];
+}
+
+// The table of the OP_SWITCH instruction at offset.
+SwitchTable* switch_table(Chunk *chunk, int offset) {
+    return &chunk->switches[read_cache_index(&chunk->code[offset + 1])];
+}
+
+// Where the jump or loop instruction at offset goes.
+int jump_target(Chunk *chunk, int offset) {
+    uint8_t *code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_LOOP: return offset + 3 - ((code[1] << 8) | code[2]);
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            return offset + 4 + read_long(&code[1]);
+        case OP_LOOP_LONG: return offset + 4 - read_long(&code[1]);
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            return offset + 4 - ((code[2] << 8) | code[3]);
+        case OP_FOR_RANGE_LONG:
+        case OP_FOR_LIST_LONG:
+            return offset + 6 - ((code[4] << 8) | code[5]);
+        default: return offset + 3 + ((code[1] << 8) | code[2]);
+    }
+}
+
+// How many values the instruction at offset pops and then pushes.
+void stack_effect(Chunk *chunk, int offset, int *pops, int *pushes) {
+    uint8_t *code = &chunk->code[offset];
+    *pops = 0;
+    *pushes = 0;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_NEW_LIST:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS_LONG:
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_POP_SCOPED:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_SET_LOCAL_POP:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_METHOD_LONG:
+        case OP_SWITCH:
+            *pops = 1;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_GET_PROPERTY_LONG:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_GET_LIST:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_ADD_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_GET_LIST_NUMIDX:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_SET_LIST:
+        case OP_SET_LIST_NUMIDX:
+            *pops = 3;
+            *pushes = 1;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_SCOPED:
+            *pops = code[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_INTRINSIC:
+            *pops = code[2] + 1;
+            *pushes = 1;
+            break;
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            *pops = code[2] + 2;
+            *pushes = 1;
+            break;
+        default:
+            break;
+    }
+}
@@ -46,14 +46,211 @@ typedef enum {
     OP_GET_LIST,
     OP_SET_LIST,
     OP_MOD,
+    OP_GET_LOCAL_GET_LOCAL_ADD,
+    OP_GET_LOCAL_CONSTANT_ADD,
+    OP_GET_LOCAL_CONSTANT_SUBTRACT,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_SET_LOCAL_POP,
+    OP_ADD_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    OP_GET_LIST_NUMIDX,
+    OP_SET_LIST_NUMIDX,
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
+    OP_CONSTANT_LONG,
+    OP_GET_LOCAL_LONG,
+    OP_SET_LOCAL_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_GET_SUPER_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_LOOP_LONG,
+    OP_CLOSURE_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+    OP_INTRINSIC,
+    OP_CALL_SCOPED,
+    OP_POP_SCOPED,
+    OP_FOR_RANGE,
+    OP_FOR_LIST,
+    OP_SWITCH,
+    OP_JUMP_IF_TRUE,
+    OP_FOR_RANGE_LONG,
+    OP_FOR_LIST_LONG,
 } OpCode;
 
+typedef enum {
+    REG_MOVE,
+    REG_LOADK,
+    REG_LOADNIL,
+    REG_LOADTRUE,
+    REG_LOADFALSE,
+    REG_GET_GLOBAL,
+    REG_DEFINE_GLOBAL,
+    REG_SET_GLOBAL,
+    REG_GET_UPVALUE,
+    REG_SET_UPVALUE,
+    REG_GET_PROPERTY,
+    REG_SET_PROPERTY,
+    REG_GET_SUPER,
+    REG_EQUAL,
+    REG_GREATER,
+    REG_LESS,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_MOD,
+    REG_GREATERK,
+    REG_LESSK,
+    REG_ADDK,
+    REG_SUBTRACTK,
+    REG_NOT,
+    REG_NEGATE,
+    REG_PRINT,
+    REG_JUMP,
+    REG_JUMP_IF_FALSE,
+    REG_LOOP,
+    REG_CALL,
+    REG_INVOKE,
+    REG_SUPER_INVOKE,
+    REG_CLOSURE,
+    REG_CLOSE_UPVALUE,
+    REG_RETURN,
+    REG_CLASS,
+    REG_INHERIT,
+    REG_METHOD,
+    REG_NEW_LIST,
+    REG_GET_LIST,
+    REG_SET_LIST,
+    REG_TAIL_CALL,
+    REG_TAIL_INVOKE,
+    REG_TAIL_SUPER_INVOKE,
+    REG_BIT_AND,
+    REG_BIT_OR,
+    REG_BIT_XOR,
+    REG_SHIFT_LEFT,
+    REG_SHIFT_RIGHT,
+    REG_INTRINSIC,
+    REG_CALL_SCOPED,
+    REG_POP_SCOPED,
+    REG_FOR_RANGE,
+    REG_FOR_LIST,
+    REG_SWITCH,
+    REG_JUMP_IF_TRUE,
+    REG_LESS_JUMP_IF_FALSE,
+    REG_LESSK_JUMP_IF_FALSE,
+} RegisterOpCode;
+
+// How OP_CLOSURE captures each upvalue, the first byte of its operand.
+typedef enum {
+    CAPTURE_UPVALUE,    // one of the enclosing closure's upvalues
+    CAPTURE_LOCAL,      // a local of the enclosing function, shared
+    CAPTURE_VALUE,      // a local that is never assigned again, copied
+} CaptureKind;
+
+// The built-in natives, in the order init_vm defines them. A call to one
+// through its global compiles to OP_INTRINSIC, which computes the result
+// inline as long as the global still holds the native.
+typedef enum {
+    INTRINSIC_CLOCK,
+    INTRINSIC_SQRT,
+    INTRINSIC_FLOOR,
+    INTRINSIC_CEIL,
+    INTRINSIC_ABS,
+    INTRINSIC_SIN,
+    INTRINSIC_COS,
+    INTRINSIC_TAN,
+    INTRINSIC_ATAN,
+    INTRINSIC_EXP,
+    INTRINSIC_LOG,
+    INTRINSIC_POW,
+    INTRINSIC_ATAN2,
+    INTRINSIC_MIN,
+    INTRINSIC_MAX,
+    INTRINSIC_COUNT,
+} Intrinsic;
+
+// What a property access or invoke found for one kind of receiver. An
+// empty entry has no shape, so it never matches.
+typedef enum {
+    CACHE_EMPTY,
+    CACHE_FIELD,        // the field in slot
+    CACHE_METHOD,       // a method of klass that no field shadows
+    CACHE_ADD_FIELD,    // a new field, moving the instance to transition
+} CacheKind;
+
+typedef struct {
+    CacheKind kind;
+    int slot;
+    struct ObjShape *shape;
+    struct ObjClass *klass;
+    struct ObjClosure *method;
+    struct ObjShape *transition;
+} CacheEntry;
+
+// Every property access and invoke site has one. It holds an entry for
+// each receiver shape it has seen, up to INLINE_CACHE_WAYS, after which
+// the site is megamorphic and shares the VM-wide cache instead.
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+    int count;
+    bool megamorphic;
+#ifdef DEBUG_PROFILE_CACHES
+    uint64_t hits;
+    uint64_t misses;
+#endif
+    CacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+// A switch statement jumps to one of its arms through a table the engines
+// share. Integer keys that are close together index an array, strings are
+// hashed by identity since they are all interned, and any other numbers
+// are searched in order. Values no case matches go to the fallback arm,
+// the default case or else the end of the statement.
+typedef struct {
+    Value key;
+    int arm;
+} SwitchCase;
+
+typedef struct {
+    int arm_count;
+    int fallback;
+    int *targets;               // where each arm starts in the bytecode
+    int *register_targets;      // and in the register code
+    int64_t low;
+    int dense_count;
+    int *dense;                 // the arm for each integer from low on
+    SwitchCase *numbers;        // sorted, leaving out the dense keys
+    int number_count;
+    SwitchCase *strings;        // nil keys in the empty entries
+    int string_capacity;
+} SwitchTable;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    InlineCache *caches;
+    int cache_count;
+    int cache_capacity;
+    SwitchTable *switches;
+    int switch_count;
+    int switch_capacity;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
@@ -61,5 +258,15 @@ void free_chunk(Chunk *chunk);
 
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
 int add_constant(Chunk *chunk, Value value);
+int add_cache(Chunk *chunk);
+int add_switch(Chunk *chunk);
+void fill_switch(SwitchTable *table, SwitchCase *cases, int case_count, int *targets, int arm_count,
+                 int fallback);
+int instruction_length(Chunk *chunk, int offset);
+int read_long(uint8_t *operand);
+int read_cache_index(uint8_t *operand);
+SwitchTable* switch_table(Chunk *chunk, int offset);
+int jump_target(Chunk *chunk, int offset);
+void stack_effect(Chunk *chunk, int offset, int *pops, int *pushes);
 
 #endif
@@ -6,6 +6,9 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#define COMPUTED_GOTO
+#define QUICKENING
+#define JIT
 
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
@@ -13,11 +16,30 @@
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+#define DEBUG_PROFILE_OPCODES
+#define DEBUG_PROFILE_CACHES
+
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xFFFFFF
 
 #undef DEBUG_PRINT_CODE
 #undef DEBUG_TRACE_EXECUTION
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
+#undef DEBUG_PROFILE_OPCODES
+#undef DEBUG_PROFILE_CACHES
+
+// Labels as values are a GCC/Clang extension, fall back to the switch
+// dispatch loop everywhere else.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// The JIT writes x86-64 code for the NaN-boxed value layout into mmap'd
+// pages, so it needs all three.
+#if defined(JIT) && !(defined(NAN_BOXING) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)))
+#undef JIT
+#endif
 
 #endif
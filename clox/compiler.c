@@ -5,7 +5,9 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -25,6 +27,10 @@ typedef enum {
     PREC_AND,
     PREC_EQUALITY,
     PREC_COMPARISION,
+    PREC_BIT_OR,
+    PREC_BIT_XOR,
+    PREC_BIT_AND,
+    PREC_SHIFT,
     PREC_TERM,
     PREC_FACTOR,
     PREC_UNARY,
@@ -40,17 +46,33 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+// A captured local that is never assigned after its declaration is
+// copied into the closures that capture it instead of shared with them.
+// One whose every read only reaches a field of its value keeps that value
+// to itself, so an instance allocated for it can be reused once it goes
+// out of scope.
 typedef struct {
     Token name;
     int depth;
     bool is_captured;
+    bool is_assigned;
+    int reads;
+    int field_reads;
+    int allocation;     // The OP_CALL that initialises it, or -1
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool is_local;
 } Upvalue;
 
+// An OP_CLOSURE operand that captures a local, as CAPTURE_LOCAL until the
+// local goes out of scope and can be seen to be never assigned.
+typedef struct {
+    int offset;
+    int local;
+} CaptureSite;
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_INITIALIZER,
@@ -63,10 +85,28 @@ typedef struct Compiler {
     ObjFunction *function;
     FunctionType type;
     
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int local_count;
+    int local_capacity;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    
+    CaptureSite *capture_sites;
+    int capture_count;
+    int capture_capacity;
+    
+    int last_instruction;
+    int previous_instruction;
+    int last_jump_target;
+    
+    // Forward jumps are numbered in the order they are emitted. A jump
+    // that turns out to need more than 16 bits is remembered in
+    // long_jumps, and the function is compiled again with it in the long
+    // form.
+    int jump_count;
+    bool *long_jumps;
+    int long_jump_capacity;
+    bool jump_overflow;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -141,61 +181,248 @@ static void emit_byte(uint8_t byte) {
     write_chunk(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2) {
-    emit_byte(byte1);
-    emit_byte(byte2);
+static bool is_instruction(int offset, OpCode op) {
+    return offset != -1 && current_chunk()->code[offset] == op;
 }
 
-static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
+// A run of instructions can only be fused if nothing jumps into the
+// middle of it.
+static bool can_fuse(int offset) {
+    return offset != -1 && current->last_jump_target <= offset;
+}
+
+static void fuse(int offset, OpCode op, int length) {
+    Chunk *chunk = current_chunk();
+    chunk->code[offset] = op;
+    chunk->count = offset + length;
+    chunk->lines[chunk->count - 1] = parser.previous.line;
     
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    current->last_instruction = offset;
+    current->previous_instruction = -1;
+}
+
+static bool fuse_instruction(OpCode op) {
+    Chunk *chunk = current_chunk();
+    int last = current->last_instruction;
+    int previous = current->previous_instruction;
     
-    emit_byte((offset >> 8) & 0xFF);
-    emit_byte(offset & 0xFF);
+    switch (op) {
+        case OP_ADD:
+            if (is_instruction(previous, OP_GET_LOCAL) && is_instruction(last, OP_GET_LOCAL) && can_fuse(previous)) {
+                chunk->code[previous + 2] = chunk->code[last + 1];
+                fuse(previous, OP_GET_LOCAL_GET_LOCAL_ADD, 3);
+                return true;
+            }
+            if (is_instruction(previous, OP_GET_LOCAL) && is_instruction(last, OP_CONSTANT) && can_fuse(previous)) {
+                chunk->code[previous + 2] = chunk->code[last + 1];
+                fuse(previous, OP_GET_LOCAL_CONSTANT_ADD, 3);
+                return true;
+            }
+            return false;
+        case OP_SUBTRACT:
+            if (is_instruction(previous, OP_GET_LOCAL) && is_instruction(last, OP_CONSTANT) && can_fuse(previous)) {
+                chunk->code[previous + 2] = chunk->code[last + 1];
+                fuse(previous, OP_GET_LOCAL_CONSTANT_SUBTRACT, 3);
+                return true;
+            }
+            return false;
+        case OP_JUMP_IF_FALSE:
+            if (is_instruction(last, OP_LESS) && can_fuse(last)) {
+                fuse(last, OP_LESS_JUMP_IF_FALSE, 1);
+                return true;
+            }
+            return false;
+        case OP_POP:
+            if (is_instruction(last, OP_SET_LOCAL) && can_fuse(last)) {
+                fuse(last, OP_SET_LOCAL_POP, 2);
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+static void emit_op(OpCode op) {
+    if (fuse_instruction(op)) return;
+    
+    current->previous_instruction = current->last_instruction;
+    current->last_instruction = current_chunk()->count;
+    emit_byte(op);
+}
+
+static void emit_bytes(uint8_t op, uint8_t operand) {
+    emit_op(op);
+    emit_byte(operand);
+}
+
+static int mark_jump_target(void) {
+    current->last_jump_target = current_chunk()->count;
+    return current->last_jump_target;
+}
+
+static void emit_long(int operand) {
+    emit_byte((operand >> 16) & 0xFF);
+    emit_byte((operand >> 8) & 0xFF);
+    emit_byte(operand & 0xFF);
+}
+
+static OpCode long_form(OpCode op) {
+    switch (op) {
+        case OP_CONSTANT: return OP_CONSTANT_LONG;
+        case OP_GET_LOCAL: return OP_GET_LOCAL_LONG;
+        case OP_SET_LOCAL: return OP_SET_LOCAL_LONG;
+        case OP_GET_GLOBAL: return OP_GET_GLOBAL_LONG;
+        case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+        case OP_SET_GLOBAL: return OP_SET_GLOBAL_LONG;
+        case OP_GET_PROPERTY: return OP_GET_PROPERTY_LONG;
+        case OP_SET_PROPERTY: return OP_SET_PROPERTY_LONG;
+        case OP_GET_SUPER: return OP_GET_SUPER_LONG;
+        case OP_JUMP: return OP_JUMP_LONG;
+        case OP_JUMP_IF_FALSE: return OP_JUMP_IF_FALSE_LONG;
+        case OP_LOOP: return OP_LOOP_LONG;
+        case OP_CLOSURE: return OP_CLOSURE_LONG;
+        case OP_CLASS: return OP_CLASS_LONG;
+        case OP_METHOD: return OP_METHOD_LONG;
+        case OP_FOR_RANGE: return OP_FOR_RANGE_LONG;
+        case OP_FOR_LIST: return OP_FOR_LIST_LONG;
+        default: return op; // unreachable
+    }
+}
+
+// Emits an instruction with a one byte operand, or its long form if the
+// operand doesn't fit.
+static void emit_operand(OpCode op, int operand) {
+    if (operand <= UINT8_MAX) {
+        emit_bytes(op, (uint8_t) operand);
+    } else {
+        emit_op(long_form(op));
+        emit_long(operand);
+    }
+}
+
+// Property accesses and invokes end with the index of their inline cache.
+static void emit_cache(void) {
+    int cache = add_cache(current_chunk());
+    emit_byte((cache >> 8) & 0xFF);
+    emit_byte(cache & 0xFF);
+}
+
+static void emit_loop(int loop_start) {
+    int offset = current_chunk()->count - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_op(OP_LOOP);
+        emit_byte((offset >> 8) & 0xFF);
+        emit_byte(offset & 0xFF);
+        return;
+    }
+    
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
+    emit_op(OP_LOOP_LONG);
+    emit_long(offset);
 }
 
-static int emit_jump(uint8_t instruction) {
-    emit_byte(instruction);
-    emit_byte(0xFF);
-    emit_byte(0xFF);
+static bool is_long_jump(int jump) {
+    return jump > UINT16_MAX || (jump < current->long_jump_capacity && current->long_jumps[jump]);
+}
+
+// The short form keeps the jump's number in its operand until it is
+// patched, in case it has to be made long.
+static int emit_jump(OpCode instruction) {
+    int jump = current->jump_count++;
+    if (is_long_jump(jump)) {
+        emit_op(long_form(instruction));
+        emit_long(UINT24_MAX);
+        return current_chunk()->count - 3;
+    }
+    
+    emit_op(instruction);
+    emit_byte((jump >> 8) & 0xFF);
+    emit_byte(jump & 0xFF);
     return current_chunk()->count - 2;
 }
 
+static void mark_long_jump(int jump) {
+    if (jump >= current->long_jump_capacity) {
+        int old_capacity = current->long_jump_capacity;
+        current->long_jump_capacity = GROW_CAPACITY(jump + 1);
+        current->long_jumps = realloc(current->long_jumps, current->long_jump_capacity * sizeof(bool));
+        if (current->long_jumps == NULL) exit(1);
+        memset(current->long_jumps + old_capacity, 0, (current->long_jump_capacity - old_capacity) * sizeof(bool));
+    }
+    current->long_jumps[jump] = true;
+    current->jump_overflow = true;
+}
+
 static void emit_return(void) {
     if (current->type == TYPE_INITIALIZER) {
         emit_bytes(OP_GET_LOCAL, 0);
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
 
-    emit_byte(OP_RETURN);
+    emit_op(OP_RETURN);
 }
 
-static uint8_t make_constant(Value v) {
+static int make_constant(Value v) {
     int constant = add_constant(current_chunk(), v);
-    if (constant > UINT8_MAX) {
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
     
-    return (uint8_t) constant;
+    return constant;
 }
 
 static void emit_constant(Value v) {
-    emit_bytes(OP_CONSTANT, make_constant(v));
+    emit_operand(OP_CONSTANT, make_constant(v));
 }
 
 static void patch_jump(int offset) {
-    int jump = current_chunk()->count - offset - 2;
-    
-    if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+    Chunk *chunk = current_chunk();
+    uint8_t *code = &chunk->code[offset];
+    
+    if (code[-1] == OP_JUMP_LONG || code[-1] == OP_JUMP_IF_FALSE_LONG) {
+        int jump = chunk->count - offset - 3;
+        if (jump > UINT24_MAX) error("Too much code to jump over.");
+        code[0] = (jump >> 16) & 0xFF;
+        code[1] = (jump >> 8) & 0xFF;
+        code[2] = jump & 0xFF;
+    } else {
+        int jump = chunk->count - offset - 2;
+        if (jump > UINT16_MAX) mark_long_jump((code[0] << 8) | code[1]);
+        code[0] = (jump >> 8) & 0xFF;
+        code[1] = jump & 0xFF;
     }
-    
-    current_chunk()->code[offset] = (jump >> 8) & 0xFF;
-    current_chunk()->code[offset + 1] = jump & 0xFF;
+    mark_jump_target();
+}
+
+static void add_capture_site(int local) {
+    if (current->capture_capacity < current->capture_count + 1) {
+        int old_capacity = current->capture_capacity;
+        current->capture_capacity = GROW_CAPACITY(old_capacity);
+        current->capture_sites = GROW_ARRAY(CaptureSite, current->capture_sites, old_capacity,
+                                            current->capture_capacity);
+    }
+    CaptureSite *site = &current->capture_sites[current->capture_count++];
+    site->offset = current_chunk()->count;
+    site->local = local;
+}
+
+// The locals from first on are going out of scope, so closures that
+// capture one which was never assigned can copy it.
+static void settle_captures(int first) {
+    int kept = 0;
+    for (int i = 0; i < current->capture_count; i++) {
+        CaptureSite site = current->capture_sites[i];
+        if (site.local < first) {
+            current->capture_sites[kept++] = site;
+        } else if (!current->locals[site.local].is_assigned) {
+            current_chunk()->code[site.offset] = CAPTURE_VALUE;
+        }
+    }
+    current->capture_count = kept;
 }
 
 static void init_compiler(Compiler *compiler, FunctionType type) {
@@ -204,6 +431,18 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->last_instruction = -1;
+    compiler->previous_instruction = -1;
+    compiler->last_jump_target = 0;
+    compiler->jump_count = 0;
+    compiler->long_jumps = NULL;
+    compiler->long_jump_capacity = 0;
+    compiler->jump_overflow = false;
+    compiler->capture_sites = NULL;
+    compiler->capture_count = 0;
+    compiler->capture_capacity = 0;
+    compiler->locals = GROW_ARRAY(Local, NULL, 0, UINT8_COUNT);
+    compiler->local_capacity = UINT8_COUNT;
     compiler->function = new_function();
     current = compiler;
     if (type != TYPE_SCRIPT) {
@@ -213,6 +452,10 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
     Local *local = &current->locals[current->local_count++];
     local->depth = 0;
     local->is_captured = false;
+    local->is_assigned = false;
+    local->reads = 0;
+    local->field_reads = 0;
+    local->allocation = -1;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -222,16 +465,734 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
     }
 }
 
+typedef enum {
+    SOURCE_REGISTER,
+    SOURCE_LOCAL,
+    SOURCE_CONSTANT,
+    SOURCE_NIL,
+    SOURCE_TRUE,
+    SOURCE_FALSE,
+} SourceKind;
+
+// Where the value in a stack slot really lives. Pushes of locals and
+// constants are only materialized into their slot when something needs them
+// there, so most of them turn into instruction operands instead.
+typedef struct {
+    SourceKind kind;
+    uint8_t index;
+} Source;
+
+#define TARGET_JUMP 0x1
+#define TARGET_LOOP 0x2
+
+typedef struct {
+    Chunk *chunk;
+    Chunk *code;
+    Source sources[UINT8_COUNT];
+    int depth;
+    int max_depth;
+    int line;
+    bool reachable;
+    bool failed;
+    int last_write;
+    
+    uint8_t *targets;
+    int *labels;
+    int *label_depths;
+    int *patches;
+    int *patch_targets;
+    int patch_count;
+} RegisterEmitter;
+
+static void emit_register_byte(RegisterEmitter *e, uint8_t byte) {
+    write_chunk(e->code, byte, e->line);
+}
+
+static void emit_register_op(RegisterEmitter *e, RegisterOpCode op) {
+    e->last_write = -1;
+    emit_register_byte(e, op);
+}
+
+// Instructions that read all of their operands before writing the
+// destination register, so the destination can be redirected to a local.
+static void emit_register_result(RegisterEmitter *e, RegisterOpCode op) {
+    e->last_write = e->code->count;
+    emit_register_byte(e, op);
+}
+
+static void push_source(RegisterEmitter *e, SourceKind kind, int index) {
+    if (e->depth == UINT8_COUNT) {
+        e->failed = true;
+        return;
+    }
+    
+    e->sources[e->depth].kind = kind;
+    e->sources[e->depth].index = (uint8_t) index;
+    e->depth++;
+    if (e->depth > e->max_depth) e->max_depth = e->depth;
+}
+
+static void push_register(RegisterEmitter *e) {
+    push_source(e, SOURCE_REGISTER, e->depth);
+}
+
+static void set_register(RegisterEmitter *e, int slot) {
+    e->sources[slot].kind = SOURCE_REGISTER;
+    e->sources[slot].index = (uint8_t) slot;
+}
+
+static void emit_load(RegisterEmitter *e, Source source, int slot) {
+    switch (source.kind) {
+        case SOURCE_REGISTER:
+        case SOURCE_LOCAL:
+            if (source.index == slot) return;
+            emit_register_result(e, REG_MOVE);
+            emit_register_byte(e, slot);
+            emit_register_byte(e, source.index);
+            return;
+        case SOURCE_CONSTANT:
+            emit_register_result(e, REG_LOADK);
+            emit_register_byte(e, slot);
+            emit_register_byte(e, source.index);
+            return;
+        case SOURCE_NIL:   emit_register_result(e, REG_LOADNIL); break;
+        case SOURCE_TRUE:  emit_register_result(e, REG_LOADTRUE); break;
+        case SOURCE_FALSE: emit_register_result(e, REG_LOADFALSE); break;
+    }
+    emit_register_byte(e, slot);
+}
+
+static void materialize(RegisterEmitter *e, int slot) {
+    if (e->sources[slot].kind == SOURCE_REGISTER) return;
+    emit_load(e, e->sources[slot], slot);
+    set_register(e, slot);
+}
+
+static void materialize_all(RegisterEmitter *e) {
+    for (int slot = 0; slot < e->depth; slot++) {
+        materialize(e, slot);
+    }
+}
+
+static uint8_t register_operand(RegisterEmitter *e, int slot) {
+    if (e->sources[slot].kind == SOURCE_LOCAL) return e->sources[slot].index;
+    materialize(e, slot);
+    return (uint8_t) slot;
+}
+
+static void translate_get_local(RegisterEmitter *e, int local) {
+    if (local >= e->depth) {
+        e->failed = true;
+        return;
+    }
+    
+    materialize(e, local);
+    push_source(e, SOURCE_LOCAL, local);
+}
+
+static void translate_set_local(RegisterEmitter *e, int local) {
+    int top = e->depth - 1;
+    if (local >= top) {
+        e->failed = true;
+        return;
+    }
+    
+    // Copies of the old value still waiting on the stack have to be made
+    // before it is overwritten.
+    for (int slot = local + 1; slot < top; slot++) {
+        if (e->sources[slot].kind == SOURCE_LOCAL && e->sources[slot].index == local) {
+            materialize(e, slot);
+        }
+    }
+    
+    Source *value = &e->sources[top];
+    if (value->kind == SOURCE_REGISTER && e->last_write != -1 && e->code->code[e->last_write + 1] == top) {
+        e->code->code[e->last_write + 1] = (uint8_t) local;
+    } else {
+        emit_load(e, *value, local);
+    }
+    
+    // The local may still be waiting to be loaded from its initializer.
+    set_register(e, local);
+    value->kind = SOURCE_LOCAL;
+    value->index = (uint8_t) local;
+    e->last_write = -1;
+}
+
+static void translate_unary(RegisterEmitter *e, RegisterOpCode op) {
+    int slot = e->depth - 1;
+    uint8_t source = register_operand(e, slot);
+    emit_register_result(e, op);
+    emit_register_byte(e, slot);
+    emit_register_byte(e, source);
+    set_register(e, slot);
+}
+
+static void translate_binary(RegisterEmitter *e, RegisterOpCode op, int constant_op) {
+    int slot = e->depth - 2;
+    uint8_t left = register_operand(e, slot);
+    
+    if (constant_op != -1 && e->sources[slot + 1].kind == SOURCE_CONSTANT) {
+        emit_register_result(e, constant_op);
+        emit_register_byte(e, slot);
+        emit_register_byte(e, left);
+        emit_register_byte(e, e->sources[slot + 1].index);
+    } else {
+        uint8_t right = register_operand(e, slot + 1);
+        emit_register_result(e, op);
+        emit_register_byte(e, slot);
+        emit_register_byte(e, left);
+        emit_register_byte(e, right);
+    }
+    
+    e->depth--;
+    set_register(e, slot);
+}
+
+// Every way into a label has to leave the stack at the same depth.
+static void join_label(RegisterEmitter *e, int target) {
+    if (e->label_depths[target] == -1) {
+        e->label_depths[target] = e->depth;
+    } else if (e->label_depths[target] != e->depth) {
+        e->failed = true;
+    }
+}
+
+static void translate_jump(RegisterEmitter *e, int target) {
+    join_label(e, target);
+    e->patches[e->patch_count] = e->code->count;
+    e->patch_targets[e->patch_count++] = target;
+    emit_register_byte(e, 0xFF);
+    emit_register_byte(e, 0xFF);
+}
+
+static void translate_conditional_jump(RegisterEmitter *e, RegisterOpCode op, int target) {
+    materialize_all(e);
+    emit_register_op(e, op);
+    emit_register_byte(e, e->depth - 1);
+    translate_jump(e, target);
+}
+
+// The comparison takes the jump along as long as nothing further down the
+// stack still has to be materialized in between.
+static void translate_less_jump_if_false(RegisterEmitter *e, int target) {
+    translate_binary(e, REG_LESS, REG_LESSK);
+    int compare = e->last_write;
+    int end = e->code->count;
+    materialize_all(e);
+    if (e->code->count != end) {
+        emit_register_op(e, REG_JUMP_IF_FALSE);
+        emit_register_byte(e, e->depth - 1);
+        translate_jump(e, target);
+        return;
+    }
+    
+    uint8_t *op = &e->code->code[compare];
+    *op = *op == REG_LESSK ? REG_LESSK_JUMP_IF_FALSE : REG_LESS_JUMP_IF_FALSE;
+    e->last_write = -1;
+    translate_jump(e, target);
+}
+
+// Invokes carry their name and cache operands along.
+static void translate_call(RegisterEmitter *e, RegisterOpCode op, int arg_count, int extra, int name, uint8_t *cache) {
+    materialize_all(e);
+    int base = e->depth - arg_count - extra - 1;
+    emit_register_op(e, op);
+    emit_register_byte(e, base);
+    if (name != -1) emit_register_byte(e, name);
+    emit_register_byte(e, arg_count);
+    if (cache != NULL) {
+        emit_register_byte(e, cache[0]);
+        emit_register_byte(e, cache[1]);
+    }
+    e->depth = base + 1;
+    set_register(e, base);
+}
+
+static void translate_instruction(RegisterEmitter *e, int offset) {
+    uint8_t *code = &e->chunk->code[offset];
+    int top = e->depth - 1;
+    
+    switch (code[0]) {
+        case OP_CONSTANT: push_source(e, SOURCE_CONSTANT, code[1]); break;
+        case OP_NIL: push_source(e, SOURCE_NIL, 0); break;
+        case OP_TRUE: push_source(e, SOURCE_TRUE, 0); break;
+        case OP_FALSE: push_source(e, SOURCE_FALSE, 0); break;
+        case OP_POP: e->depth--; break;
+        case OP_GET_LOCAL: translate_get_local(e, code[1]); break;
+        case OP_SET_LOCAL: translate_set_local(e, code[1]); break;
+        case OP_GET_GLOBAL:
+            emit_register_result(e, REG_GET_GLOBAL);
+            emit_register_byte(e, e->depth);
+            emit_register_byte(e, code[1]);
+            push_register(e);
+            break;
+        case OP_DEFINE_GLOBAL: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_DEFINE_GLOBAL);
+            emit_register_byte(e, value);
+            emit_register_byte(e, code[1]);
+            e->depth--;
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_SET_GLOBAL);
+            emit_register_byte(e, value);
+            emit_register_byte(e, code[1]);
+            break;
+        }
+        case OP_GET_UPVALUE:
+            emit_register_result(e, REG_GET_UPVALUE);
+            emit_register_byte(e, e->depth);
+            emit_register_byte(e, code[1]);
+            push_register(e);
+            break;
+        case OP_SET_UPVALUE: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_SET_UPVALUE);
+            emit_register_byte(e, value);
+            emit_register_byte(e, code[1]);
+            break;
+        }
+        case OP_GET_PROPERTY: {
+            uint8_t object = register_operand(e, top);
+            emit_register_op(e, REG_GET_PROPERTY);
+            emit_register_byte(e, top);
+            emit_register_byte(e, object);
+            emit_register_byte(e, code[1]);
+            emit_register_byte(e, code[2]);
+            emit_register_byte(e, code[3]);
+            set_register(e, top);
+            break;
+        }
+        case OP_SET_PROPERTY: {
+            uint8_t object = register_operand(e, top - 1);
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_SET_PROPERTY);
+            emit_register_byte(e, top - 1);
+            emit_register_byte(e, object);
+            emit_register_byte(e, value);
+            emit_register_byte(e, code[1]);
+            emit_register_byte(e, code[2]);
+            emit_register_byte(e, code[3]);
+            e->depth--;
+            set_register(e, top - 1);
+            break;
+        }
+        case OP_GET_SUPER: {
+            uint8_t receiver = register_operand(e, top - 1);
+            uint8_t superclass = register_operand(e, top);
+            emit_register_op(e, REG_GET_SUPER);
+            emit_register_byte(e, top - 1);
+            emit_register_byte(e, receiver);
+            emit_register_byte(e, superclass);
+            emit_register_byte(e, code[1]);
+            e->depth--;
+            set_register(e, top - 1);
+            break;
+        }
+        case OP_EQUAL: translate_binary(e, REG_EQUAL, -1); break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            translate_binary(e, REG_GREATER, REG_GREATERK);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            translate_binary(e, REG_LESS, REG_LESSK);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            translate_binary(e, REG_ADD, REG_ADDK);
+            break;
+        case OP_SUBTRACT: translate_binary(e, REG_SUBTRACT, REG_SUBTRACTK); break;
+        case OP_MULTIPLY: translate_binary(e, REG_MULTIPLY, -1); break;
+        case OP_DIVIDE: translate_binary(e, REG_DIVIDE, -1); break;
+        case OP_MOD: translate_binary(e, REG_MOD, -1); break;
+        case OP_BIT_AND: translate_binary(e, REG_BIT_AND, -1); break;
+        case OP_BIT_OR: translate_binary(e, REG_BIT_OR, -1); break;
+        case OP_BIT_XOR: translate_binary(e, REG_BIT_XOR, -1); break;
+        case OP_SHIFT_LEFT: translate_binary(e, REG_SHIFT_LEFT, -1); break;
+        case OP_SHIFT_RIGHT: translate_binary(e, REG_SHIFT_RIGHT, -1); break;
+        case OP_NOT: translate_unary(e, REG_NOT); break;
+        case OP_NEGATE: translate_unary(e, REG_NEGATE); break;
+        case OP_PRINT: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_PRINT);
+            emit_register_byte(e, value);
+            e->depth--;
+            break;
+        }
+        case OP_JUMP:
+            materialize_all(e);
+            emit_register_op(e, REG_JUMP);
+            translate_jump(e, jump_target(e->chunk, offset));
+            e->reachable = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+            translate_conditional_jump(e, REG_JUMP_IF_FALSE, jump_target(e->chunk, offset));
+            break;
+        case OP_JUMP_IF_TRUE:
+            translate_conditional_jump(e, REG_JUMP_IF_TRUE, jump_target(e->chunk, offset));
+            break;
+        case OP_LOOP: {
+            int target = jump_target(e->chunk, offset);
+            materialize_all(e);
+            if (e->label_depths[target] != e->depth) e->failed = true;
+            emit_register_op(e, REG_LOOP);
+            int jump = e->code->count + 2 - e->labels[target];
+            if (jump > UINT16_MAX) e->failed = true;
+            emit_register_byte(e, (jump >> 8) & 0xFF);
+            emit_register_byte(e, jump & 0xFF);
+            e->reachable = false;
+            break;
+        }
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST: {
+            int target = jump_target(e->chunk, offset);
+            materialize_all(e);
+            if (e->label_depths[target] != e->depth) e->failed = true;
+            emit_register_op(e, code[0] == OP_FOR_RANGE ? REG_FOR_RANGE : REG_FOR_LIST);
+            emit_register_byte(e, code[1]);
+            int jump = e->code->count + 2 - e->labels[target];
+            if (jump > UINT16_MAX) e->failed = true;
+            emit_register_byte(e, (jump >> 8) & 0xFF);
+            emit_register_byte(e, jump & 0xFF);
+            break;
+        }
+        // The arms' places in the register code go in the table once they
+        // are all known.
+        case OP_SWITCH: {
+            SwitchTable *table = switch_table(e->chunk, offset);
+            uint8_t value = register_operand(e, top);
+            e->depth--;
+            materialize_all(e);
+            emit_register_op(e, REG_SWITCH);
+            emit_register_byte(e, value);
+            emit_register_byte(e, code[1]);
+            emit_register_byte(e, code[2]);
+            for (int arm = 0; arm < table->arm_count; arm++) {
+                join_label(e, table->targets[arm]);
+            }
+            e->reachable = false;
+            break;
+        }
+        case OP_CALL: translate_call(e, REG_CALL, code[1], 0, -1, NULL); break;
+        case OP_INTRINSIC: translate_call(e, REG_INTRINSIC, code[2], 0, code[1], NULL); break;
+        case OP_CALL_SCOPED: translate_call(e, REG_CALL_SCOPED, code[1], 0, -1, NULL); break;
+        case OP_POP_SCOPED: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_POP_SCOPED);
+            emit_register_byte(e, value);
+            e->depth--;
+            break;
+        }
+        case OP_INVOKE: translate_call(e, REG_INVOKE, code[2], 0, code[1], &code[3]); break;
+        case OP_SUPER_INVOKE: translate_call(e, REG_SUPER_INVOKE, code[2], 1, code[1], NULL); break;
+        case OP_TAIL_CALL:
+            translate_call(e, REG_TAIL_CALL, code[1], 0, -1, NULL);
+            e->reachable = false;
+            break;
+        case OP_TAIL_INVOKE:
+            translate_call(e, REG_TAIL_INVOKE, code[2], 0, code[1], &code[3]);
+            e->reachable = false;
+            break;
+        case OP_TAIL_SUPER_INVOKE:
+            translate_call(e, REG_TAIL_SUPER_INVOKE, code[2], 1, code[1], NULL);
+            e->reachable = false;
+            break;
+        case OP_CLOSURE: {
+            materialize_all(e);
+            emit_register_op(e, REG_CLOSURE);
+            emit_register_byte(e, e->depth);
+            emit_register_byte(e, code[1]);
+            int length = instruction_length(e->chunk, offset);
+            for (int i = 2; i < length; i++) {
+                emit_register_byte(e, code[i]);
+            }
+            push_register(e);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(e, top);
+            emit_register_op(e, REG_CLOSE_UPVALUE);
+            emit_register_byte(e, top);
+            e->depth--;
+            break;
+        case OP_RETURN: {
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_RETURN);
+            emit_register_byte(e, value);
+            e->reachable = false;
+            break;
+        }
+        case OP_CLASS:
+            emit_register_op(e, REG_CLASS);
+            emit_register_byte(e, e->depth);
+            emit_register_byte(e, code[1]);
+            push_register(e);
+            break;
+        case OP_INHERIT: {
+            uint8_t superclass = register_operand(e, top - 1);
+            uint8_t subclass = register_operand(e, top);
+            emit_register_op(e, REG_INHERIT);
+            emit_register_byte(e, superclass);
+            emit_register_byte(e, subclass);
+            e->depth--;
+            break;
+        }
+        case OP_METHOD: {
+            uint8_t klass = register_operand(e, top - 1);
+            uint8_t method = register_operand(e, top);
+            emit_register_op(e, REG_METHOD);
+            emit_register_byte(e, klass);
+            emit_register_byte(e, method);
+            emit_register_byte(e, code[1]);
+            e->depth--;
+            break;
+        }
+        case OP_NEW_LIST:
+            emit_register_op(e, REG_NEW_LIST);
+            emit_register_byte(e, e->depth);
+            push_register(e);
+            break;
+        case OP_GET_LIST:
+        case OP_GET_LIST_NUMIDX:
+            translate_binary(e, REG_GET_LIST, -1);
+            break;
+        case OP_SET_LIST:
+        case OP_SET_LIST_NUMIDX: {
+            uint8_t list = register_operand(e, top - 2);
+            uint8_t index = register_operand(e, top - 1);
+            uint8_t value = register_operand(e, top);
+            emit_register_op(e, REG_SET_LIST);
+            emit_register_byte(e, top - 2);
+            emit_register_byte(e, list);
+            emit_register_byte(e, index);
+            emit_register_byte(e, value);
+            e->depth -= 2;
+            set_register(e, top - 2);
+            break;
+        }
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            translate_get_local(e, code[1]);
+            translate_get_local(e, code[2]);
+            translate_binary(e, REG_ADD, REG_ADDK);
+            break;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            translate_get_local(e, code[1]);
+            push_source(e, SOURCE_CONSTANT, code[2]);
+            translate_binary(e, REG_ADD, REG_ADDK);
+            break;
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            translate_get_local(e, code[1]);
+            push_source(e, SOURCE_CONSTANT, code[2]);
+            translate_binary(e, REG_SUBTRACT, REG_SUBTRACTK);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            translate_less_jump_if_false(e, jump_target(e->chunk, offset));
+            break;
+        case OP_SET_LOCAL_POP:
+            translate_set_local(e, code[1]);
+            e->depth--;
+            break;
+        default:
+            e->failed = true;
+            break;
+    }
+    
+    if (e->depth < 0) e->failed = true;
+}
+
+// Jump targets start a new block: everything on the stack is in its own
+// register there, whichever way control arrived.
+static void enter_label(RegisterEmitter *e, int offset) {
+    if (e->reachable) {
+        materialize_all(e);
+        if (e->label_depths[offset] == -1) {
+            e->label_depths[offset] = e->depth;
+        } else if (e->label_depths[offset] != e->depth) {
+            e->failed = true;
+        }
+    } else if (e->label_depths[offset] != -1 || (e->targets[offset] & TARGET_LOOP)) {
+        // A block only entered by a backward jump, like the increment clause
+        // of a for loop, starts at the depth control fell away at. The jump
+        // back to it checks that guess.
+        if (e->label_depths[offset] == -1) e->label_depths[offset] = e->depth;
+        e->reachable = true;
+        e->depth = e->label_depths[offset];
+        for (int slot = 0; slot < e->depth; slot++) {
+            set_register(e, slot);
+        }
+    }
+    
+    e->labels[offset] = e->code->count;
+    e->last_write = -1;
+}
+
+// Translates the finished stack bytecode of a function into three-address
+// register code, where register n is stack slot n of the frame. Functions
+// it can't express keep running on the stack VM.
+static void emit_register_code(ObjFunction *function) {
+    RegisterEmitter e;
+    e.chunk = &function->chunk;
+    e.code = &function->register_code;
+    e.depth = 0;
+    e.max_depth = 0;
+    e.line = 0;
+    e.reachable = true;
+    e.failed = false;
+    e.last_write = -1;
+    e.patch_count = 0;
+    
+    int count = e.chunk->count;
+    e.targets = calloc(count, sizeof(uint8_t));
+    e.labels = malloc(count * sizeof(int));
+    e.label_depths = malloc(count * sizeof(int));
+    e.patches = malloc(count * sizeof(int));
+    e.patch_targets = malloc(count * sizeof(int));
+    
+    for (int offset = 0; offset < count; offset += instruction_length(e.chunk, offset)) {
+        uint8_t *code = &e.chunk->code[offset];
+        e.labels[offset] = -1;
+        e.label_depths[offset] = -1;
+        switch (code[0]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+                e.targets[jump_target(e.chunk, offset)] |= TARGET_JUMP;
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+            case OP_FOR_RANGE:
+            case OP_FOR_LIST:
+            case OP_FOR_RANGE_LONG:
+            case OP_FOR_LIST_LONG:
+                e.targets[jump_target(e.chunk, offset)] |= TARGET_LOOP;
+                break;
+            case OP_SWITCH: {
+                SwitchTable *table = switch_table(e.chunk, offset);
+                for (int arm = 0; arm < table->arm_count; arm++) {
+                    e.targets[table->targets[arm]] |= TARGET_JUMP;
+                }
+                break;
+            }
+        }
+    }
+    
+    for (int slot = 0; slot <= function->arity; slot++) {
+        push_register(&e);
+    }
+    
+    for (int offset = 0; offset < count && !e.failed; offset += instruction_length(e.chunk, offset)) {
+        e.line = e.chunk->lines[offset];
+        if (e.targets[offset]) enter_label(&e, offset);
+        if (e.reachable) translate_instruction(&e, offset);
+    }
+    
+    for (int i = 0; i < e.patch_count && !e.failed; i++) {
+        int jump = e.labels[e.patch_targets[i]] - e.patches[i] - 2;
+        if (jump > UINT16_MAX) e.failed = true;
+        e.code->code[e.patches[i]] = (jump >> 8) & 0xFF;
+        e.code->code[e.patches[i] + 1] = jump & 0xFF;
+    }
+    // The optimizer can leave tables behind whose switch it removed.
+    for (int offset = 0; offset < count && !e.failed; offset += instruction_length(e.chunk, offset)) {
+        if (e.chunk->code[offset] != OP_SWITCH) continue;
+        SwitchTable *table = switch_table(e.chunk, offset);
+        for (int arm = 0; arm < table->arm_count; arm++) {
+            table->register_targets[arm] = e.labels[table->targets[arm]];
+        }
+    }
+    
+    if (e.failed) {
+        free_chunk(e.code);
+    } else {
+        function->register_count = e.max_depth;
+    }
+    
+    free(e.targets);
+    free(e.labels);
+    free(e.label_depths);
+    free(e.patches);
+    free(e.patch_targets);
+}
+
+// The most stack slots a call to the function can occupy, counting the
+// callee and its arguments, so the VM can make room before it starts. Two
+// spare slots cover the operands the register engine pushes to
+// concatenate strings.
+static int count_max_slots(ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    int *heights = ALLOCATE(int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++) {
+        heights[offset] = -1;
+    }
+    
+    int height = function->arity + 1;
+    int max = height;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        if (heights[offset] > height) height = heights[offset];
+        
+        int pops;
+        int pushes;
+        stack_effect(chunk, offset, &pops, &pushes);
+        height += pushes - pops;
+        if (height > max) max = height;
+        
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE || code[0] == OP_JUMP_IF_TRUE ||
+            code[0] == OP_LESS_JUMP_IF_FALSE || code[0] == OP_JUMP_LONG || code[0] == OP_JUMP_IF_FALSE_LONG) {
+            int target = jump_target(chunk, offset);
+            if (heights[target] < height) heights[target] = height;
+        }
+        if (code[0] == OP_SWITCH) {
+            SwitchTable *table = switch_table(chunk, offset);
+            for (int arm = 0; arm < table->arm_count; arm++) {
+                int target = table->targets[arm];
+                if (heights[target] < height) heights[target] = height;
+            }
+        }
+    }
+    
+    FREE_ARRAY(int, heights, chunk->count);
+    if (function->register_count > max) max = function->register_count;
+    return max + 2;
+}
+
+static bool keeps_value(Local *local) {
+    return !local->is_captured && !local->is_assigned && local->reads == local->field_reads;
+}
+
 static ObjFunction* end_compiler(void) {
     emit_return();
+    settle_captures(0);
     ObjFunction *function = current->function;
     
+    if (current->type == TYPE_INITIALIZER) {
+        function->leaks_this = !keeps_value(&current->locals[0]);
+    }
+    
+    // A function with an overflowed jump is about to be compiled again.
+    bool finished = !parser.had_error && !current->jump_overflow;
+    if (finished) optimize_function(function);
+    if (vm.use_registers && finished) {
+        emit_register_code(function);
+    }
+    if (finished) function->max_slots = count_max_slots(function);
+    
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error) {
+    if (finished) {
         disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        if (function->register_code.count > 0) disassemble_register_code(function);
     }
 #endif
     
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
+    FREE_ARRAY(CaptureSite, current->capture_sites, current->capture_capacity);
     current = current->enclosing;
     return function;
 }
@@ -243,11 +1204,19 @@ static void begin_scope(void) {
 static void end_scope(void) {
     current->scope_depth--;
     
+    int first = current->local_count;
+    while (first > 0 && current->locals[first - 1].depth > current->scope_depth) first--;
+    settle_captures(first);
+    
     while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
-        if (current->locals[current->local_count - 1].is_captured) {
-            emit_byte(OP_CLOSE_UPVALUE);
+        Local *local = &current->locals[current->local_count - 1];
+        if (local->is_captured && local->is_assigned) {
+            emit_op(OP_CLOSE_UPVALUE);
+        } else if (local->allocation != -1 && keeps_value(local)) {
+            current_chunk()->code[local->allocation] = OP_CALL_SCOPED;
+            emit_op(OP_POP_SCOPED);
         } else {
-            emit_byte(OP_POP);
+            emit_op(OP_POP);
         }
         current->local_count--;
     }
@@ -259,7 +1228,7 @@ static void declaration(void);
 static ParseRule* get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 
-static uint8_t identifier_constant(Token *name) {
+static int identifier_constant(Token *name) {
     return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
@@ -282,7 +1251,7 @@ static int resolve_local(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Compiler *compiler, int index, bool is_local) {
     int upvalue_count = compiler->function->upvalue_count;
     
     for (int i = 0; i < upvalue_count; i++) {
@@ -298,7 +1267,7 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
     }
     
     compiler->upvalues[upvalue_count].is_local = is_local;
-    compiler->upvalues[upvalue_count].index = index;
+    compiler->upvalues[upvalue_count].index = (uint16_t) index;
     return compiler->function->upvalue_count++;
 }
 
@@ -308,27 +1277,47 @@ static int resolve_upvalue(Compiler *compiler, Token *name) {
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t) local, true);
+        return add_upvalue(compiler, local, true);
     }
     
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8_t) upvalue, false);
+        return add_upvalue(compiler, upvalue, false);
     }
     
     return -1;
 }
 
+// Follows an assigned upvalue back to the local it captures.
+static void mark_assigned(Compiler *compiler, int upvalue) {
+    Upvalue *captured = &compiler->upvalues[upvalue];
+    if (captured->is_local) {
+        compiler->enclosing->locals[captured->index].is_assigned = true;
+    } else {
+        mark_assigned(compiler->enclosing, captured->index);
+    }
+}
+
 static void add_local(Token name) {
-    if (current->local_count == UINT8_COUNT) {
+    if (current->local_count == UINT16_COUNT) {
         error("Too many local variables in function.");
         return;
     }
     
+    if (current->local_count == current->local_capacity) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals, old_capacity, current->local_capacity);
+    }
+    
     Local *local = &current->locals[current->local_count++];
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
+    local->is_assigned = false;
+    local->reads = 0;
+    local->field_reads = 0;
+    local->allocation = -1;
 }
 
 static void declare_variable(void) {
@@ -349,7 +1338,7 @@ static void declare_variable(void) {
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char *error_message) {
+static int parse_variable(const char *error_message) {
     consume(TOKEN_IDENTIFIER, error_message);
     
     declare_variable();
@@ -363,13 +1352,14 @@ static void mark_initialised(void) {
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
     if (current->scope_depth > 0) {
         mark_initialised();
         return;
     }
     
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    define_global_slot(AS_STRING(current_chunk()->constants.values[global]));
+    emit_operand(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list(void) {
@@ -390,7 +1380,7 @@ static uint8_t argument_list(void) {
 static void and_(bool can_assign) {
     int end_jump = emit_jump(OP_JUMP_IF_FALSE);
     
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     parse_precedence(PREC_AND);
     
     patch_jump(end_jump);
@@ -402,60 +1392,100 @@ static void binary(bool can_assign) {
     parse_precedence((Precedence) (rule->precedence + 1));
     
     switch (operator_type) {
-        case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emit_byte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emit_byte(OP_ADD); break;
-        case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emit_byte(OP_DIVIDE); break;
-        case TOKEN_MOD:           emit_byte(OP_MOD); break;
+        case TOKEN_BANG_EQUAL:    emit_op(OP_EQUAL); emit_op(OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emit_op(OP_EQUAL); break;
+        case TOKEN_GREATER:       emit_op(OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emit_op(OP_LESS); emit_op(OP_NOT); break;
+        case TOKEN_LESS:          emit_op(OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emit_op(OP_GREATER); emit_op(OP_NOT); break;
+        case TOKEN_PLUS:          emit_op(OP_ADD); break;
+        case TOKEN_MINUS:         emit_op(OP_SUBTRACT); break;
+        case TOKEN_STAR:          emit_op(OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emit_op(OP_DIVIDE); break;
+        case TOKEN_MOD:           emit_op(OP_MOD); break;
+        case TOKEN_AMPERSAND:     emit_op(OP_BIT_AND); break;
+        case TOKEN_PIPE:          emit_op(OP_BIT_OR); break;
+        case TOKEN_CARET:         emit_op(OP_BIT_XOR); break;
+        case TOKEN_LESS_LESS:     emit_op(OP_SHIFT_LEFT); break;
+        case TOKEN_GREATER_GREATER: emit_op(OP_SHIFT_RIGHT); break;
         default: return; // unreachable
     }
 }
 
+// A call to a built-in native through its global becomes OP_INTRINSIC,
+// which checks the callee it finds on the stack before computing the
+// result inline.
 static void call(bool can_assign) {
+    int callee = current->last_instruction;
     uint8_t arg_count = argument_list();
+    if (is_instruction(callee, OP_GET_GLOBAL)) {
+        ObjString *name = AS_STRING(current_chunk()->constants.values[current_chunk()->code[callee + 1]]);
+        int intrinsic = find_intrinsic(name, arg_count);
+        if (intrinsic != -1) {
+            emit_bytes(OP_INTRINSIC, intrinsic);
+            emit_byte(arg_count);
+            return;
+        }
+    }
     emit_bytes(OP_CALL, arg_count);
 }
 
+// Notes a read of a local that only reaches one of its fields.
+static void read_field(int receiver) {
+    if (is_instruction(receiver, OP_GET_LOCAL)) {
+        current->locals[current_chunk()->code[receiver + 1]].field_reads++;
+    }
+}
+
 static void dot(bool can_assign) {
+    int receiver = current->last_instruction;
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&parser.previous);
+    int name = identifier_constant(&parser.previous);
     
     if (can_assign && match(TOKEN_EQUAL)) {
+        read_field(receiver);
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_operand(OP_SET_PROPERTY, name);
+        emit_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
+        if (name > UINT8_MAX) {
+            // There is no long form of invoke, so look the method up first.
+            emit_operand(OP_GET_PROPERTY, name);
+            emit_cache();
+            uint8_t arg_count = argument_list();
+            emit_bytes(OP_CALL, arg_count);
+            return;
+        }
+        
         uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
+        emit_bytes(OP_INVOKE, (uint8_t) name);
         emit_byte(arg_count);
+        emit_cache();
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        read_field(receiver);
+        emit_operand(OP_GET_PROPERTY, name);
+        emit_cache();
     }
 }
 
 static void literal(bool can_assign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-        case TOKEN_NIL:   emit_byte(OP_NIL); break;
-        case TOKEN_TRUE:  emit_byte(OP_TRUE); break;
+        case TOKEN_FALSE: emit_op(OP_FALSE); break;
+        case TOKEN_NIL:   emit_op(OP_NIL); break;
+        case TOKEN_TRUE:  emit_op(OP_TRUE); break;
         default: return; // unreachable
     }
 }
 
 static void list(bool can_assign) {
-    emit_byte(OP_NEW_LIST);
+    emit_op(OP_NEW_LIST);
 
-    double index = 0;
+    int index = 0;
     do {
         if (check(TOKEN_RIGHT_SQUARE_BRACKET)) break;
-        emit_constant(NUMBER_VAL(index++));
+        emit_constant(INT_VAL(index++));
         expression();
-        emit_byte(OP_SET_LIST);
+        emit_op(OP_SET_LIST);
     } while (match(TOKEN_COMMA));
 
     consume(TOKEN_RIGHT_SQUARE_BRACKET, "Expect ']' after list elements.");
@@ -467,9 +1497,9 @@ static void subscript(bool can_assign) {
     
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_byte(OP_SET_LIST);
+        emit_op(OP_SET_LIST);
     } else {
-        emit_byte(OP_GET_LIST);
+        emit_op(OP_GET_LIST);
     }
 }
 
@@ -478,9 +1508,17 @@ static void grouping(bool can_assign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+// Literals without a fraction are integers when they fit.
+static Value number_value(void) {
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL) {
+        long long v = strtoll(parser.previous.start, NULL, 10);
+        if (v <= INTEGER_MAX) return INT_VAL(v);
+    }
+    return NUMBER_VAL(strtod(parser.previous.start, NULL));
+}
+
 static void number(bool can_assign) {
-    double v = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(v));
+    emit_constant(number_value());
 }
 
 static void or_(bool can_assign) {
@@ -488,7 +1526,7 @@ static void or_(bool can_assign) {
     int end_jump = emit_jump(OP_JUMP);
     
     patch_jump(else_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     
     parse_precedence(PREC_OR);
     patch_jump(end_jump);
@@ -499,7 +1537,7 @@ static void string(bool can_assign) {
 }
 
 static void named_variable(Token name, bool can_assign) {
-    uint8_t get_op, set_op;
+    OpCode get_op, set_op;
     int arg = resolve_local(current, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
@@ -509,15 +1547,22 @@ static void named_variable(Token name, bool can_assign) {
         set_op = OP_SET_UPVALUE;
     } else {
         arg = identifier_constant(&name);
+        define_global_slot(AS_STRING(current_chunk()->constants.values[arg]));
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
     
     if (can_assign && match(TOKEN_EQUAL)) {
+        if (set_op == OP_SET_LOCAL) {
+            current->locals[arg].is_assigned = true;
+        } else if (set_op == OP_SET_UPVALUE) {
+            mark_assigned(current, arg);
+        }
         expression();
-        emit_bytes(set_op, (uint8_t) arg);
+        emit_operand(set_op, arg);
     } else {
-        emit_bytes(get_op, (uint8_t) arg);
+        if (get_op == OP_GET_LOCAL) current->locals[arg].reads++;
+        emit_operand(get_op, arg);
     }
 }
 
@@ -540,17 +1585,25 @@ static void super_(bool can_assign) {
     }
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(&parser.previous);
+    int name = identifier_constant(&parser.previous);
     
     named_variable(synthetic_token("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
+        if (name > UINT8_MAX) {
+            named_variable(synthetic_token("super"), false);
+            emit_operand(OP_GET_SUPER, name);
+            uint8_t arg_count = argument_list();
+            emit_bytes(OP_CALL, arg_count);
+            return;
+        }
+        
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
+        emit_bytes(OP_SUPER_INVOKE, (uint8_t) name);
         emit_byte(arg_count);
     } else {
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_operand(OP_GET_SUPER, name);
     }
 }
 
@@ -569,8 +1622,8 @@ static void unary(bool can_assign) {
     parse_precedence(PREC_UNARY);
     
     switch (operator_type) {
-        case TOKEN_BANG: emit_byte(OP_NOT); break;
-        case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+        case TOKEN_BANG: emit_op(OP_NOT); break;
+        case TOKEN_MINUS: emit_op(OP_NEGATE); break;
         default: return; // unreachable
     }
 }
@@ -619,6 +1672,17 @@ ParseRule rules[] = {
     [TOKEN_LEFT_SQUARE_BRACKET]  = {list,        subscript, PREC_CALL},
     [TOKEN_RIGHT_SQUARE_BRACKET] = {NULL,        NULL,      PREC_NONE},
     [TOKEN_MOD]                  = {NULL,        binary,    PREC_TERM},
+    [TOKEN_AMPERSAND]            = {NULL,        binary,    PREC_BIT_AND},
+    [TOKEN_PIPE]                 = {NULL,        binary,    PREC_BIT_OR},
+    [TOKEN_CARET]                = {NULL,        binary,    PREC_BIT_XOR},
+    [TOKEN_LESS_LESS]            = {NULL,        binary,    PREC_SHIFT},
+    [TOKEN_GREATER_GREATER]      = {NULL,        binary,    PREC_SHIFT},
+    [TOKEN_IN]                   = {NULL,        NULL,      PREC_NONE},
+    [TOKEN_DOT_DOT]              = {NULL,        NULL,      PREC_NONE},
+    [TOKEN_SWITCH]               = {NULL,        NULL,      PREC_NONE},
+    [TOKEN_CASE]                 = {NULL,        NULL,      PREC_NONE},
+    [TOKEN_DEFAULT]              = {NULL,        NULL,      PREC_NONE},
+    [TOKEN_COLON]                = {NULL,        NULL,      PREC_NONE},
 };
 
 static void parse_precedence(Precedence precedence) {
@@ -659,9 +1723,34 @@ static void block(void) {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    init_compiler(&compiler, type);
+// Compiles a function's code with parse, then compiles it again from the
+// same place in the source for as long as a forward jump overflows, with
+// the jumps that did in the long form. Code only grows, so this settles.
+static ObjFunction* compile_function(Compiler *compiler, FunctionType type, void (*parse)(void)) {
+    Parser start_parser = parser;
+    Scanner start_scanner = scanner;
+    bool *long_jumps = NULL;
+    int long_jump_capacity = 0;
+    
+    for (;;) {
+        init_compiler(compiler, type);
+        compiler->long_jumps = long_jumps;
+        compiler->long_jump_capacity = long_jump_capacity;
+        parse();
+        ObjFunction *function = end_compiler();
+        long_jumps = compiler->long_jumps;
+        long_jump_capacity = compiler->long_jump_capacity;
+        
+        if (!compiler->jump_overflow || parser.had_error) {
+            free(long_jumps);
+            return function;
+        }
+        parser = start_parser;
+        scanner = start_scanner;
+    }
+}
+
+static void function_body(void) {
     begin_scope();
     
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
@@ -671,26 +1760,58 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
+            int constant = parse_variable("Expect parameter name.");
             define_variable(constant);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
+
+static void emit_capture(Upvalue *upvalue) {
+    if (upvalue->is_local) {
+        add_capture_site(upvalue->index);
+        emit_byte(CAPTURE_LOCAL);
+    } else {
+        emit_byte(CAPTURE_UPVALUE);
+    }
+}
+
+static void function(FunctionType type) {
+    Compiler compiler;
+    ObjFunction *function = compile_function(&compiler, type, function_body);
+    int constant = make_constant(OBJ_VAL(function));
     
-    ObjFunction *function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    // Captured locals past slot 255 need the long form too, which has
+    // two byte indexes.
+    bool long_form = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        if (compiler.upvalues[i].index > UINT8_MAX) long_form = true;
+    }
     
+    if (!long_form) {
+        emit_bytes(OP_CLOSURE, (uint8_t) constant);
+        for (int i = 0; i < function->upvalue_count; i++) {
+            emit_capture(&compiler.upvalues[i]);
+            emit_byte((uint8_t) compiler.upvalues[i].index);
+        }
+        return;
+    }
+    
+    emit_op(OP_CLOSURE_LONG);
+    emit_long(constant);
     for (int i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_capture(&compiler.upvalues[i]);
+        emit_byte((compiler.upvalues[i].index >> 8) & 0xFF);
+        emit_byte(compiler.upvalues[i].index & 0xFF);
     }
 }
 
 static void method(void) {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(&parser.previous);
+    int constant = identifier_constant(&parser.previous);
+    define_selector(AS_STRING(current_chunk()->constants.values[constant]));
     
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
@@ -698,16 +1819,16 @@ static void method(void) {
     }
     
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_operand(OP_METHOD, constant);
 }
 
 static void class_declaration(void) {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token class_name = parser.previous;
-    uint8_t name_constant = identifier_constant(&parser.previous);
+    int name_constant = identifier_constant(&parser.previous);
     declare_variable();
 
-    emit_bytes(OP_CLASS, name_constant);
+    emit_operand(OP_CLASS, name_constant);
     define_variable(name_constant);
     
     ClassCompiler class_compiler;
@@ -728,7 +1849,7 @@ static void class_declaration(void) {
         define_variable(0);
         
         named_variable(class_name, false);
-        emit_byte(OP_INHERIT);
+        emit_op(OP_INHERIT);
         class_compiler.has_superclass = true;
     }
     
@@ -738,7 +1859,7 @@ static void class_declaration(void) {
         method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     
     if (class_compiler.has_superclass) {
         end_scope();
@@ -748,19 +1869,35 @@ static void class_declaration(void) {
 }
 
 static void fun_declaration(void) {
-    uint8_t global = parse_variable("Expect function name.");
+    int global = parse_variable("Expect function name.");
     mark_initialised();
+    int first_site = current->capture_count;
     function(TYPE_FUNCTION);
+    
+    // The closure is made before its variable holds it, so one that
+    // captures itself has to share the variable.
+    if (current->scope_depth > 0) {
+        Local *local = &current->locals[current->local_count - 1];
+        for (int i = first_site; i < current->capture_count; i++) {
+            if (current->capture_sites[i].local == current->local_count - 1) local->is_assigned = true;
+        }
+    }
     define_variable(global);
 }
 
 static void var_declaration(void) {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
     
     if (match(TOKEN_EQUAL)) {
         expression();
+        // Whatever a call leaves here ends up in the variable, which might
+        // keep it to itself.
+        int last = current->last_instruction;
+        if (current->scope_depth > 0 && is_instruction(last, OP_CALL)) {
+            current->locals[current->local_count - 1].allocation = last;
+        }
     } else {
-        emit_byte(OP_NIL);
+        emit_op(OP_NIL);
     }
     consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
     define_variable(global);
@@ -769,12 +1906,82 @@ static void var_declaration(void) {
 static void expression_statement(void) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
+}
+
+// Looks at the token after the current one without consuming either.
+static TokenType peek_next(void) {
+    Scanner saved = scanner;
+    Token next = scan_token();
+    scanner = saved;
+    return next.type;
+}
+
+static void add_hidden_local(void) {
+    add_local(synthetic_token(""));
+    mark_initialised();
+}
+
+// A for-in loop keeps what it walks in two hidden locals below the loop
+// variable: the counter and bound of a range, or a list and the index of
+// its next element. OP_FOR_RANGE or OP_FOR_LIST at the bottom of the loop
+// advances them, sets the variable and jumps back to the body, all in one
+// instruction.
+static void for_in_statement(void) {
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token name = parser.previous;
+    consume(TOKEN_IN, "Expect 'in' after loop variable.");
+    
+    int slot = current->local_count;
+    OpCode op = OP_FOR_LIST;
+    expression();
+    if (match(TOKEN_DOT_DOT)) {
+        expression();
+        op = OP_FOR_RANGE;
+    } else {
+        emit_constant(INT_VAL(0));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    
+    add_hidden_local();
+    add_hidden_local();
+    emit_op(OP_NIL);
+    add_local(name);
+    mark_initialised();
+    // The loop writes a new value to it every time around.
+    current->locals[current->local_count - 1].is_assigned = true;
+    
+    int entry_jump = emit_jump(OP_JUMP);
+    int body_start = mark_jump_target();
+    statement();
+    
+    // A body too long for the instruction's offset loops back through a
+    // long loop instruction just in front of it.
+    int loop_start = body_start;
+    int length = slot <= UINT8_MAX ? 4 : 6;
+    if (current_chunk()->count + length - body_start > UINT16_MAX) {
+        int skip_jump = emit_jump(OP_JUMP);
+        loop_start = mark_jump_target();
+        emit_loop(body_start);
+        patch_jump(skip_jump);
+    }
+    
+    patch_jump(entry_jump);
+    emit_operand(op, slot);
+    int offset = current_chunk()->count + 2 - loop_start;
+    emit_byte((offset >> 8) & 0xFF);
+    emit_byte(offset & 0xFF);
 }
 
 static void for_statement(void) {
     begin_scope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (check(TOKEN_IDENTIFIER) && peek_next() == TOKEN_IN) {
+        for_in_statement();
+        end_scope();
+        return;
+    }
+    
     if (match(TOKEN_SEMICOLON)) {
         
     } else if (match(TOKEN_VAR)) {
@@ -783,21 +1990,21 @@ static void for_statement(void) {
         expression_statement();
     }
     
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_jump_target();
     int exit_jump = -1;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         
         exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
     }
     
     if (!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
-        int increment_start = current_chunk()->count;
+        int increment_start = mark_jump_target();
         expression();
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
         
         emit_loop(loop_start);
@@ -810,7 +2017,7 @@ static void for_statement(void) {
     
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP);
+        emit_op(OP_POP);
     }
     
     end_scope();
@@ -822,22 +2029,142 @@ static void if_statement(void) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     
     int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     statement();
     
     int else_jump = emit_jump(OP_JUMP);
     
     patch_jump(then_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     
     if (match(TOKEN_ELSE)) statement();
     patch_jump(else_jump);
 }
 
+// A case label is a number or string literal, or nil after an error. A
+// string goes in the constant table to keep it alive.
+static Value case_value(void) {
+    if (match(TOKEN_STRING)) {
+        Value value = OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2));
+        make_constant(value);
+        return value;
+    }
+    
+    bool negative = match(TOKEN_MINUS);
+    if (!match(TOKEN_NUMBER)) {
+        error_at_current("Expect a number or string after 'case'.");
+        return NIL_VAL;
+    }
+    Value value = number_value();
+    if (!negative) return value;
+    return IS_INT(value) ? INT_VAL(-AS_INT(value)) : NUMBER_VAL(-AS_DOUBLE(value));
+}
+
+// Each arm runs its statements and leaves the switch, without falling
+// through to the next. OP_SWITCH pops the value and jumps to the arm that
+// its table picks.
+static void switch_statement(void) {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+    
+    int table = add_switch(current_chunk());
+    if (table == -1) error("Too many switch statements in one chunk.");
+    emit_op(OP_SWITCH);
+    emit_byte((table >> 8) & 0xFF);
+    emit_byte(table & 0xFF);
+    
+    SwitchCase *cases = NULL;
+    int case_count = 0;
+    int case_capacity = 0;
+    int *targets = NULL;
+    int *end_jumps = NULL;
+    int arm_count = 0;
+    int arm_capacity = 0;
+    int fallback = -1;
+    
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        if (match(TOKEN_DEFAULT)) {
+            if (fallback != -1) error("Already a default case in this switch.");
+            fallback = arm_count;
+        } else {
+            consume(TOKEN_CASE, "Expect 'case' or 'default'.");
+            do {
+                Value key = case_value();
+                if (IS_NIL(key)) continue;
+                for (int i = 0; i < case_count; i++) {
+                    if (values_equal(cases[i].key, key)) error("Duplicate case value.");
+                }
+                if (case_capacity < case_count + 1) {
+                    int old_capacity = case_capacity;
+                    case_capacity = GROW_CAPACITY(old_capacity);
+                    cases = GROW_ARRAY(SwitchCase, cases, old_capacity, case_capacity);
+                }
+                cases[case_count].key = key;
+                cases[case_count++].arm = arm_count;
+            } while (match(TOKEN_COMMA));
+        }
+        consume(TOKEN_COLON, "Expect ':' after case.");
+        
+        // One spare entry for the end of the switch, in case there is no
+        // default.
+        if (arm_capacity < arm_count + 2) {
+            int old_capacity = arm_capacity;
+            arm_capacity = GROW_CAPACITY(old_capacity);
+            targets = GROW_ARRAY(int, targets, old_capacity, arm_capacity);
+            end_jumps = GROW_ARRAY(int, end_jumps, old_capacity, arm_capacity);
+        }
+        if (arm_count > 0) end_jumps[arm_count - 1] = emit_jump(OP_JUMP);
+        targets[arm_count++] = mark_jump_target();
+        
+        begin_scope();
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        end_scope();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+    
+    for (int arm = 0; arm < arm_count - 1; arm++) {
+        patch_jump(end_jumps[arm]);
+    }
+    if (fallback == -1) {
+        if (arm_capacity == 0) {
+            arm_capacity = 1;
+            targets = GROW_ARRAY(int, targets, 0, arm_capacity);
+            end_jumps = GROW_ARRAY(int, end_jumps, 0, arm_capacity);
+        }
+        fallback = arm_count;
+        targets[arm_count++] = mark_jump_target();
+    }
+    if (table != -1) {
+        fill_switch(&current_chunk()->switches[table], cases, case_count, targets, arm_count, fallback);
+    }
+    
+    FREE_ARRAY(SwitchCase, cases, case_capacity);
+    FREE_ARRAY(int, targets, arm_capacity);
+    FREE_ARRAY(int, end_jumps, arm_capacity);
+}
+
 static void print_statement(void) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emit_byte(OP_PRINT);
+    emit_op(OP_PRINT);
+}
+
+// A call whose result is returned straight away hands its frame over to
+// the callee. The OP_RETURN still follows for any jump that lands on it.
+static void mark_tail_call(void) {
+    Chunk *chunk = current_chunk();
+    int last = current->last_instruction;
+    if (last == -1 || last + instruction_length(chunk, last) != chunk->count) return;
+    
+    switch (chunk->code[last]) {
+        case OP_CALL: chunk->code[last] = OP_TAIL_CALL; break;
+        case OP_INVOKE: chunk->code[last] = OP_TAIL_INVOKE; break;
+        case OP_SUPER_INVOKE: chunk->code[last] = OP_TAIL_SUPER_INVOKE; break;
+    }
 }
 
 static void return_statement(void) {
@@ -854,23 +2181,24 @@ static void return_statement(void) {
         
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emit_byte(OP_RETURN);
+        mark_tail_call();
+        emit_op(OP_RETURN);
     }
 }
 
 static void while_statement(void) {
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_jump_target();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
     
     int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     statement();
     emit_loop(loop_start);
     
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
 }
 
 static void synchronize(void) {
@@ -885,6 +2213,7 @@ static void synchronize(void) {
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
+            case TOKEN_SWITCH:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
                 return;
@@ -922,6 +2251,8 @@ static void statement(void) {
         return_statement();
     } else if (match(TOKEN_WHILE)) {
         while_statement();
+    } else if (match(TOKEN_SWITCH)) {
+        switch_statement();
     } else if (match(TOKEN_LEFT_BRACE)) {
         begin_scope();
         block();
@@ -931,21 +2262,21 @@ static void statement(void) {
     }
 }
 
-ObjFunction* compile(const char *source) {
-    init_scanner(source);
-    Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
-    
-    parser.had_error = false;
-    parser.panic_mode = false;
-
+static void script(void) {
     advance();
     
     while (!match(TOKEN_EOF)) {
         declaration();
     }
+}
+
+ObjFunction* compile(const char *source) {
+    init_scanner(source);
+    parser.had_error = false;
+    parser.panic_mode = false;
     
-    ObjFunction *function = end_compiler();
+    Compiler compiler;
+    ObjFunction *function = compile_function(&compiler, TYPE_SCRIPT, script);
     return parser.had_error ? NULL : function;
 }
 
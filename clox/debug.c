@@ -4,6 +4,116 @@
 #include "object.h"
 #include "value.h"
 
+static const char *opcode_names[] = {
+    [OP_CONSTANT]                    = "OP_CONSTANT",
+    [OP_NIL]                         = "OP_NIL",
+    [OP_TRUE]                        = "OP_TRUE",
+    [OP_FALSE]                       = "OP_FALSE",
+    [OP_POP]                         = "OP_POP",
+    [OP_GET_LOCAL]                   = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]                   = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL]                  = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL]               = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL]                  = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE]                 = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE]                 = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY]                = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]                = "OP_SET_PROPERTY",
+    [OP_GET_SUPER]                   = "OP_GET_SUPER",
+    [OP_EQUAL]                       = "OP_EQUAL",
+    [OP_GREATER]                     = "OP_GREATER",
+    [OP_LESS]                        = "OP_LESS",
+    [OP_ADD]                         = "OP_ADD",
+    [OP_SUBTRACT]                    = "OP_SUBTRACT",
+    [OP_MULTIPLY]                    = "OP_MULTIPLY",
+    [OP_DIVIDE]                      = "OP_DIVIDE",
+    [OP_NOT]                         = "OP_NOT",
+    [OP_NEGATE]                      = "OP_NEGATE",
+    [OP_PRINT]                       = "OP_PRINT",
+    [OP_JUMP]                        = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]               = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]                        = "OP_LOOP",
+    [OP_CALL]                        = "OP_CALL",
+    [OP_INVOKE]                      = "OP_INVOKE",
+    [OP_SUPER_INVOKE]                = "OP_SUPER_INVOKE",
+    [OP_CLOSURE]                     = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE]               = "OP_CLOSE_UPVALUE",
+    [OP_RETURN]                      = "OP_RETURN",
+    [OP_CLASS]                       = "OP_CLASS",
+    [OP_INHERIT]                     = "OP_INHERIT",
+    [OP_METHOD]                      = "OP_METHOD",
+    [OP_NEW_LIST]                    = "OP_NEW_LIST",
+    [OP_GET_LIST]                    = "OP_GET_LIST",
+    [OP_SET_LIST]                    = "OP_SET_LIST",
+    [OP_MOD]                         = "OP_MOD",
+    [OP_GET_LOCAL_GET_LOCAL_ADD]     = "OP_GET_LOCAL_GET_LOCAL_ADD",
+    [OP_GET_LOCAL_CONSTANT_ADD]      = "OP_GET_LOCAL_CONSTANT_ADD",
+    [OP_GET_LOCAL_CONSTANT_SUBTRACT] = "OP_GET_LOCAL_CONSTANT_SUBTRACT",
+    [OP_LESS_JUMP_IF_FALSE]          = "OP_LESS_JUMP_IF_FALSE",
+    [OP_SET_LOCAL_POP]               = "OP_SET_LOCAL_POP",
+    [OP_ADD_NUM]                     = "OP_ADD_NUM",
+    [OP_LESS_NUM]                    = "OP_LESS_NUM",
+    [OP_GREATER_NUM]                 = "OP_GREATER_NUM",
+    [OP_GET_LIST_NUMIDX]             = "OP_GET_LIST_NUMIDX",
+    [OP_SET_LIST_NUMIDX]             = "OP_SET_LIST_NUMIDX",
+    [OP_TAIL_CALL]                   = "OP_TAIL_CALL",
+    [OP_TAIL_INVOKE]                 = "OP_TAIL_INVOKE",
+    [OP_TAIL_SUPER_INVOKE]           = "OP_TAIL_SUPER_INVOKE",
+    [OP_CONSTANT_LONG]               = "OP_CONSTANT_LONG",
+    [OP_GET_LOCAL_LONG]              = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG]              = "OP_SET_LOCAL_LONG",
+    [OP_GET_GLOBAL_LONG]             = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL_LONG]          = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG]             = "OP_SET_GLOBAL_LONG",
+    [OP_GET_PROPERTY_LONG]           = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY_LONG]           = "OP_SET_PROPERTY_LONG",
+    [OP_GET_SUPER_LONG]              = "OP_GET_SUPER_LONG",
+    [OP_JUMP_LONG]                   = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG]          = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG]                   = "OP_LOOP_LONG",
+    [OP_CLOSURE_LONG]                = "OP_CLOSURE_LONG",
+    [OP_CLASS_LONG]                  = "OP_CLASS_LONG",
+    [OP_METHOD_LONG]                 = "OP_METHOD_LONG",
+    [OP_BIT_AND]                     = "OP_BIT_AND",
+    [OP_BIT_OR]                      = "OP_BIT_OR",
+    [OP_BIT_XOR]                     = "OP_BIT_XOR",
+    [OP_SHIFT_LEFT]                  = "OP_SHIFT_LEFT",
+    [OP_SHIFT_RIGHT]                 = "OP_SHIFT_RIGHT",
+    [OP_INTRINSIC]                   = "OP_INTRINSIC",
+    [OP_CALL_SCOPED]                 = "OP_CALL_SCOPED",
+    [OP_POP_SCOPED]                  = "OP_POP_SCOPED",
+    [OP_FOR_RANGE]                   = "OP_FOR_RANGE",
+    [OP_FOR_LIST]                    = "OP_FOR_LIST",
+    [OP_SWITCH]                      = "OP_SWITCH",
+    [OP_JUMP_IF_TRUE]                = "OP_JUMP_IF_TRUE",
+    [OP_FOR_RANGE_LONG]              = "OP_FOR_RANGE_LONG",
+    [OP_FOR_LIST_LONG]               = "OP_FOR_LIST_LONG",
+};
+
+static const char *capture_names[] = {
+    [CAPTURE_UPVALUE] = "upvalue",
+    [CAPTURE_LOCAL]   = "local",
+    [CAPTURE_VALUE]   = "value",
+};
+
+static const char *intrinsic_names[] = {
+    [INTRINSIC_CLOCK] = "clock",
+    [INTRINSIC_SQRT]  = "sqrt",
+    [INTRINSIC_FLOOR] = "floor",
+    [INTRINSIC_CEIL]  = "ceil",
+    [INTRINSIC_ABS]   = "abs",
+    [INTRINSIC_SIN]   = "sin",
+    [INTRINSIC_COS]   = "cos",
+    [INTRINSIC_TAN]   = "tan",
+    [INTRINSIC_ATAN]  = "atan",
+    [INTRINSIC_EXP]   = "exp",
+    [INTRINSIC_LOG]   = "log",
+    [INTRINSIC_POW]   = "pow",
+    [INTRINSIC_ATAN2] = "atan2",
+    [INTRINSIC_MIN]   = "min",
+    [INTRINSIC_MAX]   = "max",
+};
+
 void disassemble_chunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
@@ -19,13 +129,35 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
-static int invoke_instruction(const char *name, Chunk *chunk, int offset) {
+static int long_constant_instruction(const char *name, Chunk *chunk, int offset) {
+    int constant = read_long(&chunk->code[offset + 1]);
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// Property accesses end with their inline cache's index.
+static int property_instruction(const char *name, Chunk *chunk, int offset, bool wide) {
+    int constant = wide ? read_long(&chunk->code[offset + 1]) : chunk->code[offset + 1];
+    offset += wide ? 4 : 2;
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", read_cache_index(&chunk->code[offset]));
+    return offset + 2;
+}
+
+static int invoke_instruction(const char *name, Chunk *chunk, int offset, bool cached) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     print_value(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    if (!cached) {
+        printf("'\n");
+        return offset + 3;
+    }
+    printf("' ic %d\n", read_cache_index(&chunk->code[offset + 3]));
+    return offset + 5;
 }
 
 static int simple_instruction(const char *name, int offset) {
@@ -39,10 +171,59 @@ static int byte_instruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
-static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+static int intrinsic_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t intrinsic = chunk->code[offset + 1];
+    printf("%-16s %4d '%s' (%d args)\n", name, intrinsic, intrinsic_names[intrinsic], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int long_instruction(const char *name, Chunk *chunk, int offset) {
+    int slot = read_long(&chunk->code[offset + 1]);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 4;
+}
+
+static int local_pair_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int local_constant_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int jump_instruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s %4d -> %d\n", name, offset, jump_target(chunk, offset));
+    return offset + instruction_length(chunk, offset);
+}
+
+// The loop's hidden locals start at the slot operand.
+static int for_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t *code = &chunk->code[offset];
+    bool wide = code[0] == OP_FOR_RANGE_LONG || code[0] == OP_FOR_LIST_LONG;
+    printf("%-16s %4d -> %d\n", name, wide ? read_long(&code[1]) : code[1], jump_target(chunk, offset));
+    return offset + instruction_length(chunk, offset);
+}
+
+// Lists where each arm starts, marking the one unmatched values go to.
+static void print_arms(SwitchTable *table, int *targets) {
+    for (int arm = 0; arm < table->arm_count; arm++) {
+        printf(" %s%d", arm == table->fallback ? "default " : "", targets[arm]);
+    }
+    printf("\n");
+}
+
+static int switch_instruction(const char *name, Chunk *chunk, int offset) {
+    SwitchTable *table = switch_table(chunk, offset);
+    printf("%-16s %4d ->", name, read_cache_index(&chunk->code[offset + 1]));
+    print_arms(table, table->targets);
     return offset + 3;
 }
 
@@ -82,9 +263,9 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case OP_SET_UPVALUE:
             return byte_instruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+            return property_instruction("OP_GET_PROPERTY", chunk, offset, false);
         case OP_SET_PROPERTY:
-            return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+            return property_instruction("OP_SET_PROPERTY", chunk, offset, false);
         case OP_GET_SUPER:
             return constant_instruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -108,17 +289,25 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case OP_PRINT:
             return simple_instruction("OP_PRINT", offset);
         case OP_JUMP:
-            return jump_instruction("OP_JUMP", 1, chunk, offset);
+            return jump_instruction("OP_JUMP", chunk, offset);
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+            return jump_instruction("OP_JUMP_IF_FALSE", chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jump_instruction("OP_JUMP_IF_TRUE", chunk, offset);
         case OP_LOOP:
-            return jump_instruction("OP_LOOP", -1, chunk, offset);
+            return jump_instruction("OP_LOOP", chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
         case OP_INVOKE:
-            return invoke_instruction("OP_INVOKE", chunk, offset);
+            return invoke_instruction("OP_INVOKE", chunk, offset, true);
         case OP_SUPER_INVOKE:
-            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+            return invoke_instruction("OP_SUPER_INVOKE", chunk, offset, false);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invoke_instruction("OP_TAIL_INVOKE", chunk, offset, true);
+        case OP_TAIL_SUPER_INVOKE:
+            return invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset, false);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -128,9 +317,9 @@ int disassemble_instruction(Chunk *chunk, int offset) {
 
             ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
             for (int j = 0; j < function->upvalue_count; j++) {
-                int isLocal = chunk->code[offset++];
+                int kind = chunk->code[offset++];
                 int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+                printf("%04d      |                     %s %d\n", offset - 2, capture_names[kind], index);
             }
 
             return offset;
@@ -153,8 +342,407 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return simple_instruction("OP_SET_LIST", offset);
         case OP_MOD:
             return simple_instruction("OP_MOD", offset);
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            return local_pair_instruction("OP_GET_LOCAL_GET_LOCAL_ADD", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            return local_constant_instruction("OP_GET_LOCAL_CONSTANT_ADD", chunk, offset);
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            return local_constant_instruction("OP_GET_LOCAL_CONSTANT_SUBTRACT", chunk, offset);
+        case OP_LESS_JUMP_IF_FALSE:
+            return jump_instruction("OP_LESS_JUMP_IF_FALSE", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_ADD_NUM:
+            return simple_instruction("OP_ADD_NUM", offset);
+        case OP_LESS_NUM:
+            return simple_instruction("OP_LESS_NUM", offset);
+        case OP_GREATER_NUM:
+            return simple_instruction("OP_GREATER_NUM", offset);
+        case OP_GET_LIST_NUMIDX:
+            return simple_instruction("OP_GET_LIST_NUMIDX", offset);
+        case OP_SET_LIST_NUMIDX:
+            return simple_instruction("OP_SET_LIST_NUMIDX", offset);
+        case OP_CONSTANT_LONG:
+            return long_constant_instruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return long_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return long_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return long_constant_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return long_constant_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return long_constant_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return property_instruction("OP_GET_PROPERTY_LONG", chunk, offset, true);
+        case OP_SET_PROPERTY_LONG:
+            return property_instruction("OP_SET_PROPERTY_LONG", chunk, offset, true);
+        case OP_GET_SUPER_LONG:
+            return long_constant_instruction("OP_GET_SUPER_LONG", chunk, offset);
+        case OP_JUMP_LONG:
+            return jump_instruction("OP_JUMP_LONG", chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jump_instruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+        case OP_LOOP_LONG:
+            return jump_instruction("OP_LOOP_LONG", chunk, offset);
+        case OP_CLOSURE_LONG: {
+            int constant = read_long(&chunk->code[offset + 1]);
+            printf("%-16s %4d ", "OP_CLOSURE_LONG", constant);
+            print_value(chunk->constants.values[constant]);
+            printf("\n");
+            offset += 4;
+
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            for (int j = 0; j < function->upvalue_count; j++) {
+                int kind = chunk->code[offset];
+                int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+                printf("%04d      |                     %s %d\n", offset, capture_names[kind], index);
+                offset += 3;
+            }
+
+            return offset;
+        }
+        case OP_CLASS_LONG:
+            return long_constant_instruction("OP_CLASS_LONG", chunk, offset);
+        case OP_METHOD_LONG:
+            return long_constant_instruction("OP_METHOD_LONG", chunk, offset);
+        case OP_BIT_AND:
+            return simple_instruction("OP_BIT_AND", offset);
+        case OP_BIT_OR:
+            return simple_instruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:
+            return simple_instruction("OP_BIT_XOR", offset);
+        case OP_SHIFT_LEFT:
+            return simple_instruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT:
+            return simple_instruction("OP_SHIFT_RIGHT", offset);
+        case OP_INTRINSIC:
+            return intrinsic_instruction("OP_INTRINSIC", chunk, offset);
+        case OP_CALL_SCOPED:
+            return byte_instruction("OP_CALL_SCOPED", chunk, offset);
+        case OP_POP_SCOPED:
+            return simple_instruction("OP_POP_SCOPED", offset);
+        case OP_FOR_RANGE:
+            return for_instruction("OP_FOR_RANGE", chunk, offset);
+        case OP_FOR_LIST:
+            return for_instruction("OP_FOR_LIST", chunk, offset);
+        case OP_FOR_RANGE_LONG:
+            return for_instruction("OP_FOR_RANGE_LONG", chunk, offset);
+        case OP_FOR_LIST_LONG:
+            return for_instruction("OP_FOR_LIST_LONG", chunk, offset);
+        case OP_SWITCH:
+            return switch_instruction("OP_SWITCH", chunk, offset);
+        default:
+            printf("Unknown opcode %d\n", instruction);
+            return offset + 1;
+    }
+}
+
+void disassemble_register_code(ObjFunction *function) {
+    printf("== %s (registers) ==\n", function->name != NULL ? function->name->chars : "<script>");
+    for (int offset = 0; offset < function->register_code.count;) {
+        offset = disassemble_register_instruction(function, offset);
+    }
+}
+
+static int register_instruction(const char *name, ObjFunction *function, int offset, int registers, bool constant) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%-3d", code[offset + i]);
+    }
+    offset += registers + 1;
+    
+    if (constant) {
+        printf(" %4d '", code[offset]);
+        print_value(function->chunk.constants.values[code[offset]]);
+        printf("'");
+        offset++;
+    }
+    printf("\n");
+    return offset;
+}
+
+static int register_property_instruction(const char *name, ObjFunction *function, int offset, int registers) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%-3d", code[offset + i]);
+    }
+    offset += registers + 1;
+    
+    printf(" %4d '", code[offset]);
+    print_value(function->chunk.constants.values[code[offset]]);
+    printf("' ic %d\n", read_cache_index(&code[offset + 1]));
+    return offset + 3;
+}
+
+static int register_call_instruction(const char *name, ObjFunction *function, int offset, bool constant, bool cached) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s r%-3d", name, code[offset + 1]);
+    if (constant) {
+        printf(" %4d '", code[offset + 2]);
+        print_value(function->chunk.constants.values[code[offset + 2]]);
+        printf("'");
+        offset++;
+    }
+    printf(" (%d args)", code[offset + 2]);
+    if (cached) {
+        printf(" ic %d", read_cache_index(&code[offset + 3]));
+        offset += 2;
+    }
+    printf("\n");
+    return offset + 3;
+}
+
+static int register_intrinsic_instruction(const char *name, ObjFunction *function, int offset) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s r%-3d '%s' (%d args)\n", name, code[offset + 1], intrinsic_names[code[offset + 2]], code[offset + 3]);
+    return offset + 4;
+}
+
+static int register_jump_instruction(const char *name, int sign, ObjFunction *function, int offset, int registers) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s", name);
+    for (int i = 1; i <= registers; i++) {
+        printf(" r%-3d", code[offset + i]);
+    }
+    offset += registers;
+    uint16_t jump = (uint16_t)(code[offset + 1] << 8) | code[offset + 2];
+    printf(" -> %d\n", offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+static int register_compare_jump_instruction(const char *name, ObjFunction *function, int offset, bool constant) {
+    uint8_t *code = function->register_code.code;
+    printf("%-16s r%-3d r%-3d", name, code[offset + 1], code[offset + 2]);
+    if (constant) {
+        printf(" %4d '", code[offset + 3]);
+        print_value(function->chunk.constants.values[code[offset + 3]]);
+        printf("'");
+    } else {
+        printf(" r%-3d", code[offset + 3]);
+    }
+    uint16_t jump = (uint16_t)(code[offset + 4] << 8) | code[offset + 5];
+    printf(" -> %d\n", offset + 6 + jump);
+    return offset + 6;
+}
+
+static int register_switch_instruction(const char *name, ObjFunction *function, int offset) {
+    uint8_t *code = &function->register_code.code[offset];
+    printf("%-16s r%-3d ->", name, code[1]);
+    SwitchTable *table = &function->chunk.switches[read_cache_index(&code[2])];
+    print_arms(table, table->register_targets);
+    return offset + 4;
+}
+
+int disassemble_register_instruction(ObjFunction *function, int offset) {
+    Chunk *chunk = &function->register_code;
+    printf("%04d ", offset);
+
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset-1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+        case REG_MOVE:
+            return register_instruction("REG_MOVE", function, offset, 2, false);
+        case REG_LOADK:
+            return register_instruction("REG_LOADK", function, offset, 1, true);
+        case REG_LOADNIL:
+            return register_instruction("REG_LOADNIL", function, offset, 1, false);
+        case REG_LOADTRUE:
+            return register_instruction("REG_LOADTRUE", function, offset, 1, false);
+        case REG_LOADFALSE:
+            return register_instruction("REG_LOADFALSE", function, offset, 1, false);
+        case REG_GET_GLOBAL:
+            return register_instruction("REG_GET_GLOBAL", function, offset, 1, true);
+        case REG_DEFINE_GLOBAL:
+            return register_instruction("REG_DEFINE_GLOBAL", function, offset, 1, true);
+        case REG_SET_GLOBAL:
+            return register_instruction("REG_SET_GLOBAL", function, offset, 1, true);
+        case REG_GET_UPVALUE:
+            return register_instruction("REG_GET_UPVALUE", function, offset, 2, false);
+        case REG_SET_UPVALUE:
+            return register_instruction("REG_SET_UPVALUE", function, offset, 2, false);
+        case REG_GET_PROPERTY:
+            return register_property_instruction("REG_GET_PROPERTY", function, offset, 2);
+        case REG_SET_PROPERTY:
+            return register_property_instruction("REG_SET_PROPERTY", function, offset, 3);
+        case REG_GET_SUPER:
+            return register_instruction("REG_GET_SUPER", function, offset, 3, true);
+        case REG_EQUAL:
+            return register_instruction("REG_EQUAL", function, offset, 3, false);
+        case REG_GREATER:
+            return register_instruction("REG_GREATER", function, offset, 3, false);
+        case REG_LESS:
+            return register_instruction("REG_LESS", function, offset, 3, false);
+        case REG_ADD:
+            return register_instruction("REG_ADD", function, offset, 3, false);
+        case REG_SUBTRACT:
+            return register_instruction("REG_SUBTRACT", function, offset, 3, false);
+        case REG_MULTIPLY:
+            return register_instruction("REG_MULTIPLY", function, offset, 3, false);
+        case REG_DIVIDE:
+            return register_instruction("REG_DIVIDE", function, offset, 3, false);
+        case REG_MOD:
+            return register_instruction("REG_MOD", function, offset, 3, false);
+        case REG_BIT_AND:
+            return register_instruction("REG_BIT_AND", function, offset, 3, false);
+        case REG_BIT_OR:
+            return register_instruction("REG_BIT_OR", function, offset, 3, false);
+        case REG_BIT_XOR:
+            return register_instruction("REG_BIT_XOR", function, offset, 3, false);
+        case REG_SHIFT_LEFT:
+            return register_instruction("REG_SHIFT_LEFT", function, offset, 3, false);
+        case REG_SHIFT_RIGHT:
+            return register_instruction("REG_SHIFT_RIGHT", function, offset, 3, false);
+        case REG_INTRINSIC:
+            return register_intrinsic_instruction("REG_INTRINSIC", function, offset);
+        case REG_CALL_SCOPED:
+            return register_call_instruction("REG_CALL_SCOPED", function, offset, false, false);
+        case REG_POP_SCOPED:
+            return register_instruction("REG_POP_SCOPED", function, offset, 1, false);
+        case REG_FOR_RANGE:
+            return register_jump_instruction("REG_FOR_RANGE", -1, function, offset, 1);
+        case REG_FOR_LIST:
+            return register_jump_instruction("REG_FOR_LIST", -1, function, offset, 1);
+        case REG_SWITCH:
+            return register_switch_instruction("REG_SWITCH", function, offset);
+        case REG_GREATERK:
+            return register_instruction("REG_GREATERK", function, offset, 2, true);
+        case REG_LESSK:
+            return register_instruction("REG_LESSK", function, offset, 2, true);
+        case REG_ADDK:
+            return register_instruction("REG_ADDK", function, offset, 2, true);
+        case REG_SUBTRACTK:
+            return register_instruction("REG_SUBTRACTK", function, offset, 2, true);
+        case REG_NOT:
+            return register_instruction("REG_NOT", function, offset, 2, false);
+        case REG_NEGATE:
+            return register_instruction("REG_NEGATE", function, offset, 2, false);
+        case REG_PRINT:
+            return register_instruction("REG_PRINT", function, offset, 1, false);
+        case REG_JUMP:
+            return register_jump_instruction("REG_JUMP", 1, function, offset, 0);
+        case REG_JUMP_IF_FALSE:
+            return register_jump_instruction("REG_JUMP_IF_FALSE", 1, function, offset, 1);
+        case REG_JUMP_IF_TRUE:
+            return register_jump_instruction("REG_JUMP_IF_TRUE", 1, function, offset, 1);
+        case REG_LESS_JUMP_IF_FALSE:
+            return register_compare_jump_instruction("REG_LESS_JUMP_IF_FALSE", function, offset, false);
+        case REG_LESSK_JUMP_IF_FALSE:
+            return register_compare_jump_instruction("REG_LESSK_JUMP_IF_FALSE", function, offset, true);
+        case REG_LOOP:
+            return register_jump_instruction("REG_LOOP", -1, function, offset, 0);
+        case REG_CALL:
+            return register_call_instruction("REG_CALL", function, offset, false, false);
+        case REG_INVOKE:
+            return register_call_instruction("REG_INVOKE", function, offset, true, true);
+        case REG_SUPER_INVOKE:
+            return register_call_instruction("REG_SUPER_INVOKE", function, offset, true, false);
+        case REG_TAIL_CALL:
+            return register_call_instruction("REG_TAIL_CALL", function, offset, false, false);
+        case REG_TAIL_INVOKE:
+            return register_call_instruction("REG_TAIL_INVOKE", function, offset, true, true);
+        case REG_TAIL_SUPER_INVOKE:
+            return register_call_instruction("REG_TAIL_SUPER_INVOKE", function, offset, true, false);
+        case REG_CLOSURE: {
+            ObjFunction *closure = AS_FUNCTION(function->chunk.constants.values[chunk->code[offset + 2]]);
+            offset = register_instruction("REG_CLOSURE", function, offset, 1, true);
+            for (int j = 0; j < closure->upvalue_count; j++) {
+                int kind = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                printf("%04d      |                     %s %d\n", offset - 2, capture_names[kind], index);
+            }
+            return offset;
+        }
+        case REG_CLOSE_UPVALUE:
+            return register_instruction("REG_CLOSE_UPVALUE", function, offset, 1, false);
+        case REG_RETURN:
+            return register_instruction("REG_RETURN", function, offset, 1, false);
+        case REG_CLASS:
+            return register_instruction("REG_CLASS", function, offset, 1, true);
+        case REG_INHERIT:
+            return register_instruction("REG_INHERIT", function, offset, 2, false);
+        case REG_METHOD:
+            return register_instruction("REG_METHOD", function, offset, 2, true);
+        case REG_NEW_LIST:
+            return register_instruction("REG_NEW_LIST", function, offset, 1, false);
+        case REG_GET_LIST:
+            return register_instruction("REG_GET_LIST", function, offset, 3, false);
+        case REG_SET_LIST:
+            return register_instruction("REG_SET_LIST", function, offset, 4, false);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+const char* opcode_name(uint8_t opcode) {
+    if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0]) || opcode_names[opcode] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcode_names[opcode];
+}
+
+void print_opcode_pairs(uint64_t pairs[UINT8_COUNT][UINT8_COUNT], int limit) {
+    uint64_t total = 0;
+    for (int a = 0; a < UINT8_COUNT; a++) {
+        for (int b = 0; b < UINT8_COUNT; b++) {
+            total += pairs[a][b];
+        }
+    }
+    if (total == 0) return;
+
+    printf("== opcode pairs (%llu dispatches) ==\n", (unsigned long long) total);
+    uint64_t previous = UINT64_MAX;
+    for (int printed = 0; printed < limit;) {
+        uint64_t best = 0;
+        for (int a = 0; a < UINT8_COUNT; a++) {
+            for (int b = 0; b < UINT8_COUNT; b++) {
+                if (pairs[a][b] < previous && pairs[a][b] > best) best = pairs[a][b];
+            }
+        }
+        if (best == 0) return;
+
+        for (int a = 0; a < UINT8_COUNT && printed < limit; a++) {
+            for (int b = 0; b < UINT8_COUNT && printed < limit; b++) {
+                if (pairs[a][b] != best) continue;
+                printf("%6.2f%% %12llu  %-16s %s\n", 100.0 * best / total, (unsigned long long) best, opcode_name(a), opcode_name(b));
+                printed++;
+            }
+        }
+        previous = best;
+    }
+}
+
+#ifdef DEBUG_PROFILE_CACHES
+// Lists the inline caches that saw any traffic, function by function.
+void print_cache_profile(Obj *objects) {
+    printf("== inline caches ==\n");
+    for (Obj *object = objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction *function = (ObjFunction *) object;
+        for (int i = 0; i < function->chunk.cache_count; i++) {
+            InlineCache *cache = &function->chunk.caches[i];
+            if (cache->hits == 0 && cache->misses == 0) continue;
+            const char *state = "empty";
+            if (cache->megamorphic) {
+                state = "megamorphic";
+            } else if (cache->count > 1) {
+                state = "polymorphic";
+            } else if (cache->count == 1) {
+                state = "monomorphic";
+            }
+            printf("%-16s ic %-5d %12llu hits %8llu misses  %s\n",
+                   function->name != NULL ? function->name->chars : "<script>", i,
+                   (unsigned long long) cache->hits, (unsigned long long) cache->misses, state);
+        }
+    }
+}
+#endif
@@ -2,8 +2,16 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_instruction(Chunk *chunk, int offset);
+void disassemble_register_code(ObjFunction *function);
+int disassemble_register_instruction(ObjFunction *function, int offset);
+const char* opcode_name(uint8_t opcode);
+void print_opcode_pairs(uint64_t pairs[UINT8_COUNT][UINT8_COUNT], int limit);
+#ifdef DEBUG_PROFILE_CACHES
+void print_cache_profile(Obj *objects);
+#endif
 
 #endif
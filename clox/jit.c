@@ -0,0 +1,1607 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R12 12
+#define R14 14
+#define R15 15
+
+// Interpreter state pinned in callee-saved registers for the whole
+// function. The stack top is written back to vm.stack_top before every
+// call into the runtime and reloaded after it.
+#define STACK_TOP RBX
+#define SLOTS     R12
+#define FRAME     R14
+#define VM_TOP    R15
+
+#define CC_O  0x0
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xC
+#define CC_GE 0xD
+#define CC_G  0xF
+#define JMP   -1
+
+// Branch targets that aren't bytecode offsets.
+#define ERROR_EXIT -1
+#define DEOPTIMIZE(offset) (-2 - (offset))
+
+#define FACTS_MAX 32
+
+typedef struct {
+    ObjFunction *function;
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    int *offsets;
+    int *fixups;
+    int *fixup_targets;
+    int fixup_count;
+    int fixup_capacity;
+    bool failed;
+
+    // Only used by the optimizing tier. The facts record which values are
+    // known to be numbers and are forgotten at every jump target.
+    bool optimizing;
+    bool *labels;
+    bool facts[FACTS_MAX];
+    int fact_count;
+    bool local_facts[UINT8_COUNT];
+    bool bool_in_rax;
+} Jit;
+
+static void emit(Jit *jit, uint8_t byte) {
+    if (jit->capacity < jit->count + 1) {
+        jit->capacity = jit->capacity < 256 ? 256 : jit->capacity * 2;
+        jit->code = realloc(jit->code, jit->capacity);
+        if (jit->code == NULL) exit(1);
+    }
+    jit->code[jit->count++] = byte;
+}
+
+static void emit_bytes(Jit *jit, const uint8_t *bytes, int length) {
+    for (int i = 0; i < length; i++) {
+        emit(jit, bytes[i]);
+    }
+}
+
+static void emit32(Jit *jit, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit(jit, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void emit64(Jit *jit, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit(jit, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void emit_rex(Jit *jit, int reg, int rm) {
+    emit(jit, 0x48 | ((reg & 8) ? 0x4 : 0) | ((rm & 8) ? 0x1 : 0));
+}
+
+// An instruction with a [base + displacement] operand, where reg is either
+// a register or an opcode extension. Narrow instructions work on dwords.
+static void emit_memory_op(Jit *jit, bool wide, uint8_t opcode, int reg, int base, int32_t displacement) {
+    if (wide) {
+        emit_rex(jit, reg, base);
+    } else if ((reg & 8) || (base & 8)) {
+        emit(jit, 0x40 | ((reg & 8) ? 0x4 : 0) | ((base & 8) ? 0x1 : 0));
+    }
+    emit(jit, opcode);
+
+    int mod = 2;
+    if (displacement == 0 && (base & 7) != RBP) {
+        mod = 0;
+    } else if (displacement >= -128 && displacement <= 127) {
+        mod = 1;
+    }
+
+    emit(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emit(jit, 0x24);
+    if (mod == 1) emit(jit, (uint8_t) displacement);
+    if (mod == 2) emit32(jit, (uint32_t) displacement);
+}
+
+// mov dst, [base + displacement]
+static void emit_load(Jit *jit, int dst, int base, int32_t displacement) {
+    emit_memory_op(jit, true, 0x8B, dst, base, displacement);
+}
+
+// mov [base + displacement], src
+static void emit_store(Jit *jit, int base, int32_t displacement, int src) {
+    emit_memory_op(jit, true, 0x89, src, base, displacement);
+}
+
+static void emit_mov_imm(Jit *jit, int dst, uint64_t value) {
+    emit(jit, 0x48 | ((dst & 8) ? 0x1 : 0));
+    emit(jit, 0xB8 + (dst & 7));
+    emit64(jit, value);
+}
+
+// Register to register ALU instruction: 0x89 mov, 0x01 add, 0x21 and,
+// 0x39 cmp, 0x85 test.
+static void emit_alu(Jit *jit, uint8_t opcode, int dst, int src) {
+    emit_rex(jit, src, dst);
+    emit(jit, opcode);
+    emit(jit, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// Immediate ALU instruction, extension 0 is add, 5 is sub and 7 is cmp.
+static void emit_alu_imm(Jit *jit, int extension, int dst, int32_t value) {
+    emit_rex(jit, 0, dst);
+    if (value >= -128 && value <= 127) {
+        emit(jit, 0x83);
+        emit(jit, 0xC0 | (extension << 3) | (dst & 7));
+        emit(jit, (uint8_t) value);
+    } else {
+        emit(jit, 0x81);
+        emit(jit, 0xC0 | (extension << 3) | (dst & 7));
+        emit32(jit, (uint32_t) value);
+    }
+}
+
+// Shift by an immediate count, extension 4 is shl, 5 is shr and 7 is sar.
+static void emit_shift(Jit *jit, int extension, int reg, uint8_t count) {
+    emit_rex(jit, 0, reg);
+    emit(jit, 0xC1);
+    emit(jit, 0xC0 | (extension << 3) | (reg & 7));
+    emit(jit, count);
+}
+
+static int emit_branch(Jit *jit, int condition) {
+    if (condition == JMP) {
+        emit(jit, 0xE9);
+    } else {
+        emit(jit, 0x0F);
+        emit(jit, 0x80 + condition);
+    }
+    emit32(jit, 0);
+    return jit->count - 4;
+}
+
+static void patch_branch(Jit *jit, int at, int target) {
+    int32_t displacement = target - (at + 4);
+    memcpy(&jit->code[at], &displacement, sizeof(displacement));
+}
+
+static void patch_here(Jit *jit, int at) {
+    patch_branch(jit, at, jit->count);
+}
+
+// Branches to the code for a bytecode offset, the error exit or a
+// deoptimization stub.
+static void emit_branch_to(Jit *jit, int condition, int target) {
+    if (jit->fixup_capacity < jit->fixup_count + 1) {
+        jit->fixup_capacity = jit->fixup_capacity < 64 ? 64 : jit->fixup_capacity * 2;
+        jit->fixups = realloc(jit->fixups, jit->fixup_capacity * sizeof(int));
+        jit->fixup_targets = realloc(jit->fixup_targets, jit->fixup_capacity * sizeof(int));
+        if (jit->fixups == NULL || jit->fixup_targets == NULL) exit(1);
+    }
+
+    jit->fixups[jit->fixup_count] = emit_branch(jit, condition);
+    jit->fixup_targets[jit->fixup_count++] = target;
+}
+
+static void emit_call_address(Jit *jit, void *function) {
+    emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t) function);
+    emit(jit, 0xFF);            // call rax
+    emit(jit, 0xD0);
+}
+
+static void emit_prologue(Jit *jit) {
+    static const uint8_t prologue[] = {
+        0x55,                   // push rbp
+        0x48, 0x89, 0xE5,       // mov rbp, rsp
+        0x53,                   // push rbx
+        0x41, 0x54,             // push r12
+        0x41, 0x56,             // push r14
+        0x41, 0x57,             // push r15
+    };
+    emit_bytes(jit, prologue, sizeof(prologue));
+
+    emit_alu(jit, 0x89, FRAME, RDI);
+    emit_load(jit, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit_mov_imm(jit, VM_TOP, (uint64_t)(uintptr_t) &vm.stack_top);
+    emit_load(jit, STACK_TOP, VM_TOP, 0);
+
+    if (!jit->optimizing) {
+        // Baseline code keeps counting calls and hands the function to the
+        // optimizing tier once it is hot enough.
+        emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t) &jit->function->hotness);
+        emit_memory_op(jit, false, 0x83, 0, RAX, 0);    // add dword [rax], 1
+        emit(jit, 1);
+        emit_memory_op(jit, false, 0x81, 7, RAX, 0);    // cmp dword [rax], imm32
+        emit32(jit, JIT_OPTIMIZE_THRESHOLD);
+        int cold = emit_branch(jit, CC_NE);
+        emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) jit->function);
+        emit_call_address(jit, jit_optimize);
+        patch_here(jit, cold);
+    }
+}
+
+static void emit_epilogue(Jit *jit) {
+    static const uint8_t epilogue[] = {
+        0x41, 0x5F,             // pop r15
+        0x41, 0x5E,             // pop r14
+        0x41, 0x5C,             // pop r12
+        0x5B,                   // pop rbx
+        0x5D,                   // pop rbp
+        0xC3,                   // ret
+    };
+    emit_bytes(jit, epilogue, sizeof(epilogue));
+}
+
+// Leaves this function for the code a tail call helper returned in rax,
+// which then returns straight to our caller.
+static void emit_tail_jump(Jit *jit) {
+    static const uint8_t jump[] = {
+        0x41, 0x5F,             // pop r15
+        0x41, 0x5E,             // pop r14
+        0x41, 0x5C,             // pop r12
+        0x5B,                   // pop rbx
+        0x5D,                   // pop rbp
+        0xFF, 0xE0,             // jmp rax
+    };
+    emit_alu(jit, 0x89, RDI, FRAME);
+    emit_bytes(jit, jump, sizeof(jump));
+}
+
+static void emit_return(Jit *jit, InterpretResult result) {
+    emit(jit, 0xB8);            // mov eax, result
+    emit32(jit, result);
+    emit_epilogue(jit);
+}
+
+static void emit_push(Jit *jit, int reg) {
+    emit_store(jit, STACK_TOP, 0, reg);
+    emit_alu_imm(jit, 0, STACK_TOP, sizeof(Value));
+}
+
+static void emit_push_value(Jit *jit, Value value) {
+    emit_mov_imm(jit, RAX, value);
+    emit_push(jit, RAX);
+}
+
+static void emit_pop(Jit *jit) {
+    emit_alu_imm(jit, 5, STACK_TOP, sizeof(Value));
+}
+
+static void emit_get_local(Jit *jit, int slot) {
+    emit_load(jit, RAX, SLOTS, slot * (int) sizeof(Value));
+    emit_push(jit, RAX);
+}
+
+static void emit_set_local(Jit *jit, int slot) {
+    emit_load(jit, RAX, STACK_TOP, -(int) sizeof(Value));
+    emit_store(jit, SLOTS, slot * (int) sizeof(Value), RAX);
+}
+
+// Points frame->ip past the instruction, the same place the interpreter
+// would have it, so errors and calls see the right line.
+static void emit_save_ip(Jit *jit, int next) {
+    emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t) &jit->function->chunk.code[next]);
+    emit_store(jit, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+// Calls into the runtime with the arguments already in rdi, rsi, rdx and rcx.
+static void emit_runtime_call(Jit *jit, void *function, bool can_fail) {
+    emit_store(jit, VM_TOP, 0, STACK_TOP);
+    emit_call_address(jit, function);
+    if (can_fail) {
+        emit(jit, 0x84);        // test al, al
+        emit(jit, 0xC0);
+        emit_branch_to(jit, CC_E, ERROR_EXIT);
+    }
+    emit_load(jit, STACK_TOP, VM_TOP, 0);
+}
+
+// Calls can grow the call and value stacks, which moves them. Once a call
+// returns this frame is on top again, so find it and its slots afresh.
+static void emit_reload_frame(Jit *jit) {
+    emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t) &vm.frame_count);
+    emit_memory_op(jit, false, 0x8B, RAX, RAX, 0);     // mov eax, [rax]
+    emit_rex(jit, RAX, RAX);                            // imul rax, rax, imm32
+    emit(jit, 0x69);
+    emit(jit, 0xC0 | (RAX << 3) | RAX);
+    emit32(jit, sizeof(CallFrame));
+    emit_mov_imm(jit, RCX, (uint64_t)(uintptr_t) &vm.frames);
+    emit_load(jit, RCX, RCX, 0);
+    emit_alu(jit, 0x01, RAX, RCX);
+    emit_memory_op(jit, true, 0x8D, FRAME, RAX, -(int) sizeof(CallFrame));
+    emit_load(jit, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+static void emit_name_call(Jit *jit, void *function, Value name, int next) {
+    emit_save_ip(jit, next);
+    emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(name));
+    emit_runtime_call(jit, function, true);
+}
+
+// Only baseline code records feedback.
+static uint64_t feedback_at(Jit *jit, int offset) {
+    if (jit->optimizing) return 0;
+    return (uint64_t)(uintptr_t) &jit->function->feedback[offset];
+}
+
+static uint64_t cache_at(Jit *jit, uint8_t *operand) {
+    return (uint64_t)(uintptr_t) &jit->function->chunk.caches[read_cache_index(operand)];
+}
+
+// The interpreter's cached_field() in machine code: leaves the address of
+// the field that the cache's first entry finds for the instance at
+// distance in rax, or takes one of the returned branches. Expects the
+// cache in rdx.
+static void emit_cached_field(Jit *jit, int distance, int slow[4]) {
+    static const uint8_t not_rcx[] = { 0x48, 0xF7, 0xD1 };
+    emit_load(jit, RAX, STACK_TOP, -(distance + 1) * (int) sizeof(Value));
+    emit_mov_imm(jit, RCX, SIGN_BIT | QNAN);
+    emit_alu(jit, 0x89, RSI, RAX);
+    emit_alu(jit, 0x21, RSI, RCX);
+    emit_alu(jit, 0x39, RSI, RCX);
+    slow[0] = emit_branch(jit, CC_NE);
+    emit_bytes(jit, not_rcx, sizeof(not_rcx));
+    emit_alu(jit, 0x21, RAX, RCX);
+    emit_memory_op(jit, false, 0x83, 7, RAX, offsetof(Obj, type));
+    emit(jit, OBJ_INSTANCE);
+    slow[1] = emit_branch(jit, CC_NE);
+
+    int entry = offsetof(InlineCache, entries);
+    emit_load(jit, RCX, RAX, offsetof(ObjInstance, shape));
+    emit_memory_op(jit, true, 0x3B, RCX, RDX, entry + offsetof(CacheEntry, shape));    // cmp rcx, [rdx + shape]
+    slow[2] = emit_branch(jit, CC_NE);
+    emit_memory_op(jit, false, 0x83, 7, RDX, entry + offsetof(CacheEntry, kind));
+    emit(jit, CACHE_FIELD);
+    slow[3] = emit_branch(jit, CC_NE);
+
+#ifdef DEBUG_PROFILE_CACHES
+    emit_memory_op(jit, true, 0x83, 0, RDX, offsetof(InlineCache, hits));              // add qword [rdx + hits], 1
+    emit(jit, 1);
+#endif
+    emit_memory_op(jit, true, 0x63, RCX, RDX, entry + offsetof(CacheEntry, slot));      // movsxd rcx, [rdx + slot]
+    emit_shift(jit, 4, RCX, 3);
+    emit_load(jit, RAX, RAX, offsetof(ObjInstance, fields));
+    emit_alu(jit, 0x01, RAX, RCX);
+}
+
+// Property reads that the inline path handles never reach the runtime,
+// so their feedback starts out with what the cache has already seen.
+static void seed_property_feedback(Jit *jit, uint8_t *operand, int offset) {
+    InlineCache *cache = &jit->function->chunk.caches[read_cache_index(operand)];
+    Feedback *feedback = &jit->function->feedback[offset];
+    if (cache->count > 0) feedback->target = (Obj *) cache->entries[0].shape;
+    if (cache->count > 1 || cache->megamorphic) feedback->types |= FEEDBACK_POLYMORPHIC;
+}
+
+// Property accesses try the monomorphic case inline and leave the rest to
+// the runtime, which also fills the cache and records the receiver's shape
+// for reads.
+static void emit_property(Jit *jit, bool set, Value name, uint8_t *cache, int offset, int next) {
+    int slow[4];
+    if (!set && !jit->optimizing) seed_property_feedback(jit, cache, offset);
+    emit_mov_imm(jit, RDX, cache_at(jit, cache));
+    emit_cached_field(jit, set ? 1 : 0, slow);
+    if (set) {
+        emit_load(jit, RCX, STACK_TOP, -(int) sizeof(Value));
+        emit_store(jit, RAX, 0, RCX);
+        emit_store(jit, STACK_TOP, -2 * (int) sizeof(Value), RCX);
+        emit_pop(jit);
+    } else {
+        emit_load(jit, RAX, RAX, 0);
+        emit_store(jit, STACK_TOP, -(int) sizeof(Value), RAX);
+    }
+    int done = emit_branch(jit, JMP);
+
+    for (int i = 0; i < 4; i++) {
+        patch_here(jit, slow[i]);
+    }
+    emit_save_ip(jit, next);
+    emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(name));
+    emit_mov_imm(jit, RSI, cache_at(jit, cache));
+    if (!set) emit_mov_imm(jit, RDX, feedback_at(jit, offset));
+    emit_runtime_call(jit, set ? (void *) runtime_set_property : (void *) runtime_get_property, true);
+    patch_here(jit, done);
+}
+
+// Globals are read and written in their slot, leaving undefined ones to
+// the runtime to report.
+static void emit_global(Jit *jit, bool set, Value name, int next) {
+    int32_t slot = AS_STRING(name)->global * (int) sizeof(Value);
+    emit_mov_imm(jit, RAX, (uint64_t)(uintptr_t) &vm.globals.values);
+    emit_load(jit, RAX, RAX, 0);
+    emit_load(jit, RCX, RAX, slot);
+    emit_mov_imm(jit, RDX, UNDEFINED_VAL);
+    emit_alu(jit, 0x39, RCX, RDX);
+    int undefined = emit_branch(jit, CC_E);
+    if (set) {
+        emit_load(jit, RCX, STACK_TOP, -(int) sizeof(Value));
+        emit_store(jit, RAX, slot, RCX);
+    } else {
+        emit_push(jit, RCX);
+    }
+    int done = emit_branch(jit, JMP);
+
+    patch_here(jit, undefined);
+    emit_name_call(jit, set ? (void *) runtime_set_global : (void *) runtime_get_global, name, next);
+    patch_here(jit, done);
+}
+
+// Sets ZF when reg isn't a double. Expects QNAN in rdx.
+static void emit_number_test(Jit *jit, int reg) {
+    emit_alu(jit, 0x89, RSI, reg);
+    emit_alu(jit, 0x21, RSI, RDX);
+    emit_alu(jit, 0x39, RSI, RDX);
+}
+
+// Sets rax to TRUE_VAL or FALSE_VAL from the flag in al.
+static void emit_bool_from_al(Jit *jit) {
+    static const uint8_t widen[] = { 0x0F, 0xB6, 0xC0 };   // movzx eax, al
+    emit_bytes(jit, widen, sizeof(widen));
+    emit_mov_imm(jit, RCX, FALSE_VAL);
+    emit_alu(jit, 0x01, RAX, RCX);
+}
+
+// Computes rax op rcx on two numbers, leaving the resulting value in rax.
+static void emit_number_op(Jit *jit, OpCode op) {
+    static const uint8_t load_operands[] = {
+        0x66, 0x48, 0x0F, 0x6E, 0xC0,   // movq xmm0, rax
+        0x66, 0x48, 0x0F, 0x6E, 0xC9,   // movq xmm1, rcx
+    };
+    emit_bytes(jit, load_operands, sizeof(load_operands));
+
+    switch (op) {
+        case OP_GREATER:
+        case OP_LESS: {
+            uint8_t compare[] = {
+                0x66, 0x0F, 0x2E, op == OP_LESS ? 0xC8 : 0xC1,   // ucomisd
+                0x0F, 0x97, 0xC0,                                 // seta al
+            };
+            emit_bytes(jit, compare, sizeof(compare));
+            emit_bool_from_al(jit);
+            break;
+        }
+        default: {
+            uint8_t arithmetic = 0x58;
+            if (op == OP_SUBTRACT) arithmetic = 0x5C;
+            if (op == OP_MULTIPLY) arithmetic = 0x59;
+            if (op == OP_DIVIDE) arithmetic = 0x5E;
+            uint8_t instruction[] = {
+                0xF2, 0x0F, arithmetic, 0xC1,       // op xmm0, xmm1
+                0x66, 0x48, 0x0F, 0x7E, 0xC0,       // movq rax, xmm0
+            };
+            emit_bytes(jit, instruction, sizeof(instruction));
+            break;
+        }
+    }
+}
+
+// Jumps to the returned fixup unless reg holds an integer. Clobbers rsi.
+static int emit_int_test(Jit *jit, int reg) {
+    emit_alu(jit, 0x89, RSI, reg);
+    emit_shift(jit, 5, RSI, 48);
+    emit_alu_imm(jit, 7, RSI, (int32_t) ((QNAN | TAG_INT) >> 48));
+    return emit_branch(jit, CC_NE);
+}
+
+// Computes rax op rcx on two integers, leaving the resulting value in rax.
+// Both are shifted up to the top of the register first so that the
+// processor's overflow flag catches results that don't fit in 48 bits,
+// which are left to the runtime to turn into doubles. Returns that
+// branch, or -1 for comparisons, which can't overflow.
+static int emit_int_op(Jit *jit, OpCode op) {
+    static const uint8_t imul[] = { 0x48, 0x0F, 0xAF, 0xC1 };    // imul rax, rcx
+    // A product only needs one of its factors scaled, so the other one is
+    // just sign extended.
+    emit_shift(jit, 4, RAX, 16);
+    if (op == OP_MULTIPLY) emit_shift(jit, 7, RAX, 16);
+    emit_shift(jit, 4, RCX, 16);
+
+    switch (op) {
+        case OP_GREATER:
+        case OP_LESS: {
+            uint8_t compare[] = { 0x0F, op == OP_LESS ? 0x9C : 0x9F, 0xC0 };   // setl/setg al
+            emit_alu(jit, 0x39, RAX, RCX);
+            emit_bytes(jit, compare, sizeof(compare));
+            emit_bool_from_al(jit);
+            return -1;
+        }
+        case OP_MULTIPLY:
+            emit_bytes(jit, imul, sizeof(imul));
+            break;
+        default:
+            emit_alu(jit, op == OP_SUBTRACT ? 0x29 : 0x01, RAX, RCX);
+            break;
+    }
+    int overflow = emit_branch(jit, CC_O);
+    emit_shift(jit, 5, RAX, 16);
+    emit_mov_imm(jit, RCX, QNAN | TAG_INT);
+    emit_alu(jit, 0x09, RAX, RCX);
+    return overflow;
+}
+
+// Doubles and integers are handled inline; anything else goes through the
+// runtime, which mixes the two, concatenates strings or reports the error.
+static void emit_binary(Jit *jit, OpCode op, int offset, int next) {
+    emit_load(jit, RAX, STACK_TOP, -2 * (int) sizeof(Value));
+    emit_load(jit, RCX, STACK_TOP, -(int) sizeof(Value));
+    emit_mov_imm(jit, RDX, QNAN);
+    emit_number_test(jit, RAX);
+    int a_slow = emit_branch(jit, CC_E);
+    emit_number_test(jit, RCX);
+    int b_slow = emit_branch(jit, CC_E);
+    emit_number_op(jit, op);
+    emit_store(jit, STACK_TOP, -2 * (int) sizeof(Value), RAX);
+    emit_pop(jit);
+    int done = emit_branch(jit, JMP);
+
+    patch_here(jit, a_slow);
+    patch_here(jit, b_slow);
+    int int_done = -1;
+    int slow[3] = { -1, -1, -1 };
+    if (op != OP_DIVIDE) {
+        slow[0] = emit_int_test(jit, RAX);
+        slow[1] = emit_int_test(jit, RCX);
+        slow[2] = emit_int_op(jit, op);
+        if (feedback_at(jit, offset) != 0) {
+            // Integers mustn't look like doubles to the optimizing tier.
+            emit_mov_imm(jit, RSI, feedback_at(jit, offset));
+            emit_memory_op(jit, false, 0x80, 1, RSI, offsetof(Feedback, types));    // or byte [rsi], imm8
+            emit(jit, FEEDBACK_NOT_NUMBER);
+        }
+        emit_store(jit, STACK_TOP, -2 * (int) sizeof(Value), RAX);
+        emit_pop(jit);
+        int_done = emit_branch(jit, JMP);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (slow[i] != -1) patch_here(jit, slow[i]);
+    }
+    emit_save_ip(jit, next);
+    emit_mov_imm(jit, RDI, op);
+    emit_mov_imm(jit, RSI, feedback_at(jit, offset));
+    emit_runtime_call(jit, runtime_binary_op, true);
+    patch_here(jit, done);
+    if (int_done != -1) patch_here(jit, int_done);
+}
+
+static void emit_falsey_compare(Jit *jit) {
+    emit_load(jit, RAX, STACK_TOP, -(int) sizeof(Value));
+    emit_mov_imm(jit, RCX, NIL_VAL);
+    emit_mov_imm(jit, RDX, FALSE_VAL);
+}
+
+static void emit_jump_if_false(Jit *jit, int target) {
+    emit_falsey_compare(jit);
+    emit_alu(jit, 0x39, RAX, RCX);
+    emit_branch_to(jit, CC_E, target);
+    emit_alu(jit, 0x39, RAX, RDX);
+    emit_branch_to(jit, CC_E, target);
+}
+
+static void emit_jump_if_true(Jit *jit, int target) {
+    emit_falsey_compare(jit);
+    emit_alu(jit, 0x39, RAX, RCX);
+    int nil = emit_branch(jit, CC_E);
+    emit_alu(jit, 0x39, RAX, RDX);
+    emit_branch_to(jit, CC_NE, target);
+    patch_here(jit, nil);
+}
+
+static void emit_not(Jit *jit) {
+    static const uint8_t falsey[] = {
+        0x48, 0x39, 0xC8,       // cmp rax, rcx
+        0x0F, 0x94, 0xC1,       // sete cl
+        0x48, 0x39, 0xD0,       // cmp rax, rdx
+        0x0F, 0x94, 0xC0,       // sete al
+        0x08, 0xC8,             // or al, cl
+    };
+    emit_falsey_compare(jit);
+    emit_bytes(jit, falsey, sizeof(falsey));
+    emit_bool_from_al(jit);
+    emit_store(jit, STACK_TOP, -(int) sizeof(Value), RAX);
+}
+
+// Leaves the upvalue's location in rax.
+static void emit_upvalue_location(Jit *jit, int index) {
+    emit_load(jit, RAX, FRAME, offsetof(CallFrame, closure));
+    emit_load(jit, RAX, RAX, offsetof(ObjClosure, upvalues));
+    emit_load(jit, RAX, RAX, index * (int) sizeof(ObjUpvalue *));
+    emit_load(jit, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+// Takes a step of a for-in loop in the runtime and goes back to the body
+// at target if there is another element.
+static void emit_for_step(Jit *jit, void *function, int slot, int target, int next) {
+    emit_save_ip(jit, next);
+    emit_memory_op(jit, true, 0x8D, RDI, SLOTS, slot * (int) sizeof(Value));  // lea rdi, [slots + slot]
+    emit_runtime_call(jit, function, true);
+    emit(jit, 0x3C);            // cmp al, FOR_NEXT
+    emit(jit, FOR_NEXT);
+    emit_branch_to(jit, CC_E, target);
+}
+
+// Counts through a range of integers inline. The counter stays below the
+// bound, so adding one to it can't overflow.
+static void emit_for_range(Jit *jit, int slot, int target, int next) {
+    int counter = slot * (int) sizeof(Value);
+    int slow[2];
+    emit_load(jit, RAX, SLOTS, counter);
+    emit_load(jit, RCX, SLOTS, counter + (int) sizeof(Value));
+    slow[0] = emit_int_test(jit, RAX);
+    slow[1] = emit_int_test(jit, RCX);
+    emit_alu(jit, 0x89, RDX, RAX);
+    emit_shift(jit, 4, RDX, 16);
+    emit_shift(jit, 4, RCX, 16);
+    emit_alu(jit, 0x39, RDX, RCX);
+    int done = emit_branch(jit, CC_GE);
+    emit_store(jit, SLOTS, counter + 2 * (int) sizeof(Value), RAX);
+    emit_alu_imm(jit, 0, RDX, 1 << 16);
+    emit_shift(jit, 5, RDX, 16);
+    emit_mov_imm(jit, RCX, QNAN | TAG_INT);
+    emit_alu(jit, 0x09, RDX, RCX);
+    emit_store(jit, SLOTS, counter, RDX);
+    emit_branch_to(jit, JMP, target);
+
+    patch_here(jit, slow[0]);
+    patch_here(jit, slow[1]);
+    emit_for_step(jit, runtime_for_range, slot, target, next);
+    patch_here(jit, done);
+}
+
+// The runtime picks the arm, which indexes a table of jumps, one to each.
+static void emit_switch(Jit *jit, SwitchTable *table) {
+    emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) table);
+    emit_runtime_call(jit, runtime_switch, false);
+    static const uint8_t dispatch[] = {
+        0x89, 0xC0,                     // mov eax, eax
+        0x48, 0x8D, 0x0D, 9, 0, 0, 0,   // lea rcx, [rip + 9]
+        0x48, 0x8D, 0x04, 0x80,         // lea rax, [rax + rax * 4]
+        0x48, 0x01, 0xC8,               // add rax, rcx
+        0xFF, 0xE0,                     // jmp rax
+    };
+    emit_bytes(jit, dispatch, sizeof(dispatch));
+    for (int arm = 0; arm < table->arm_count; arm++) {
+        emit_branch_to(jit, JMP, table->targets[arm]);
+    }
+}
+
+static void compile_instruction(Jit *jit, int offset, int next) {
+    Chunk *chunk = &jit->function->chunk;
+    uint8_t *code = &chunk->code[offset];
+    Value *constants = chunk->constants.values;
+
+    switch (code[0]) {
+        case OP_CONSTANT: emit_push_value(jit, constants[code[1]]); break;
+        case OP_NIL: emit_push_value(jit, NIL_VAL); break;
+        case OP_TRUE: emit_push_value(jit, TRUE_VAL); break;
+        case OP_FALSE: emit_push_value(jit, FALSE_VAL); break;
+        case OP_POP: emit_pop(jit); break;
+        case OP_GET_LOCAL: emit_get_local(jit, code[1]); break;
+        case OP_SET_LOCAL: emit_set_local(jit, code[1]); break;
+        case OP_GET_GLOBAL: emit_global(jit, false, constants[code[1]], next); break;
+        case OP_DEFINE_GLOBAL:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_runtime_call(jit, runtime_define_global, false);
+            break;
+        case OP_SET_GLOBAL: emit_global(jit, true, constants[code[1]], next); break;
+        case OP_GET_UPVALUE:
+            emit_upvalue_location(jit, code[1]);
+            emit_load(jit, RAX, RAX, 0);
+            emit_push(jit, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            emit_upvalue_location(jit, code[1]);
+            emit_load(jit, RCX, STACK_TOP, -(int) sizeof(Value));
+            emit_store(jit, RAX, 0, RCX);
+            break;
+        case OP_GET_PROPERTY: emit_property(jit, false, constants[code[1]], &code[2], offset, next); break;
+        case OP_SET_PROPERTY: emit_property(jit, true, constants[code[1]], &code[2], offset, next); break;
+        case OP_GET_SUPER: emit_name_call(jit, runtime_get_super, constants[code[1]], next); break;
+        case OP_EQUAL:
+        case OP_MOD:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, code[0]);
+            emit_mov_imm(jit, RSI, 0);
+            emit_runtime_call(jit, runtime_binary_op, true);
+            break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            emit_binary(jit, OP_GREATER, offset, next);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            emit_binary(jit, OP_LESS, offset, next);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+            emit_binary(jit, OP_ADD, offset, next);
+            break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            emit_binary(jit, code[0], offset, next);
+            break;
+        case OP_NOT: emit_not(jit); break;
+        case OP_NEGATE:
+            emit_save_ip(jit, next);
+            emit_runtime_call(jit, runtime_negate, true);
+            break;
+        case OP_PRINT: emit_runtime_call(jit, runtime_print, false); break;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_LOOP_LONG:
+            emit_branch_to(jit, JMP, jump_target(chunk, offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            emit_jump_if_false(jit, jump_target(chunk, offset));
+            break;
+        case OP_JUMP_IF_TRUE: emit_jump_if_true(jit, jump_target(chunk, offset)); break;
+        case OP_FOR_RANGE: emit_for_range(jit, code[1], jump_target(chunk, offset), next); break;
+        case OP_FOR_LIST: emit_for_step(jit, runtime_for_list, code[1], jump_target(chunk, offset), next); break;
+        case OP_FOR_RANGE_LONG:
+            emit_for_range(jit, read_long(&code[1]), jump_target(chunk, offset), next);
+            break;
+        case OP_FOR_LIST_LONG:
+            emit_for_step(jit, runtime_for_list, read_long(&code[1]), jump_target(chunk, offset), next);
+            break;
+        case OP_SWITCH: emit_switch(jit, switch_table(chunk, offset)); break;
+        case OP_CALL:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, code[1]);
+            emit_mov_imm(jit, RSI, feedback_at(jit, offset));
+            emit_runtime_call(jit, runtime_call, true);
+            emit_reload_frame(jit);
+            break;
+        case OP_CALL_SCOPED:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, code[1]);
+            emit_runtime_call(jit, runtime_call_scoped, true);
+            emit_reload_frame(jit);
+            break;
+        case OP_POP_SCOPED: emit_runtime_call(jit, runtime_pop_scoped, false); break;
+        case OP_INTRINSIC:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, code[1]);
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_runtime_call(jit, runtime_intrinsic, true);
+            emit_reload_frame(jit);
+            break;
+        case OP_INVOKE:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_mov_imm(jit, RDX, feedback_at(jit, offset));
+            emit_mov_imm(jit, RCX, cache_at(jit, &code[3]));
+            emit_runtime_call(jit, runtime_invoke, true);
+            emit_reload_frame(jit);
+            break;
+        case OP_SUPER_INVOKE:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_runtime_call(jit, runtime_super_invoke, true);
+            emit_reload_frame(jit);
+            break;
+        case OP_TAIL_CALL:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, code[1]);
+            emit_runtime_call(jit, runtime_tail_call, false);
+            emit_tail_jump(jit);
+            break;
+        case OP_TAIL_INVOKE:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_mov_imm(jit, RDX, cache_at(jit, &code[3]));
+            emit_runtime_call(jit, runtime_tail_invoke, false);
+            emit_tail_jump(jit);
+            break;
+        case OP_TAIL_SUPER_INVOKE:
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_runtime_call(jit, runtime_tail_super_invoke, false);
+            emit_tail_jump(jit);
+            break;
+        case OP_CLOSURE:
+            emit_alu(jit, 0x89, RDI, FRAME);
+            emit_mov_imm(jit, RSI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) &code[2]);
+            emit_mov_imm(jit, RCX, false);
+            emit_runtime_call(jit, runtime_closure, false);
+            break;
+        case OP_CLOSE_UPVALUE: emit_runtime_call(jit, runtime_close_upvalue, false); break;
+        case OP_RETURN:
+            emit_alu(jit, 0x89, RDI, FRAME);
+            emit_runtime_call(jit, runtime_return, false);
+            emit_return(jit, INTERPRET_OK);
+            break;
+        case OP_CLASS:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_runtime_call(jit, runtime_class, false);
+            break;
+        case OP_INHERIT:
+            emit_save_ip(jit, next);
+            emit_runtime_call(jit, runtime_inherit, true);
+            break;
+        case OP_METHOD:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_runtime_call(jit, runtime_method, false);
+            break;
+        case OP_NEW_LIST: emit_runtime_call(jit, runtime_new_list, false); break;
+        case OP_GET_LIST:
+        case OP_GET_LIST_NUMIDX:
+            emit_save_ip(jit, next);
+            emit_runtime_call(jit, runtime_get_list, true);
+            break;
+        case OP_SET_LIST:
+        case OP_SET_LIST_NUMIDX:
+            emit_save_ip(jit, next);
+            emit_runtime_call(jit, runtime_set_list, true);
+            break;
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            emit_get_local(jit, code[1]);
+            emit_get_local(jit, code[2]);
+            emit_binary(jit, OP_ADD, offset, next);
+            break;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            emit_get_local(jit, code[1]);
+            emit_push_value(jit, constants[code[2]]);
+            emit_binary(jit, code[0] == OP_GET_LOCAL_CONSTANT_ADD ? OP_ADD : OP_SUBTRACT, offset, next);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            emit_binary(jit, OP_LESS, offset, next);
+            emit_jump_if_false(jit, jump_target(chunk, offset));
+            break;
+        case OP_SET_LOCAL_POP:
+            emit_set_local(jit, code[1]);
+            emit_pop(jit);
+            break;
+        case OP_CONSTANT_LONG: emit_push_value(jit, constants[read_long(&code[1])]); break;
+        case OP_GET_LOCAL_LONG: emit_get_local(jit, read_long(&code[1])); break;
+        case OP_SET_LOCAL_LONG: emit_set_local(jit, read_long(&code[1])); break;
+        case OP_GET_GLOBAL_LONG:
+            emit_global(jit, false, constants[read_long(&code[1])], next);
+            break;
+        case OP_DEFINE_GLOBAL_LONG:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[read_long(&code[1])]));
+            emit_runtime_call(jit, runtime_define_global, false);
+            break;
+        case OP_SET_GLOBAL_LONG:
+            emit_global(jit, true, constants[read_long(&code[1])], next);
+            break;
+        case OP_GET_PROPERTY_LONG:
+            emit_property(jit, false, constants[read_long(&code[1])], &code[4], offset, next);
+            break;
+        case OP_SET_PROPERTY_LONG:
+            emit_property(jit, true, constants[read_long(&code[1])], &code[4], offset, next);
+            break;
+        case OP_GET_SUPER_LONG:
+            emit_name_call(jit, runtime_get_super, constants[read_long(&code[1])], next);
+            break;
+        case OP_CLOSURE_LONG:
+            emit_alu(jit, 0x89, RDI, FRAME);
+            emit_mov_imm(jit, RSI, (uint64_t)(uintptr_t) AS_OBJ(constants[read_long(&code[1])]));
+            emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) &code[4]);
+            emit_mov_imm(jit, RCX, true);
+            emit_runtime_call(jit, runtime_closure, false);
+            break;
+        case OP_CLASS_LONG:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[read_long(&code[1])]));
+            emit_runtime_call(jit, runtime_class, false);
+            break;
+        case OP_METHOD_LONG:
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[read_long(&code[1])]));
+            emit_runtime_call(jit, runtime_method, false);
+            break;
+        default:
+            jit->failed = true;
+            break;
+    }
+}
+
+// The optimizing tier keeps the baseline's stack layout, so a frame can be
+// handed back to the interpreter at any instruction, but it trusts the
+// feedback the baseline code gathered. Arithmetic that has only seen
+// numbers is guarded instead of getting a slow path, and call sites that
+// have only seen one function jump straight into its code.
+
+static void push_fact(Jit *jit, bool number) {
+    if (jit->fact_count == FACTS_MAX) {
+        memmove(jit->facts, jit->facts + 1, (FACTS_MAX - 1) * sizeof(bool));
+        jit->fact_count--;
+    }
+    jit->facts[jit->fact_count++] = number;
+}
+
+static void pop_facts(Jit *jit, int count) {
+    jit->fact_count = count > jit->fact_count ? 0 : jit->fact_count - count;
+}
+
+static bool known_number(Jit *jit, int distance) {
+    return distance < jit->fact_count && jit->facts[jit->fact_count - 1 - distance];
+}
+
+static void forget_facts(Jit *jit) {
+    jit->fact_count = 0;
+    memset(jit->local_facts, 0, sizeof(jit->local_facts));
+    jit->bool_in_rax = false;
+}
+
+// Whether the instruction at offset is compiled on the assumption that
+// its operands are numbers.
+static bool speculates(Jit *jit, int offset) {
+    Chunk *chunk = &jit->function->chunk;
+    if (jit->function->feedback[offset].types & FEEDBACK_NOT_NUMBER) return false;
+
+    switch (chunk->code[offset]) {
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            return IS_DOUBLE(chunk->constants.values[chunk->code[offset + 2]]);
+        default:
+            return true;
+    }
+}
+
+typedef enum {
+    OPERAND_STACK,
+    OPERAND_LOCAL,
+    OPERAND_CONSTANT,
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int index;
+    bool known;
+} Operand;
+
+static Operand stack_operand(Jit *jit, int distance) {
+    Operand operand = { OPERAND_STACK, distance, known_number(jit, distance) };
+    return operand;
+}
+
+static Operand local_operand(Jit *jit, int slot) {
+    Operand operand = { OPERAND_LOCAL, slot, jit->local_facts[slot] };
+    return operand;
+}
+
+// The fused constant forms take any constant, so a string needs its guard
+// like any other operand.
+static Operand constant_operand(Jit *jit, int index) {
+    Operand operand = { OPERAND_CONSTANT, index, IS_NUMBER(jit->function->chunk.constants.values[index]) };
+    return operand;
+}
+
+static void emit_load_operand(Jit *jit, int reg, Operand operand) {
+    switch (operand.kind) {
+        case OPERAND_STACK:
+            emit_load(jit, reg, STACK_TOP, -(operand.index + 1) * (int) sizeof(Value));
+            break;
+        case OPERAND_LOCAL:
+            emit_load(jit, reg, SLOTS, operand.index * (int) sizeof(Value));
+            break;
+        case OPERAND_CONSTANT:
+            emit_mov_imm(jit, reg, jit->function->chunk.constants.values[operand.index]);
+            break;
+    }
+}
+
+static void emit_number_guard(Jit *jit, int reg, int offset) {
+    emit_number_test(jit, reg);
+    emit_branch_to(jit, CC_E, DEOPTIMIZE(offset));
+}
+
+// A failing guard leaves the stack untouched, so the interpreter can redo
+// the whole instruction.
+static void emit_speculative_binary(Jit *jit, OpCode op, Operand a, Operand b, int offset) {
+    int pops = (a.kind == OPERAND_STACK) + (b.kind == OPERAND_STACK);
+    emit_load_operand(jit, RAX, a);
+    emit_load_operand(jit, RCX, b);
+    if (!a.known || !b.known) emit_mov_imm(jit, RDX, QNAN);
+    if (!a.known) emit_number_guard(jit, RAX, offset);
+    if (!b.known) emit_number_guard(jit, RCX, offset);
+
+    emit_number_op(jit, op);
+    emit_store(jit, STACK_TOP, -pops * (int) sizeof(Value), RAX);
+    if (pops != 1) emit_alu_imm(jit, 0, STACK_TOP, (1 - pops) * (int) sizeof(Value));
+    jit->bool_in_rax = op == OP_LESS || op == OP_GREATER;
+}
+
+// Branches on a boolean the previous instruction left in rax, when it is
+// false with CC_E and when it is true with CC_NE.
+static void emit_bool_jump(Jit *jit, int condition, int target) {
+    emit(jit, 0xA8);            // test al, 1
+    emit(jit, 0x01);
+    emit_branch_to(jit, condition, target);
+}
+
+// Calls a closure over target without going through the runtime, as long
+// as the callee really is one and target already has machine code.
+// Anything else takes the generic path.
+static void emit_direct_call(Jit *jit, ObjFunction *target, int arg_count, int next) {
+    static const uint8_t not_rcx[] = { 0x48, 0xF7, 0xD1 };
+    static const uint8_t call_rcx[] = { 0xFF, 0xD1 };
+    static const uint8_t test_eax[] = { 0x85, 0xC0 };
+    int callee = -(arg_count + 1) * (int) sizeof(Value);
+    int slow[7];
+
+    emit_save_ip(jit, next);
+    emit_load(jit, RAX, STACK_TOP, callee);
+    emit_mov_imm(jit, RCX, SIGN_BIT | QNAN);
+    emit_alu(jit, 0x89, RDX, RAX);
+    emit_alu(jit, 0x21, RDX, RCX);
+    emit_alu(jit, 0x39, RDX, RCX);
+    slow[0] = emit_branch(jit, CC_NE);
+    emit_bytes(jit, not_rcx, sizeof(not_rcx));
+    emit_alu(jit, 0x21, RAX, RCX);
+    emit_memory_op(jit, false, 0x83, 7, RAX, offsetof(Obj, type));
+    emit(jit, OBJ_CLOSURE);
+    slow[1] = emit_branch(jit, CC_NE);
+
+    emit_load(jit, RCX, RAX, offsetof(ObjClosure, function));
+    emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) target);
+    emit_alu(jit, 0x39, RCX, RDX);
+    slow[2] = emit_branch(jit, CC_NE);
+    emit_load(jit, RCX, RDX, offsetof(ObjFunction, native_code));
+    emit_alu(jit, 0x85, RCX, RCX);
+    slow[3] = emit_branch(jit, CC_E);
+
+    // The frame has to fit without growing either stack, and the C stack
+    // has to have room for the call.
+    emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) &vm.frame_count);
+    emit_memory_op(jit, false, 0x8B, RSI, RDX, 0);     // mov esi, [rdx]
+    emit_mov_imm(jit, R8, (uint64_t)(uintptr_t) &vm.frame_capacity);
+    emit_memory_op(jit, false, 0x3B, RSI, R8, 0);      // cmp esi, [r8]
+    slow[4] = emit_branch(jit, CC_AE);
+    emit_memory_op(jit, true, 0x8D, RDI, STACK_TOP, callee + target->max_slots * (int) sizeof(Value));
+    emit_mov_imm(jit, R8, (uint64_t)(uintptr_t) &vm.stack_end);
+    emit_memory_op(jit, true, 0x3B, RDI, R8, 0);       // cmp rdi, [r8]
+    slow[5] = emit_branch(jit, CC_A);
+    emit_mov_imm(jit, R8, (uint64_t)(uintptr_t) &vm.c_stack_limit);
+    emit_memory_op(jit, true, 0x3B, RSP, R8, 0);       // cmp rsp, [r8]
+    slow[6] = emit_branch(jit, CC_B);
+
+    emit_rex(jit, RDI, RSI);                            // imul rdi, rsi, imm32
+    emit(jit, 0x69);
+    emit(jit, 0xC0 | (RDI << 3) | RSI);
+    emit32(jit, sizeof(CallFrame));
+    emit_mov_imm(jit, R8, (uint64_t)(uintptr_t) &vm.frames);
+    emit_load(jit, R8, R8, 0);
+    emit_alu(jit, 0x01, RDI, R8);
+    emit_memory_op(jit, false, 0xFF, 0, RDX, 0);       // inc dword [rdx]
+
+    emit_store(jit, RDI, offsetof(CallFrame, closure), RAX);
+    emit_memory_op(jit, true, 0x8D, R8, STACK_TOP, callee);
+    emit_store(jit, RDI, offsetof(CallFrame, slots), R8);
+    emit_mov_imm(jit, R8, (uint64_t)(uintptr_t) target->chunk.code);
+    emit_store(jit, RDI, offsetof(CallFrame, ip), R8);
+    emit_memory_op(jit, false, 0xC7, 0, RDI, offsetof(CallFrame, engine));
+    emit32(jit, ENGINE_NATIVE);
+
+    emit_store(jit, VM_TOP, 0, STACK_TOP);
+    emit_bytes(jit, call_rcx, sizeof(call_rcx));
+    emit_bytes(jit, test_eax, sizeof(test_eax));
+    emit_branch_to(jit, CC_NE, ERROR_EXIT);
+    emit_load(jit, STACK_TOP, VM_TOP, 0);
+    int done = emit_branch(jit, JMP);
+
+    for (int i = 0; i < 7; i++) {
+        patch_here(jit, slow[i]);
+    }
+    emit_mov_imm(jit, RDI, arg_count);
+    emit_mov_imm(jit, RSI, 0);
+    emit_runtime_call(jit, runtime_call, true);
+    patch_here(jit, done);
+    emit_reload_frame(jit);
+}
+
+// Calls a native's number_function straight from machine code when the
+// callee is target and the argument a double, or for sqrt does the
+// instruction itself. Anything else takes the generic path.
+static void emit_number_native_call(Jit *jit, ObjNative *target, int next) {
+    static const uint8_t argument_to_xmm0[] = { 0x66, 0x48, 0x0F, 0x6E, 0xC0 };   // movq xmm0, rax
+    static const uint8_t sqrt_xmm0[] = { 0xF2, 0x0F, 0x51, 0xC0 };                // sqrtsd xmm0, xmm0
+    static const uint8_t result_to_rax[] = { 0x66, 0x48, 0x0F, 0x7E, 0xC0 };      // movq rax, xmm0
+    int slow[2];
+
+    emit_load(jit, RAX, STACK_TOP, -2 * (int) sizeof(Value));
+    emit_mov_imm(jit, RCX, OBJ_VAL(target));
+    emit_alu(jit, 0x39, RAX, RCX);
+    slow[0] = emit_branch(jit, CC_NE);
+    emit_load(jit, RAX, STACK_TOP, -(int) sizeof(Value));
+    emit_mov_imm(jit, RDX, QNAN);
+    emit_number_test(jit, RAX);
+    slow[1] = emit_branch(jit, CC_E);
+
+    emit_bytes(jit, argument_to_xmm0, sizeof(argument_to_xmm0));
+    if (target == vm.intrinsics[INTRINSIC_SQRT]) {
+        emit_bytes(jit, sqrt_xmm0, sizeof(sqrt_xmm0));
+    } else {
+        emit_call_address(jit, target->number_function);
+    }
+    emit_bytes(jit, result_to_rax, sizeof(result_to_rax));
+    emit_store(jit, STACK_TOP, -2 * (int) sizeof(Value), RAX);
+    emit_pop(jit);
+    int done = emit_branch(jit, JMP);
+
+    for (int i = 0; i < 2; i++) {
+        patch_here(jit, slow[i]);
+    }
+    emit_save_ip(jit, next);
+    emit_mov_imm(jit, RDI, 1);
+    emit_mov_imm(jit, RSI, 0);
+    emit_runtime_call(jit, runtime_call, true);
+    emit_reload_frame(jit);
+    patch_here(jit, done);
+}
+
+// Returns without the runtime unless there are upvalues to close.
+static void emit_inline_return(Jit *jit) {
+    emit_mov_imm(jit, RCX, (uint64_t)(uintptr_t) &vm.open_upvalues);
+    emit_load(jit, RCX, RCX, 0);
+    emit_alu(jit, 0x85, RCX, RCX);
+    int no_upvalues = emit_branch(jit, CC_E);
+    emit_load(jit, RCX, RCX, offsetof(ObjUpvalue, location));
+    emit_alu(jit, 0x39, RCX, SLOTS);
+    int below = emit_branch(jit, CC_B);
+    emit_alu(jit, 0x89, RDI, FRAME);
+    emit_runtime_call(jit, runtime_return, false);
+    emit_return(jit, INTERPRET_OK);
+
+    patch_here(jit, no_upvalues);
+    patch_here(jit, below);
+    emit_load(jit, RAX, STACK_TOP, -(int) sizeof(Value));
+    emit_store(jit, SLOTS, 0, RAX);
+    emit_memory_op(jit, true, 0x8D, STACK_TOP, SLOTS, sizeof(Value));
+    emit_store(jit, VM_TOP, 0, STACK_TOP);
+    emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) &vm.frame_count);
+    emit_memory_op(jit, false, 0xFF, 1, RDX, 0);       // dec dword [rdx]
+    emit_return(jit, INTERPRET_OK);
+}
+
+// Leaves the instance on top of the stack in rax, as long as it has the
+// shape the site has always seen.
+static void emit_shape_guard(Jit *jit, ObjShape *shape, int offset) {
+    static const uint8_t not_rcx[] = { 0x48, 0xF7, 0xD1 };
+    emit_load(jit, RAX, STACK_TOP, -(int) sizeof(Value));
+    emit_mov_imm(jit, RCX, SIGN_BIT | QNAN);
+    emit_alu(jit, 0x89, RSI, RAX);
+    emit_alu(jit, 0x21, RSI, RCX);
+    emit_alu(jit, 0x39, RSI, RCX);
+    emit_branch_to(jit, CC_NE, DEOPTIMIZE(offset));
+    emit_bytes(jit, not_rcx, sizeof(not_rcx));
+    emit_alu(jit, 0x21, RAX, RCX);
+    emit_memory_op(jit, false, 0x83, 7, RAX, offsetof(Obj, type));
+    emit(jit, OBJ_INSTANCE);
+    emit_branch_to(jit, CC_NE, DEOPTIMIZE(offset));
+    emit_mov_imm(jit, RCX, (uint64_t)(uintptr_t) shape);
+    emit_memory_op(jit, true, 0x3B, RCX, RAX, offsetof(ObjInstance, shape));   // cmp rcx, [rax + shape]
+    emit_branch_to(jit, CC_NE, DEOPTIMIZE(offset));
+}
+
+static void optimize_instruction(Jit *jit, int offset, int next) {
+    Chunk *chunk = &jit->function->chunk;
+    uint8_t *code = &chunk->code[offset];
+    Value *constants = chunk->constants.values;
+    Feedback *feedback = &jit->function->feedback[offset];
+    bool bool_in_rax = jit->bool_in_rax;
+    jit->bool_in_rax = false;
+
+    switch (code[0]) {
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            if (!speculates(jit, offset)) break;
+            OpCode op = code[0];
+            if (op == OP_GREATER_NUM) op = OP_GREATER;
+            if (op == OP_LESS_NUM) op = OP_LESS;
+            if (op == OP_ADD_NUM) op = OP_ADD;
+            emit_speculative_binary(jit, op, stack_operand(jit, 1), stack_operand(jit, 0), offset);
+            return;
+        }
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            if (!speculates(jit, offset)) break;
+            emit_speculative_binary(jit, OP_ADD, local_operand(jit, code[1]), local_operand(jit, code[2]), offset);
+            return;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            if (!speculates(jit, offset)) break;
+            emit_speculative_binary(jit, code[0] == OP_GET_LOCAL_CONSTANT_ADD ? OP_ADD : OP_SUBTRACT,
+                                    local_operand(jit, code[1]), constant_operand(jit, code[2]), offset);
+            return;
+        case OP_LESS_JUMP_IF_FALSE:
+            if (!speculates(jit, offset)) break;
+            emit_speculative_binary(jit, OP_LESS, stack_operand(jit, 1), stack_operand(jit, 0), offset);
+            emit_bool_jump(jit, CC_E, jump_target(chunk, offset));
+            return;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+            if (known_number(jit, 0)) return;
+            if (!bool_in_rax) break;
+            emit_bool_jump(jit, CC_E, jump_target(chunk, offset));
+            return;
+        case OP_JUMP_IF_TRUE:
+            if (known_number(jit, 0)) {
+                emit_branch_to(jit, JMP, jump_target(chunk, offset));
+                return;
+            }
+            if (!bool_in_rax) break;
+            emit_bool_jump(jit, CC_NE, jump_target(chunk, offset));
+            return;
+        case OP_CALL: {
+            Obj *target = feedback->target;
+            if (target == NULL || (feedback->types & FEEDBACK_POLYMORPHIC)) break;
+            if (target->type == OBJ_NATIVE) {
+                ObjNative *native = (ObjNative *) target;
+                if (native->number_function == NULL || code[1] != 1) break;
+                emit_number_native_call(jit, native, next);
+                return;
+            }
+            if (((ObjFunction *) target)->arity != code[1]) break;
+            emit_direct_call(jit, (ObjFunction *) target, code[1], next);
+            return;
+        }
+        case OP_INTRINSIC: {
+            ObjNative *native = vm.intrinsics[code[1]];
+            if (native->number_function == NULL) break;
+            emit_number_native_call(jit, native, next);
+            return;
+        }
+        case OP_INVOKE: {
+            ObjClass *klass = (ObjClass *) feedback->target;
+            ObjClosure *method = klass == NULL ? NULL : find_method(klass, AS_STRING(constants[code[1]]));
+            if (method == NULL || (feedback->types & FEEDBACK_POLYMORPHIC)) break;
+            emit_save_ip(jit, next);
+            emit_mov_imm(jit, RDI, (uint64_t)(uintptr_t) AS_OBJ(constants[code[1]]));
+            emit_mov_imm(jit, RSI, code[2]);
+            emit_mov_imm(jit, RDX, (uint64_t)(uintptr_t) klass);
+            emit_mov_imm(jit, RCX, (uint64_t)(uintptr_t) method);
+            emit_runtime_call(jit, jit_invoke_known, true);
+            emit_reload_frame(jit);
+            return;
+        }
+        // A read of a field at a site that has only seen one shape loads
+        // it from its slot.
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG: {
+            ObjShape *shape = (ObjShape *) feedback->target;
+            if (shape == NULL || (feedback->types & FEEDBACK_POLYMORPHIC)) break;
+            int name = code[0] == OP_GET_PROPERTY ? code[1] : read_long(&code[1]);
+            int slot = shape_slot(shape, AS_STRING(constants[name]));
+            if (slot < 0) break;
+            emit_shape_guard(jit, shape, offset);
+            emit_load(jit, RAX, RAX, offsetof(ObjInstance, fields));
+            emit_load(jit, RAX, RAX, slot * (int) sizeof(Value));
+            emit_store(jit, STACK_TOP, -(int) sizeof(Value), RAX);
+            return;
+        }
+        case OP_RETURN:
+            emit_inline_return(jit);
+            return;
+    }
+    compile_instruction(jit, offset, next);
+}
+
+// Follows what the instruction at offset does to the stack and locals.
+static void track_instruction(Jit *jit, int offset) {
+    Chunk *chunk = &jit->function->chunk;
+    uint8_t *code = &chunk->code[offset];
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            push_fact(jit, IS_DOUBLE(chunk->constants.values[code[1]]));
+            break;
+        case OP_CONSTANT_LONG:
+            push_fact(jit, IS_DOUBLE(chunk->constants.values[read_long(&code[1])]));
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_NEW_LIST:
+        case OP_GET_LOCAL_LONG:     // Facts are only kept for the first 256 locals.
+        case OP_GET_GLOBAL_LONG:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS_LONG:
+            push_fact(jit, false);
+            break;
+        case OP_POP:
+        case OP_POP_SCOPED:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_METHOD_LONG:
+        case OP_SWITCH:
+            pop_facts(jit, 1);
+            break;
+        case OP_GET_LOCAL:
+            push_fact(jit, jit->local_facts[code[1]]);
+            break;
+        case OP_SET_LOCAL:
+            jit->local_facts[code[1]] = known_number(jit, 0);
+            break;
+        case OP_SET_LOCAL_POP:
+            jit->local_facts[code[1]] = known_number(jit, 0);
+            pop_facts(jit, 1);
+            break;
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            for (int slot = code[1]; slot < code[1] + 3 && slot < UINT8_COUNT; slot++) {
+                jit->local_facts[slot] = false;
+            }
+            break;
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_GET_PROPERTY_LONG:
+            pop_facts(jit, 1);
+            push_fact(jit, false);
+            break;
+        case OP_NEGATE: {
+            bool number = known_number(jit, 0);
+            pop_facts(jit, 1);
+            push_fact(jit, number);
+            break;
+        }
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_GET_LIST:
+        case OP_GET_LIST_NUMIDX:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            pop_facts(jit, 2);
+            push_fact(jit, false);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY: {
+            bool number = speculates(jit, offset) || (known_number(jit, 0) && known_number(jit, 1));
+            pop_facts(jit, 2);
+            push_fact(jit, number);
+            break;
+        }
+        case OP_MOD: {
+            bool number = known_number(jit, 0) && known_number(jit, 1);
+            pop_facts(jit, 2);
+            push_fact(jit, number);
+            break;
+        }
+        case OP_DIVIDE:
+            // Division always gives a double.
+            pop_facts(jit, 2);
+            push_fact(jit, true);
+            break;
+        case OP_SET_LIST:
+        case OP_SET_LIST_NUMIDX:
+            pop_facts(jit, 3);
+            push_fact(jit, false);
+            break;
+        case OP_CALL:
+        case OP_INTRINSIC:
+        case OP_CALL_SCOPED:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE: {
+            int pops;
+            int pushes;
+            stack_effect(chunk, offset, &pops, &pushes);
+            pop_facts(jit, pops);
+            push_fact(jit, false);
+            // The callee may assign to our locals through upvalues.
+            memset(jit->local_facts, 0, sizeof(jit->local_facts));
+            break;
+        }
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            push_fact(jit, speculates(jit, offset) ||
+                      (jit->local_facts[code[1]] && jit->local_facts[code[2]]));
+            break;
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            push_fact(jit, speculates(jit, offset) ||
+                      (jit->local_facts[code[1]] && IS_DOUBLE(chunk->constants.values[code[2]])));
+            break;
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            push_fact(jit, speculates(jit, offset) ||
+                      (jit->local_facts[code[1]] && IS_DOUBLE(chunk->constants.values[code[2]])));
+            break;
+        default:
+            break;
+    }
+}
+
+static void mark_labels(Jit *jit) {
+    Chunk *chunk = &jit->function->chunk;
+    jit->labels = calloc(chunk->count, sizeof(bool));
+    if (jit->labels == NULL) exit(1);
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        switch (chunk->code[offset]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_LESS_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+            case OP_LOOP_LONG:
+            case OP_FOR_RANGE:
+            case OP_FOR_LIST:
+            case OP_FOR_RANGE_LONG:
+            case OP_FOR_LIST_LONG:
+                jit->labels[jump_target(chunk, offset)] = true;
+                break;
+            case OP_SWITCH: {
+                SwitchTable *table = switch_table(chunk, offset);
+                for (int arm = 0; arm < table->arm_count; arm++) {
+                    jit->labels[table->targets[arm]] = true;
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Leaves a deoptimized frame to the interpreter at the failing instruction.
+static void emit_deoptimization(Jit *jit, int offset) {
+    emit_store(jit, VM_TOP, 0, STACK_TOP);
+    emit_alu(jit, 0x89, RDI, FRAME);
+    emit_mov_imm(jit, RSI, (uint64_t)(uintptr_t) &jit->function->chunk.code[offset]);
+    emit_call_address(jit, jit_deoptimize);
+    emit_epilogue(jit);
+}
+
+// Translates the function's stack bytecode into machine code and returns
+// it, or NULL if the function can't be compiled.
+static void *assemble(ObjFunction *function, bool optimizing, size_t *size) {
+    Chunk *chunk = &function->chunk;
+    Jit jit;
+    memset(&jit, 0, sizeof(jit));
+    jit.function = function;
+    jit.optimizing = optimizing;
+    jit.offsets = malloc(chunk->count * sizeof(int));
+    if (jit.offsets == NULL) exit(1);
+    if (optimizing) mark_labels(&jit);
+
+    emit_prologue(&jit);
+    for (int offset = 0; offset < chunk->count && !jit.failed;) {
+        int next = offset + instruction_length(chunk, offset);
+        jit.offsets[offset] = jit.count;
+        if (optimizing) {
+            if (jit.labels[offset]) forget_facts(&jit);
+            optimize_instruction(&jit, offset, next);
+            track_instruction(&jit, offset);
+        } else {
+            compile_instruction(&jit, offset, next);
+        }
+        offset = next;
+    }
+
+    int error_exit = jit.count;
+    emit_return(&jit, INTERPRET_RUNTIME_ERROR);
+
+    int *stubs = NULL;
+    if (optimizing) {
+        stubs = malloc(chunk->count * sizeof(int));
+        if (stubs == NULL) exit(1);
+        for (int i = 0; i < chunk->count; i++) stubs[i] = -1;
+    }
+
+    for (int i = 0; i < jit.fixup_count; i++) {
+        int target = jit.fixup_targets[i];
+        if (target == ERROR_EXIT) {
+            target = error_exit;
+        } else if (target < ERROR_EXIT) {
+            int offset = DEOPTIMIZE(target);
+            if (stubs[offset] == -1) {
+                stubs[offset] = jit.count;
+                emit_deoptimization(&jit, offset);
+            }
+            target = stubs[offset];
+        } else {
+            target = jit.offsets[target];
+        }
+        patch_branch(&jit, jit.fixups[i], target);
+    }
+
+    void *code = NULL;
+    if (!jit.failed) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        *size = (jit.count + page - 1) & ~(page - 1);
+        void *memory = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            memcpy(memory, jit.code, jit.count);
+            if (mprotect(memory, *size, PROT_READ | PROT_EXEC) == 0) {
+                code = memory;
+            } else {
+                munmap(memory, *size);
+            }
+        }
+    }
+
+    free(jit.code);
+    free(jit.offsets);
+    free(jit.fixups);
+    free(jit.fixup_targets);
+    free(jit.labels);
+    free(stubs);
+    return code;
+}
+
+void jit_compile(ObjFunction *function) {
+    function->feedback = calloc(function->chunk.count, sizeof(Feedback));
+    if (function->feedback == NULL) exit(1);
+
+    function->baseline_code = assemble(function, false, &function->baseline_size);
+    function->native_code = function->baseline_code;
+}
+
+void jit_optimize(ObjFunction *function) {
+    if (function->optimized_code != NULL) return;
+
+    function->optimized_code = assemble(function, true, &function->optimized_size);
+    if (function->optimized_code != NULL) function->native_code = function->optimized_code;
+}
+
+void jit_free(ObjFunction *function) {
+    if (function->baseline_code != NULL) munmap(function->baseline_code, function->baseline_size);
+    if (function->optimized_code != NULL) munmap(function->optimized_code, function->optimized_size);
+    free(function->feedback);
+    function->native_code = NULL;
+    function->baseline_code = NULL;
+    function->optimized_code = NULL;
+    function->feedback = NULL;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#define JIT_THRESHOLD 1000
+#define JIT_OPTIMIZE_THRESHOLD 10000
+#define JIT_DEOPT_LIMIT 8
+
+void jit_compile(ObjFunction *function);
+void jit_optimize(ObjFunction *function);
+void jit_free(ObjFunction *function);
+
+// Entry points for optimized code, defined in vm.c.
+bool jit_invoke_known(ObjString *name, int arg_count, ObjClass *klass, ObjClosure *method);
+InterpretResult jit_deoptimize(CallFrame *frame, uint8_t *ip);
+
+#endif
+
+#endif
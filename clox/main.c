@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "aot.h"
 #include "common.h"
 #include "vm.h"
 
@@ -47,25 +48,50 @@ static char* read_file(const char *path) {
     return buffer;
 }
 
-static void run_file(const char *path) {
+static void run_file(const char *path, bool emit) {
     char *source = read_file(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = emit ? emit_c(source, stdout) : interpret(source);
     free(source);
     
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage(void) {
+    fprintf(stderr, "Usage: clox [-O0|-O1|-O2] [--registers] [--no-jit] [--emit-c] [--max-frames n] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char *argv[]) {
     init_vm();
 
-    if (argc == 1) {
+    bool emit = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "--registers") == 0) {
+            vm.use_registers = true;
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            vm.use_jit = false;
+        } else if (strcmp(argv[arg], "-O0") == 0 || strcmp(argv[arg], "-O1") == 0 ||
+                   strcmp(argv[arg], "-O2") == 0) {
+            vm.optimize_level = argv[arg][2] - '0';
+        } else if (strcmp(argv[arg], "--emit-c") == 0) {
+            emit = true;
+        } else if (strcmp(argv[arg], "--max-frames") == 0 && arg + 1 < argc) {
+            int frames_max = atoi(argv[++arg]);
+            if (frames_max < 1) usage();
+            set_frames_max(frames_max);
+        } else {
+            usage();
+        }
+    }
+
+    if (arg == argc && !emit) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
+    } else if (arg == argc - 1) {
+        run_file(argv[arg], emit);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     free_vm();
@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -82,27 +84,59 @@ static void blacken_object(Obj *object) {
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *) object;
             mark_object((Obj *) klass->name);
-            mark_table(&klass->methods);
+            mark_object((Obj *) klass->superclass);
+            mark_object((Obj *) klass->initializer);
+            mark_object((Obj *) klass->spare);
+            for (int i = 0; i < klass->method_count; i++) {
+                mark_object((Obj *) klass->methods[i].method);
+            }
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) object;
             mark_object((Obj *)closure->function);
+            for (int i = 0; i < closure->cell_count; i++) {
+                mark_value(closure->cells[i].closed);
+            }
             for (int i = 0; i < closure->upvalue_count; i++) {
-                mark_object((Obj *) closure->upvalues[i]);
+                if (!is_cell(closure, closure->upvalues[i])) mark_object((Obj *) closure->upvalues[i]);
             }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             mark_object((Obj *) instance->klass);
-            mark_table(&instance->fields);
+            // Both are marked while an instance moves to a dictionary.
+            if (instance->shape != NULL) {
+                mark_object((Obj *) instance->shape);
+                for (int i = 0; i < instance->shape->field_count; i++) {
+                    mark_value(instance->fields[i]);
+                }
+            }
+            if (instance->dictionary != NULL) mark_table(instance->dictionary);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) object;
             mark_object((Obj *) function->name);
+            mark_object((Obj *) function->closure);
             mark_array(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.cache_count; i++) {
+                InlineCache *cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    mark_object((Obj *) cache->entries[j].shape);
+                    mark_object((Obj *) cache->entries[j].klass);
+                    mark_object((Obj *) cache->entries[j].method);
+                    mark_object((Obj *) cache->entries[j].transition);
+                }
+            }
+#ifdef JIT
+            if (function->feedback != NULL) {
+                for (int i = 0; i < function->chunk.count; i++) {
+                    mark_object(function->feedback[i].target);
+                }
+            }
+#endif
             break;
         }
         case OBJ_UPVALUE:
@@ -116,6 +150,12 @@ static void blacken_object(Obj *object) {
             mark_array(&list->elements);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            mark_table(&shape->slots);
+            mark_table(&shape->transitions);
+            break;
+        }
     }
 }
 
@@ -130,26 +170,35 @@ static void free_object(Obj *object) {
             break;
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *) object;
-            free_table(&klass->methods);
+            FREE_ARRAY(MethodEntry, klass->methods, klass->method_capacity);
             FREE(ObjClass, object);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure*) object;
-            FREE_ARRAY(ObjUpvalue, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+            reallocate(object, closure_size(closure->upvalue_count, closure->cell_count), 0);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*) object;
             free_chunk(&function->chunk);
+            free_chunk(&function->register_code);
+#ifdef JIT
+            jit_free(function);
+#endif
             FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
-            free_table(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->fields != instance->inline_fields) {
+                FREE_ARRAY(Value, instance->fields, instance->field_capacity);
+            }
+            if (instance->dictionary != NULL) {
+                free_table(instance->dictionary);
+                FREE(Table, instance->dictionary);
+            }
+            reallocate(object, sizeof(ObjInstance) + instance->inline_capacity * sizeof(Value), 0);
             break;
         }
         case OBJ_NATIVE: {
@@ -172,6 +221,13 @@ static void free_object(Obj *object) {
             FREE(ObjList, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            free_table(&shape->slots);
+            free_table(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
     }
 }
 
@@ -179,6 +235,11 @@ static void mark_roots(void) {
     for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
         mark_value(*slot);
     }
+    // Everything above the top is dead. Clearing it keeps the registers a
+    // frame takes over from ever holding an object this collection frees.
+    for (Value *slot = vm.stack_top; slot < vm.stack_end; slot++) {
+        *slot = NIL_VAL;
+    }
     
     for (int i = 0; i < vm.frame_count; i++) {
         mark_object((Obj *) vm.frames[i].closure);
@@ -188,9 +249,16 @@ static void mark_roots(void) {
         mark_object((Obj *) upvalue);
     }
     
-    mark_table(&vm.globals);
+    mark_array(&vm.globals);
+    mark_array(&vm.global_names);
     mark_compiler_roots();
     mark_object((Obj *) vm.init_string);
+    mark_object((Obj *) vm.empty_shape);
+    // OP_INTRINSIC compares callees against these even once their globals
+    // hold something else.
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        mark_object((Obj *) vm.intrinsics[i]);
+    }
 }
 
 static void trace_references(void) {
@@ -233,6 +301,8 @@ void collect_garbage(void) {
     mark_roots();
     trace_references();
     table_remove_white(&vm.strings);
+    // Cheaper to refill than to trace.
+    memset(vm.megamorphic_cache, 0, sizeof(vm.megamorphic_cache));
     sweep();
     
     vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
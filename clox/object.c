@@ -28,26 +28,113 @@ ObjBoundMethod* new_bound_method(Value receiver, ObjClosure *method) {
     ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
+    // The method can keep its receiver.
+    if (IS_INSTANCE(receiver)) AS_INSTANCE(receiver)->scoped = false;
     return bound;
 }
 
 ObjClass* new_class(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    init_table(&klass->methods);
+    klass->superclass = NULL;
+    klass->methods = NULL;
+    klass->method_count = 0;
+    klass->method_capacity = 0;
+    klass->initializer = NULL;
+    klass->field_count = 0;
+    klass->spare = NULL;
     return klass;
 }
 
-ObjClosure* new_closure(ObjFunction *function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
-    for (int i = 0; i < function->upvalue_count; i++) {
-        upvalues[i] = NULL;
+// Method names are numbered densely, in the order the compiler first
+// sees a method declared under them.
+void define_selector(ObjString *name) {
+    if (name->selector == -1) name->selector = vm.selector_count++;
+}
+
+// Globals live in vm.globals, in slots numbered by the compiler as it
+// meets their names. vm.global_names keeps those names alive for good.
+// Callers keep name reachable, since the arrays can grow.
+void define_global_slot(ObjString *name) {
+    if (name->global != -1) return;
+    write_value_array(&vm.globals, UNDEFINED_VAL);
+    write_value_array(&vm.global_names, OBJ_VAL(name));
+    name->global = vm.global_names.count - 1;
+}
+
+// The method klass or its nearest superclass declares under name, or NULL.
+ObjClosure* find_method(ObjClass *klass, ObjString *name) {
+    int selector = name->selector;
+    if (selector == -1) return NULL;
+    
+    for (; klass != NULL; klass = klass->superclass) {
+        int low = 0;
+        int high = klass->method_count - 1;
+        while (low <= high) {
+            int middle = (low + high) / 2;
+            int found = klass->methods[middle].selector;
+            if (found == selector) return klass->methods[middle].method;
+            if (found < selector) {
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Callers keep the class and method reachable, since growing the array
+// can allocate.
+void class_add_method(ObjClass *klass, ObjString *name, ObjClosure *method) {
+    define_selector(name);
+    if (name == vm.init_string) klass->initializer = method;
+    int index = 0;
+    while (index < klass->method_count && klass->methods[index].selector < name->selector) index++;
+    if (index < klass->method_count && klass->methods[index].selector == name->selector) {
+        klass->methods[index].method = method;
+        return;
     }
     
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    if (klass->method_capacity < klass->method_count + 1) {
+        int old_capacity = klass->method_capacity;
+        klass->method_capacity = GROW_CAPACITY(old_capacity);
+        klass->methods = GROW_ARRAY(MethodEntry, klass->methods, old_capacity, klass->method_capacity);
+    }
+    memmove(&klass->methods[index + 1], &klass->methods[index],
+            (klass->method_count - index) * sizeof(MethodEntry));
+    klass->methods[index].selector = name->selector;
+    klass->methods[index].method = method;
+    klass->method_count++;
+}
+
+// Runs before the subclass declares any methods, so its own init() still
+// replaces the inherited one.
+void class_inherit(ObjClass *subclass, ObjClass *superclass) {
+    subclass->superclass = superclass;
+    subclass->initializer = superclass->initializer;
+    subclass->field_count = superclass->field_count;
+}
+
+ObjClosure* new_closure(ObjFunction *function, int cell_count) {
+    ObjClosure *closure = (ObjClosure *) allocate_object(closure_size(function->upvalue_count, cell_count),
+                                                        OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
+    closure->upvalues = (ObjUpvalue **) &closure->cells[cell_count];
     closure->upvalue_count = function->upvalue_count;
+    closure->cell_count = cell_count;
+    for (int i = 0; i < cell_count; i++) {
+        ObjUpvalue *cell = &closure->cells[i];
+        cell->obj.type = OBJ_UPVALUE;
+        cell->obj.is_marked = false;
+        cell->obj.next = NULL;
+        cell->closed = NIL_VAL;
+        cell->location = &cell->closed;
+        cell->next = NULL;
+    }
+    for (int i = 0; i < closure->upvalue_count; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -55,21 +142,46 @@ ObjFunction* new_function(void) {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->max_slots = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->leaks_this = true;
     init_chunk(&function->chunk);
+    init_chunk(&function->register_code);
+    function->register_count = 0;
+    function->native_code = NULL;
+#ifdef JIT
+    function->hotness = 0;
+    function->deopts = 0;
+    function->baseline_code = NULL;
+    function->baseline_size = 0;
+    function->optimized_code = NULL;
+    function->optimized_size = 0;
+    function->feedback = NULL;
+#endif
     return function;
 }
 
 ObjInstance* new_instance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int capacity = klass->field_count;
+    ObjInstance *instance = (ObjInstance *) allocate_object(sizeof(ObjInstance) + capacity * sizeof(Value),
+                                                            OBJ_INSTANCE);
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = vm.empty_shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = capacity;
+    instance->inline_capacity = capacity;
+    instance->dictionary = NULL;
+    instance->scoped = false;
     return instance;
 }
 
-ObjNative* new_native(NativeFn function) {
+ObjNative* new_native(int arity, NativeFn function, NativeNumberFn number_function, NativeBinaryFn binary_function) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->arity = arity;
     native->function = function;
+    native->number_function = number_function;
+    native->binary_function = binary_function;
     return native;
 }
 
@@ -78,6 +190,8 @@ static ObjString* allocate_string(char *chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->selector = -1;
+    string->global = -1;
     
     push(OBJ_VAL(string));
     table_set(&vm.strings, string, NIL_VAL);
@@ -163,6 +277,9 @@ void print_object(Value value) {
         case OBJ_LIST:
             printf("<list>");
             break;
+        case OBJ_SHAPE:
+            printf("<shape>");
+            break;
     }
 }
 
@@ -171,3 +288,104 @@ ObjList* new_list(void) {
     init_value_array(&list->elements);
     return list;
 }
+
+ObjShape* new_shape(void) {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->field_count = 0;
+    init_table(&shape->slots);
+    init_table(&shape->transitions);
+    return shape;
+}
+
+// The slot for name, or -1 when the shape doesn't have that field.
+int shape_slot(ObjShape *shape, ObjString *name) {
+    Value slot;
+    if (!table_get(&shape->slots, name, &slot)) return -1;
+    return (int) AS_INT(slot);
+}
+
+// The shape reached from shape by adding name, created on first use.
+ObjShape* shape_transition(ObjShape *shape, ObjString *name) {
+    Value next;
+    if (table_get(&shape->transitions, name, &next)) return AS_SHAPE(next);
+    
+    ObjShape *child = new_shape();
+    push(OBJ_VAL(child));
+    table_add_all(&shape->slots, &child->slots);
+    table_set(&child->slots, name, INT_VAL(shape->field_count));
+    child->field_count = shape->field_count + 1;
+    table_set(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+static void convert_to_dictionary(ObjInstance *instance) {
+    Table *dictionary = ALLOCATE(Table, 1);
+    init_table(dictionary);
+    instance->dictionary = dictionary;
+    
+    // The instance is unchanged until its shape goes, so a collection
+    // while the table grows still sees every field.
+    Table *slots = &instance->shape->slots;
+    for (int i = 0; i < slots->capacity; i++) {
+        Entry *entry = &slots->entries[i];
+        if (entry->key == NULL) continue;
+        table_set(dictionary, entry->key, instance->fields[AS_INT(entry->value)]);
+    }
+    
+    if (instance->fields != instance->inline_fields) {
+        FREE_ARRAY(Value, instance->fields, instance->field_capacity);
+    }
+    instance->fields = NULL;
+    instance->field_capacity = 0;
+    instance->shape = NULL;
+}
+
+bool instance_get_field(ObjInstance *instance, ObjString *name, Value *value) {
+    if (instance->dictionary != NULL) return table_get(instance->dictionary, name, value);
+    
+    int slot = shape_slot(instance->shape, name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+// Callers keep the instance and value reachable, since adding a field can
+// allocate.
+void instance_set_field(ObjInstance *instance, ObjString *name, Value value) {
+    if (instance->dictionary == NULL) {
+        int slot = shape_slot(instance->shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            return;
+        }
+        if (instance->shape->field_count == SHAPE_FIELDS_MAX) convert_to_dictionary(instance);
+    }
+    if (instance->dictionary != NULL) {
+        table_set(instance->dictionary, name, value);
+        return;
+    }
+    
+    instance_add_field(instance, shape_transition(instance->shape, name), value);
+}
+
+// Moves the instance to shape, one of its shape's transitions, storing
+// value in the field that adds.
+void instance_add_field(ObjInstance *instance, ObjShape *shape, Value value) {
+    if (instance->field_capacity < shape->field_count) {
+        int capacity = instance->field_capacity < 4 ? 4 : instance->field_capacity * 2;
+        if (instance->fields == instance->inline_fields) {
+            Value *fields = ALLOCATE(Value, capacity);
+            memcpy(fields, instance->inline_fields, instance->field_capacity * sizeof(Value));
+            instance->fields = fields;
+        } else {
+            instance->fields = GROW_ARRAY(Value, instance->fields, instance->field_capacity, capacity);
+        }
+        instance->field_capacity = capacity;
+    }
+    instance->fields[shape->field_count - 1] = value;
+    instance->shape = shape;
+    
+    ObjClass *klass = instance->klass;
+    if (klass->field_count < shape->field_count) klass->field_count = shape->field_count;
+}
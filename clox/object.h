@@ -16,16 +16,21 @@
 #define IS_NATIVE(value)       is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value)       is_obj_type(value, OBJ_STRING)
 #define IS_LIST(value)         is_obj_type(value, OBJ_LIST)
+#define IS_SHAPE(value)        is_obj_type(value, OBJ_SHAPE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *) AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass *) AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure *) AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction *) AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance *) AS_OBJ(value))
-#define AS_NATIVE(value)       (((ObjNative *) AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative *) AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString *) AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString *) AS_OBJ(value))->chars)
 #define AS_LIST(value)         ((ObjList *) AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape *) AS_OBJ(value))
+
+// Instances with more fields than this keep them in a Table instead.
+#define SHAPE_FIELDS_MAX 64
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -37,6 +42,7 @@ typedef enum {
     OBJ_STRING,
     OBJ_UPVALUE,
     OBJ_LIST,
+    OBJ_SHAPE,
 } ObjType;
 
 struct Obj {
@@ -45,19 +51,53 @@ struct Obj {
     Obj *next;
 };
 
+// Bits in Feedback.types. NOT_NUMBER is set once an operand that isn't a
+// double, integers included, has been seen.
+#define FEEDBACK_NOT_NUMBER  0x1
+#define FEEDBACK_POLYMORPHIC 0x2
+
+typedef struct {
+    uint8_t types;
+    Obj *target;    // The function or native called, or the receiver's class
+} Feedback;
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    int max_slots;
     Chunk chunk;
+    Chunk register_code;
+    int register_count;
+    void *native_code;
+#ifdef JIT
+    int hotness;
+    int deopts;
+    void *baseline_code;
+    size_t baseline_size;
+    void *optimized_code;
+    size_t optimized_size;
+    Feedback *feedback;
+#endif
     ObjString *name;
+    struct ObjClosure *closure;     // Shared when there are no upvalues
+    bool leaks_this;                // Unless an initializer only uses this for its fields
 } ObjFunction;
 
 typedef Value (*NativeFn)(int arg_count, Value *args);
+typedef double (*NativeNumberFn)(double);
+typedef double (*NativeBinaryFn)(double, double);
 
+// Natives declare their arity, or -1 to take any number of arguments.
+// One that maps numbers to a number can give number_function or
+// binary_function instead of function, and calls check its arguments and
+// box its result.
 typedef struct {
     Obj obj;
+    int arity;
     NativeFn function;
+    NativeNumberFn number_function;
+    NativeBinaryFn binary_function;
 } ObjNative;
 
 struct ObjString {
@@ -65,6 +105,8 @@ struct ObjString {
     int length;
     char* chars;
     uint32_t hash;
+    int selector;   // -1 until a method is declared under this name
+    int global;     // -1 until the compiler sees a global by this name
 };
 
 typedef struct ObjUpvalue {
@@ -74,23 +116,72 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+// Closures are flat: the upvalue pointers follow the closure in the same
+// allocation, after cells holding the variables it captured by value.
+// Cells look like closed upvalues, so every upvalue is read the same way.
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue** upvalues;
     int upvalue_count;
+    int cell_count;
+    ObjUpvalue cells[];
 } ObjClosure;
 
+static inline size_t closure_size(int upvalue_count, int cell_count) {
+    return sizeof(ObjClosure) + cell_count * sizeof(ObjUpvalue) + upvalue_count * sizeof(ObjUpvalue *);
+}
+
+static inline bool is_cell(ObjClosure *closure, ObjUpvalue *upvalue) {
+    return upvalue >= closure->cells && upvalue < closure->cells + closure->cell_count;
+}
+
 typedef struct {
+    int selector;
+    ObjClosure *method;
+} MethodEntry;
+
+// A class keeps only the methods it declares, sorted by selector, and
+// finds inherited ones through its superclass. It also keeps its own or
+// inherited init() at hand and the most fields its instances have held,
+// which new instances reserve up front.
+typedef struct ObjClass {
     Obj obj;
     ObjString *name;
-    Table methods;
+    struct ObjClass *superclass;
+    MethodEntry *methods;
+    int method_count;
+    int method_capacity;
+    ObjClosure *initializer;
+    int field_count;
+    struct ObjInstance *spare;      // Left by a scoped local, for the next one
 } ObjClass;
 
-typedef struct {
+// The layout shared by instances that were given the same fields in the
+// same order. Each shape maps field names to slots and remembers the
+// shapes reached from it by adding one more field.
+typedef struct ObjShape {
+    Obj obj;
+    int field_count;
+    Table slots;
+    Table transitions;
+} ObjShape;
+
+// Fields live in slots laid out by the shape, at first in storage
+// allocated along with the instance. An instance that outgrows
+// SHAPE_FIELDS_MAX drops its shape and moves them into a dictionary.
+// A scoped instance is only referenced by the local it was made for, and
+// goes back to its class when that local goes out of scope.
+typedef struct ObjInstance {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape;
+    Value *fields;
+    int field_capacity;
+    int inline_capacity;
+    Table *dictionary;
+    bool scoped;
+    Value inline_fields[];
 } ObjInstance;
 
 typedef struct {
@@ -106,15 +197,26 @@ typedef struct {
 
 ObjBoundMethod* new_bound_method(Value receiver, ObjClosure *method);
 ObjClass* new_class(ObjString *name);
-ObjClosure* new_closure(ObjFunction *function);
+ObjClosure* new_closure(ObjFunction *function, int cell_count);
 ObjFunction* new_function(void);
 ObjInstance* new_instance(ObjClass *klass);
-ObjNative* new_native(NativeFn function);
+ObjNative* new_native(int arity, NativeFn function, NativeNumberFn number_function, NativeBinaryFn binary_function);
 ObjString* take_string(char *chars, int length);
 ObjString* copy_string(const char *chars, int length);
 ObjUpvalue* new_upvalue(Value* slot);
 void print_object(Value v);
 ObjList* new_list(void);
+ObjShape* new_shape(void);
+void define_selector(ObjString *name);
+void define_global_slot(ObjString *name);
+ObjClosure* find_method(ObjClass *klass, ObjString *name);
+void class_add_method(ObjClass *klass, ObjString *name, ObjClosure *method);
+void class_inherit(ObjClass *subclass, ObjClass *superclass);
+int shape_slot(ObjShape *shape, ObjString *name);
+ObjShape* shape_transition(ObjShape *shape, ObjString *name);
+bool instance_get_field(ObjInstance *instance, ObjString *name, Value *value);
+void instance_set_field(ObjInstance *instance, ObjString *name, Value value);
+void instance_add_field(ObjInstance *instance, ObjShape *shape, Value value);
 
 static inline bool is_obj_type(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,1443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// The cleanup passes run until none of them changes anything. This only
+// stops two that keep undoing each other, and says so under
+// DEBUG_PRINT_CODE.
+#define ROUNDS_MAX 16
+#define OPERANDS_MAX 16
+
+// The longest instruction, an OP_CLOSURE_LONG capturing every upvalue.
+#define INSTRUCTION_MAX (4 + 3 * UINT8_COUNT)
+
+// The optimizer decodes a function's bytecode into a list of instructions
+// whose jumps and switch arms name the instruction they go to. Each pass
+// writes a new list from the old one, and the last list is encoded back
+// into the chunk with every jump in the shortest form that reaches.
+typedef struct {
+    int start;          // where its bytes are in the pool, which never changes them
+    int length;
+    int line;
+    int target;         // the instruction a jump goes to, or -1
+    int origin;         // the first instruction of the previous list it stands for
+    bool label;         // a jump or an arm goes to it
+} Instruction;
+
+typedef struct {
+    Instruction *instructions;
+    int count;
+    int capacity;
+} InstructionList;
+
+typedef struct {
+    ObjFunction *function;
+    Chunk view;                 // the function's chunk, reading code from the pool
+    uint8_t *bytes;
+    int byte_count;
+    int byte_capacity;
+    InstructionList code;
+    InstructionList next;       // what the current pass is writing
+    int **arms;                 // where each arm of each switch table starts
+
+    // What analyze() found out about the current list.
+    int *heights;               // the stack height before each instruction, -1 if unreachable
+    int max_height;
+    int *successor_start;
+    int *successors;
+    int *predecessor_start;
+    int *predecessors;
+    bool *captured;             // the slots closures share by reference
+} Optimizer;
+
+// Values on the stack while a loop is searched for an invariant
+// expression, with the instructions that compute them.
+typedef struct {
+    int start;
+    int end;
+    bool invariant;
+    bool computed;      // by an operator, not just pushed
+    bool number;        // always a number
+    bool pure;          // can't fail and does nothing but push
+    bool movable;       // computing it in front of the loop can't be seen
+} Operand;
+
+static void append(InstructionList *list, Instruction instruction) {
+    if (list->capacity < list->count + 1) {
+        list->capacity = GROW_CAPACITY(list->capacity);
+        list->instructions = realloc(list->instructions, list->capacity * sizeof(Instruction));
+        if (list->instructions == NULL) exit(1);
+    }
+    list->instructions[list->count++] = instruction;
+}
+
+static int add_bytes(Optimizer *o, const uint8_t *bytes, int length) {
+    if (o->byte_capacity < o->byte_count + length) {
+        while (o->byte_capacity < o->byte_count + length) {
+            o->byte_capacity = GROW_CAPACITY(o->byte_capacity);
+        }
+        o->bytes = realloc(o->bytes, o->byte_capacity);
+        if (o->bytes == NULL) exit(1);
+    }
+    memcpy(&o->bytes[o->byte_count], bytes, length);
+    o->byte_count += length;
+    return o->byte_count - length;
+}
+
+static uint8_t* code_at(Optimizer *o, int index) {
+    return &o->bytes[o->code.instructions[index].start];
+}
+
+static int switch_index(uint8_t *code) {
+    return (code[1] << 8) | code[2];
+}
+
+static bool falls_through(uint8_t op) {
+    return op != OP_JUMP && op != OP_RETURN && op != OP_SWITCH;
+}
+
+// The instructions at the bottom of a for-in loop, which jump back to its
+// body while there are more values.
+static bool is_for_step(uint8_t op) {
+    return op == OP_FOR_RANGE || op == OP_FOR_LIST || op == OP_FOR_RANGE_LONG || op == OP_FOR_LIST_LONG;
+}
+
+static bool is_constant(uint8_t op) {
+    return op == OP_CONSTANT || op == OP_CONSTANT_LONG || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+// Pushes a value and can't fail or do anything else.
+static bool is_pure_push(uint8_t op) {
+    return is_constant(op) || op == OP_GET_LOCAL || op == OP_GET_LOCAL_LONG || op == OP_GET_UPVALUE;
+}
+
+static bool is_binary(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A pass writes a new list. An instruction it adds stands in for the
+// instructions of the old list from its origin on, so a jump to an
+// instruction the pass dropped goes to the next one it kept.
+static void begin_rewrite(Optimizer *o) {
+    o->next.count = 0;
+}
+
+static void add(Optimizer *o, const uint8_t *bytes, int length, int line, int target, int origin, bool label) {
+    Instruction instruction = {add_bytes(o, bytes, length), length, line, target, origin, label};
+    append(&o->next, instruction);
+}
+
+static void keep(Optimizer *o, int index) {
+    Instruction instruction = o->code.instructions[index];
+    instruction.origin = index;
+    append(&o->next, instruction);
+}
+
+// Jumps and arms go on naming instructions of the old list until here.
+static void end_rewrite(Optimizer *o) {
+    int count = o->code.count;
+    int *map = malloc((count + 1) * sizeof(int));
+    if (map == NULL) exit(1);
+
+    int kept = 0;
+    for (int i = 0; i <= count; i++) {
+        while (kept < o->next.count && o->next.instructions[kept].origin < i) kept++;
+        map[i] = kept;
+    }
+    for (int i = 0; i < o->next.count; i++) {
+        Instruction *instruction = &o->next.instructions[i];
+        if (instruction->target >= 0) instruction->target = map[instruction->target];
+    }
+    for (int table = 0; table < o->function->chunk.switch_count; table++) {
+        for (int arm = 0; arm < o->function->chunk.switches[table].arm_count; arm++) {
+            o->arms[table][arm] = map[o->arms[table][arm]];
+        }
+    }
+    free(map);
+
+    InstructionList old = o->code;
+    o->code = o->next;
+    o->next = old;
+}
+
+// Jumps lose their operands, which encode() works out again. Long jumps
+// and loops become plain jumps that go either way.
+static bool decode(Optimizer *o) {
+    Chunk *chunk = &o->function->chunk;
+    int *indices = malloc((chunk->count + 1) * sizeof(int));
+    if (indices == NULL) exit(1);
+    for (int offset = 0; offset <= chunk->count; offset++) {
+        indices[offset] = -1;
+    }
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        int length = instruction_length(chunk, offset);
+        uint8_t jump[6] = {code[0], 0, 0, 0, 0, 0};
+        Instruction instruction = {0, length, chunk->lines[offset + length - 1], -1, 0, false};
+        switch (code[0]) {
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                jump[0] = OP_JUMP;
+                instruction.length = 3;
+                instruction.target = jump_target(chunk, offset);
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                jump[0] = OP_JUMP_IF_FALSE;
+                instruction.length = 3;
+                instruction.target = jump_target(chunk, offset);
+                break;
+            case OP_JUMP_IF_TRUE:
+            case OP_LESS_JUMP_IF_FALSE:
+                instruction.target = jump_target(chunk, offset);
+                break;
+            case OP_FOR_RANGE:
+            case OP_FOR_LIST:
+                jump[1] = code[1];
+                instruction.target = jump_target(chunk, offset);
+                break;
+            case OP_FOR_RANGE_LONG:
+            case OP_FOR_LIST_LONG:
+                memcpy(&jump[1], &code[1], 3);
+                instruction.target = jump_target(chunk, offset);
+                break;
+        }
+
+        indices[offset] = o->code.count;
+        instruction.start = add_bytes(o, instruction.target >= 0 ? jump : code, instruction.length);
+        append(&o->code, instruction);
+    }
+
+    bool valid = true;
+    for (int i = 0; i < o->code.count; i++) {
+        Instruction *instruction = &o->code.instructions[i];
+        if (instruction->target < 0) continue;
+        if (instruction->target >= chunk->count || indices[instruction->target] < 0) valid = false;
+        instruction->target = valid ? indices[instruction->target] : 0;
+    }
+
+    o->arms = calloc(chunk->switch_count, sizeof(int*));
+    if (chunk->switch_count > 0 && o->arms == NULL) exit(1);
+    for (int table = 0; table < chunk->switch_count; table++) {
+        SwitchTable *switches = &chunk->switches[table];
+        o->arms[table] = malloc(switches->arm_count * sizeof(int));
+        if (o->arms[table] == NULL) exit(1);
+        for (int arm = 0; arm < switches->arm_count; arm++) {
+            int index = indices[switches->targets[arm]];
+            if (index < 0) valid = false;
+            o->arms[table][arm] = index < 0 ? 0 : index;
+        }
+    }
+
+    free(indices);
+    return valid;
+}
+
+static int list_successors(Optimizer *o, int index, int *successors) {
+    Instruction *instruction = &o->code.instructions[index];
+    uint8_t *code = &o->bytes[instruction->start];
+    int count = 0;
+    if (falls_through(code[0]) && index + 1 < o->code.count) {
+        if (successors != NULL) successors[count] = index + 1;
+        count++;
+    }
+    if (instruction->target >= 0) {
+        if (successors != NULL) successors[count] = instruction->target;
+        count++;
+    }
+    if (code[0] == OP_SWITCH) {
+        int table = switch_index(code);
+        for (int arm = 0; arm < o->function->chunk.switches[table].arm_count; arm++) {
+            if (successors != NULL) successors[count] = o->arms[table][arm];
+            count++;
+        }
+    }
+    return count;
+}
+
+static void mark_captures(Optimizer *o, uint8_t *code, int length) {
+    bool wide = code[0] == OP_CLOSURE_LONG;
+    for (int p = wide ? 4 : 2; p < length; p += wide ? 3 : 2) {
+        int slot = wide ? (code[p + 1] << 8) | code[p + 2] : code[p + 1];
+        if (code[p] == CAPTURE_LOCAL && slot <= o->max_height) o->captured[slot] = true;
+    }
+}
+
+// Finds the labels, the control flow and the stack height at every
+// instruction. False if the heights where paths meet don't agree, which
+// leaves the function as it was.
+static bool analyze(Optimizer *o) {
+    int count = o->code.count;
+    Instruction *code = o->code.instructions;
+    o->view = o->function->chunk;
+    o->view.code = o->bytes;
+
+    o->successor_start = realloc(o->successor_start, (count + 1) * sizeof(int));
+    o->predecessor_start = realloc(o->predecessor_start, (count + 1) * sizeof(int));
+    o->heights = realloc(o->heights, (count + 1) * sizeof(int));
+    if (o->successor_start == NULL || o->predecessor_start == NULL || o->heights == NULL) exit(1);
+
+    int edge_count = 0;
+    for (int i = 0; i < count; i++) {
+        code[i].label = false;
+        o->successor_start[i] = edge_count;
+        o->predecessor_start[i] = 0;
+        edge_count += list_successors(o, i, NULL);
+    }
+    o->successor_start[count] = edge_count;
+    o->predecessor_start[count] = 0;
+
+    o->successors = realloc(o->successors, (edge_count + 1) * sizeof(int));
+    o->predecessors = realloc(o->predecessors, (edge_count + 1) * sizeof(int));
+    if (o->successors == NULL || o->predecessors == NULL) exit(1);
+    for (int i = 0; i < count; i++) {
+        list_successors(o, i, &o->successors[o->successor_start[i]]);
+    }
+
+    int *work = malloc((count + 1) * sizeof(int));
+    if (work == NULL) exit(1);
+    for (int edge = 0; edge < edge_count; edge++) {
+        if (o->successors[edge] >= count) {
+            free(work);
+            return false;
+        }
+        o->predecessor_start[o->successors[edge]]++;
+    }
+    int total = 0;
+    for (int i = 0; i <= count; i++) {
+        int predecessors = o->predecessor_start[i];
+        o->predecessor_start[i] = total;
+        total += predecessors;
+        work[i] = total;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        for (int edge = o->successor_start[i]; edge < o->successor_start[i + 1]; edge++) {
+            o->predecessors[--work[o->successors[edge]]] = i;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (code[i].target >= 0) code[code[i].target].label = true;
+        o->heights[i] = -1;
+        uint8_t *bytes = &o->bytes[code[i].start];
+        if (bytes[0] != OP_SWITCH) continue;
+        int table = switch_index(bytes);
+        for (int arm = 0; arm < o->function->chunk.switches[table].arm_count; arm++) {
+            code[o->arms[table][arm]].label = true;
+        }
+    }
+
+    int work_count = 0;
+    bool consistent = true;
+    o->max_height = o->function->arity + 1;
+    if (count > 0) {
+        o->heights[0] = o->max_height;
+        work[work_count++] = 0;
+    }
+    while (work_count > 0 && consistent) {
+        int i = work[--work_count];
+        int pops;
+        int pushes;
+        stack_effect(&o->view, code[i].start, &pops, &pushes);
+        int height = o->heights[i] - pops + pushes;
+        if (height < 0) consistent = false;
+        if (height > o->max_height) o->max_height = height;
+
+        for (int edge = o->successor_start[i]; edge < o->successor_start[i + 1]; edge++) {
+            int successor = o->successors[edge];
+            if (o->heights[successor] < 0) {
+                o->heights[successor] = height;
+                work[work_count++] = successor;
+            } else if (o->heights[successor] != height) {
+                consistent = false;
+            }
+        }
+    }
+    free(work);
+
+    o->captured = realloc(o->captured, (o->max_height + 1) * sizeof(bool));
+    if (o->captured == NULL) exit(1);
+    memset(o->captured, 0, (o->max_height + 1) * sizeof(bool));
+    for (int i = 0; i < count; i++) {
+        uint8_t *bytes = &o->bytes[code[i].start];
+        if (bytes[0] == OP_CLOSURE || bytes[0] == OP_CLOSURE_LONG) mark_captures(o, bytes, code[i].length);
+    }
+    return consistent;
+}
+
+// Where a jump from index to target ends up once it stops landing on jumps
+// that only jump again. A conditional jump that lands on another testing
+// the same value goes wherever that one goes, as long as it's forward.
+static int thread_jump(Optimizer *o, int index, int target) {
+    uint8_t op = code_at(o, index)[0];
+    for (int hops = 0; hops < o->code.count; hops++) {
+        uint8_t landing = code_at(o, target)[0];
+        int next;
+        if (landing == OP_JUMP) {
+            next = o->code.instructions[target].target;
+        } else if (op != OP_JUMP && (landing == OP_JUMP_IF_FALSE || landing == OP_JUMP_IF_TRUE)) {
+            bool same = (landing == OP_JUMP_IF_TRUE) == (op == OP_JUMP_IF_TRUE);
+            next = same ? o->code.instructions[target].target : target + 1;
+        } else {
+            break;
+        }
+        if (next == target || next >= o->code.count || (op != OP_JUMP && next <= index)) break;
+        target = next;
+    }
+    return target;
+}
+
+// Cleans up what the compiler leaves behind, looking at an instruction or
+// two at a time. Jumps go straight to where the jumps they land on go, a
+// jump to a return returns, and a jump to the next instruction goes. Code
+// after a jump or a return that nothing jumps to goes, like the implicit
+// return after an explicit one. OP_NOT goes into the conditional jump
+// after it when both ways pop the value, a local that is stored and read
+// straight back stays on the stack, and a value that is only pushed to be
+// popped isn't pushed. Adds how many instructions went to removed.
+static bool peephole(Optimizer *o, int *removed) {
+    static const uint8_t return_op = OP_RETURN;
+    bool changed = false;
+    bool reachable = true;
+    begin_rewrite(o);
+
+    for (int i = 0; i < o->code.count; i++) {
+        Instruction instruction = o->code.instructions[i];
+        uint8_t *code = code_at(o, i);
+        Instruction *written = o->next.instructions;
+        int n = o->next.count;
+        uint8_t *last = n > 0 ? &o->bytes[written[n - 1].start] : NULL;
+        reachable |= instruction.label;
+        if (!reachable) {
+            changed = true;
+            continue;
+        }
+        reachable = falls_through(code[0]);
+
+        instruction.origin = i;
+        if (instruction.target >= 0 && !is_for_step(code[0])) {
+            int target = thread_jump(o, i, instruction.target);
+            changed |= target != instruction.target;
+            instruction.target = target;
+        }
+        bool conditional = code[0] == OP_JUMP_IF_FALSE || code[0] == OP_JUMP_IF_TRUE;
+
+        if (code[0] == OP_JUMP && code_at(o, instruction.target)[0] == OP_RETURN) {
+            add(o, &return_op, 1, instruction.line, -1, i, instruction.label);
+            changed = true;
+        } else if ((code[0] == OP_JUMP || conditional) && instruction.target == i + 1) {
+            reachable = true;
+            changed = true;
+        } else if (instruction.label || n == 0) {
+            append(&o->next, instruction);
+        } else if (conditional && last[0] == OP_NOT && i + 1 < o->code.count && code_at(o, i + 1)[0] == OP_POP &&
+                   code_at(o, instruction.target)[0] == OP_POP) {
+            uint8_t jump[3] = {code[0] == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, 0, 0};
+            Instruction negation = written[n - 1];
+            o->next.count--;
+            add(o, jump, 3, instruction.line, instruction.target, negation.origin, negation.label);
+            changed = true;
+        } else if (code[0] == OP_GET_LOCAL && last[0] == OP_SET_LOCAL_POP && last[1] == code[1]) {
+            uint8_t set[2] = {OP_SET_LOCAL, code[1]};
+            Instruction store = written[n - 1];
+            o->next.count--;
+            add(o, set, 2, store.line, -1, store.origin, store.label);
+            changed = true;
+        } else if (code[0] == OP_POP && is_pure_push(last[0])) {
+            o->next.count--;
+            changed = true;
+        } else {
+            append(&o->next, instruction);
+        }
+    }
+
+    if (changed) {
+        *removed += o->code.count - o->next.count;
+        end_rewrite(o);
+    }
+    return changed;
+}
+
+static bool constant_value(Optimizer *o, Instruction *instruction, Value *value) {
+    uint8_t *code = &o->bytes[instruction->start];
+    Value *constants = o->function->chunk.constants.values;
+    switch (code[0]) {
+        case OP_CONSTANT:      *value = constants[code[1]]; return true;
+        case OP_CONSTANT_LONG: *value = constants[read_long(&code[1])]; return true;
+        case OP_NIL:           *value = NIL_VAL; return true;
+        case OP_TRUE:          *value = BOOL_VAL(true); return true;
+        case OP_FALSE:         *value = BOOL_VAL(false); return true;
+        default:               return false;
+    }
+}
+
+static bool fold(OpCode op, Value a, Value b, Value *result) {
+    if (op != OP_ADD || !IS_STRING(a) || !IS_STRING(b)) return fold_operator(op, a, b, result);
+
+    ObjString *x = AS_STRING(a);
+    ObjString *y = AS_STRING(b);
+    int length = x->length + y->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, x->chars, x->length);
+    memcpy(chars + x->length, y->chars, y->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(take_string(chars, length));
+    return true;
+}
+
+// Replaces the last count instructions written with one that pushes
+// value. False if the constant table is full.
+static bool replace_with_constant(Optimizer *o, int count, Value value, int line) {
+    Instruction first = o->next.instructions[o->next.count - count];
+    Chunk *chunk = &o->function->chunk;
+    uint8_t code[4];
+    int length = 1;
+    if (IS_NIL(value)) {
+        code[0] = OP_NIL;
+    } else if (IS_BOOL(value)) {
+        code[0] = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    } else {
+        if (chunk->constants.count > UINT24_MAX) return false;
+        int constant = add_constant(chunk, value);
+        if (constant <= UINT8_MAX) {
+            code[0] = OP_CONSTANT;
+            code[1] = (uint8_t) constant;
+            length = 2;
+        } else {
+            code[0] = OP_CONSTANT_LONG;
+            code[1] = (constant >> 16) & 0xFF;
+            code[2] = (constant >> 8) & 0xFF;
+            code[3] = constant & 0xFF;
+            length = 4;
+        }
+    }
+
+    o->next.count -= count;
+    add(o, code, length, line, -1, first.origin, first.label);
+    return true;
+}
+
+// Operators on constants become their result, and conditional jumps on a
+// constant either always go or never do.
+static bool fold_constants(Optimizer *o) {
+    static const uint8_t jump[3] = {OP_JUMP, 0, 0};
+    bool changed = false;
+    begin_rewrite(o);
+
+    for (int i = 0; i < o->code.count; i++) {
+        Instruction instruction = o->code.instructions[i];
+        uint8_t op = o->bytes[instruction.start];
+        Instruction *written = o->next.instructions;
+        int n = o->next.count;
+        if (instruction.label || n == 0) {
+            keep(o, i);
+            continue;
+        }
+
+        Value a;
+        Value b;
+        Value result;
+        bool one = constant_value(o, &written[n - 1], &b);
+        bool two = one && n >= 2 && !written[n - 1].label && constant_value(o, &written[n - 2], &a);
+        if (two && is_binary(op) && fold(op, a, b, &result) && replace_with_constant(o, 2, result, instruction.line)) {
+            changed = true;
+        } else if (one && (op == OP_NOT || op == OP_NEGATE) && fold_operator(op, b, NIL_VAL, &result) &&
+                   replace_with_constant(o, 1, result, instruction.line)) {
+            changed = true;
+        } else if (two && op == OP_LESS_JUMP_IF_FALSE && fold_operator(OP_LESS, a, b, &result)) {
+            replace_with_constant(o, 2, result, instruction.line);
+            if (!AS_BOOL(result)) add(o, jump, 3, instruction.line, instruction.target, i, false);
+            changed = true;
+        } else if (one && (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE)) {
+            fold_operator(OP_NOT, b, NIL_VAL, &result);
+            if (AS_BOOL(result) == (op == OP_JUMP_IF_FALSE)) {
+                add(o, jump, 3, instruction.line, instruction.target, i, false);
+            }
+            changed = true;
+        } else {
+            keep(o, i);
+        }
+    }
+
+    if (changed) end_rewrite(o);
+    return changed;
+}
+
+// Drops the instructions no path reaches, and jumps to where control
+// would fall through to anyway.
+static bool remove_dead_code(Optimizer *o) {
+    int count = o->code.count;
+    bool *dead = calloc(count + 1, sizeof(bool));
+    if (dead == NULL) exit(1);
+
+    bool changed = false;
+    int next_live = count;
+    for (int i = count - 1; i >= 0; i--) {
+        dead[i] = o->heights[i] < 0 ||
+                  (code_at(o, i)[0] == OP_JUMP && o->code.instructions[i].target == next_live);
+        if (!dead[i]) next_live = i;
+        changed |= dead[i];
+    }
+
+    if (changed) {
+        begin_rewrite(o);
+        for (int i = 0; i < count; i++) {
+            if (!dead[i]) keep(o, i);
+        }
+        end_rewrite(o);
+    }
+    free(dead);
+    return changed;
+}
+
+static bool writes_slot(uint8_t *code, int slot) {
+    switch (code[0]) {
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return code[1] == slot;
+        case OP_SET_LOCAL_LONG:
+            return read_long(&code[1]) == slot;
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            return slot >= code[1] && slot <= code[1] + 2;
+        case OP_FOR_RANGE_LONG:
+        case OP_FOR_LIST_LONG:
+            return slot >= read_long(&code[1]) && slot <= read_long(&code[1]) + 2;
+        default:
+            return false;
+    }
+}
+
+static bool reads_slot(uint8_t *code, int slot) {
+    switch (code[0]) {
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            return code[1] == slot;
+        case OP_GET_LOCAL_LONG:
+            return read_long(&code[1]) == slot;
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            return code[1] == slot || code[2] == slot;
+        default:
+            return false;
+    }
+}
+
+static int emit_get_local(uint8_t *code, int slot) {
+    if (slot <= UINT8_MAX) {
+        code[0] = OP_GET_LOCAL;
+        code[1] = (uint8_t) slot;
+        return 2;
+    }
+    code[0] = OP_GET_LOCAL_LONG;
+    code[1] = (slot >> 16) & 0xFF;
+    code[2] = (slot >> 8) & 0xFF;
+    code[3] = slot & 0xFF;
+    return 4;
+}
+
+// Writes the instruction at index with its reads of the local that source
+// pushed reading whatever source pushed instead. A fused instruction that
+// reads a constant that way comes apart, for fold_constants() to finish.
+static void substitute(Optimizer *o, int index, int source) {
+    Instruction instruction = o->code.instructions[index];
+    Instruction value = o->code.instructions[source];
+    int slot = o->heights[source];
+    uint8_t code[4];
+    uint8_t pushed[4];
+    memcpy(code, &o->bytes[instruction.start], instruction.length);
+    memcpy(pushed, &o->bytes[value.start], value.length);
+
+    if (code[0] == OP_GET_LOCAL || code[0] == OP_GET_LOCAL_LONG) {
+        add(o, pushed, value.length, instruction.line, -1, index, instruction.label);
+        return;
+    }
+
+    if (pushed[0] == OP_GET_LOCAL) {
+        if (code[1] == slot) code[1] = pushed[1];
+        if (code[0] == OP_GET_LOCAL_GET_LOCAL_ADD && code[2] == slot) code[2] = pushed[1];
+        add(o, code, instruction.length, instruction.line, -1, index, instruction.label);
+        return;
+    }
+
+    // Adding numbers doesn't depend on their order, so a local and a
+    // one byte numeric constant still fit the fused form.
+    if (code[0] == OP_GET_LOCAL_GET_LOCAL_ADD && pushed[0] == OP_CONSTANT && (code[1] == slot) != (code[2] == slot) &&
+        IS_NUMBER(o->function->chunk.constants.values[pushed[1]])) {
+        uint8_t fused[3] = {OP_GET_LOCAL_CONSTANT_ADD, code[1] == slot ? code[2] : code[1], pushed[1]};
+        add(o, fused, 3, instruction.line, -1, index, instruction.label);
+        return;
+    }
+
+    uint8_t operand[4];
+    uint8_t op;
+    if (code[0] == OP_GET_LOCAL_GET_LOCAL_ADD) {
+        int length = code[1] == slot ? value.length : emit_get_local(operand, code[1]);
+        add(o, code[1] == slot ? pushed : operand, length, instruction.line, -1, index, instruction.label);
+        length = code[2] == slot ? value.length : emit_get_local(operand, code[2]);
+        add(o, code[2] == slot ? pushed : operand, length, instruction.line, -1, index, false);
+        op = OP_ADD;
+    } else {
+        add(o, pushed, value.length, instruction.line, -1, index, instruction.label);
+        operand[0] = OP_CONSTANT;
+        operand[1] = code[2];
+        add(o, operand, 2, instruction.line, -1, index, false);
+        op = code[0] == OP_GET_LOCAL_CONSTANT_ADD ? OP_ADD : OP_SUBTRACT;
+    }
+    add(o, &op, 1, instruction.line, -1, index, false);
+}
+
+// A local that starts out as a constant or a copy of another local, and
+// that nothing assigns while it is in scope, is read as that constant or
+// that other local. Only code between the push and the end of the local's
+// scope is looked at, and nothing may jump into it from outside.
+static bool propagate_copies(Optimizer *o) {
+    int count = o->code.count;
+    int *sources = malloc((count + 1) * sizeof(int));
+    if (sources == NULL) exit(1);
+    for (int i = 0; i < count; i++) {
+        sources[i] = -1;
+    }
+
+    bool changed = false;
+    for (int push = 0; push < count; push++) {
+        uint8_t *code = code_at(o, push);
+        int copy = -1;
+        if (code[0] == OP_GET_LOCAL) {
+            copy = code[1];
+        } else if (code[0] == OP_GET_LOCAL_LONG) {
+            copy = read_long(&code[1]);
+        } else if (!is_constant(code[0])) {
+            continue;
+        }
+
+        int slot = o->heights[push];
+        if (slot < 0 || o->captured[slot] || (copy >= 0 && o->captured[copy])) continue;
+
+        // The local lasts until something pops it.
+        int end = push + 1;
+        for (; end < count && o->heights[end] > slot; end++) {
+            int pops;
+            int pushes;
+            stack_effect(&o->view, o->code.instructions[end].start, &pops, &pushes);
+            if (o->heights[end] - pops <= slot) break;
+        }
+
+        bool safe = true;
+        for (int i = push + 1; i < end && safe; i++) {
+            uint8_t *inner = code_at(o, i);
+            if (writes_slot(inner, slot) || (copy >= 0 && writes_slot(inner, copy))) safe = false;
+            for (int edge = o->predecessor_start[i]; edge < o->predecessor_start[i + 1]; edge++) {
+                int predecessor = o->predecessors[edge];
+                if (predecessor < push || predecessor >= end) safe = false;
+            }
+        }
+
+        for (int i = push + 1; i < end && safe; i++) {
+            if (sources[i] < 0 && reads_slot(code_at(o, i), slot)) {
+                sources[i] = push;
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        begin_rewrite(o);
+        for (int i = 0; i < count; i++) {
+            if (sources[i] < 0) {
+                keep(o, i);
+            } else {
+                substitute(o, i, sources[i]);
+            }
+        }
+        end_rewrite(o);
+    }
+    free(sources);
+    return changed;
+}
+
+// The loop closed by the backward jump at back: its head and everything
+// that reaches back without going through the head.
+static bool* find_loop(Optimizer *o, int head, int back) {
+    int count = o->code.count;
+    bool *in_loop = calloc(count + 1, sizeof(bool));
+    int *work = malloc((count + 1) * sizeof(int));
+    if (in_loop == NULL || work == NULL) exit(1);
+
+    int work_count = 0;
+    in_loop[head] = true;
+    if (!in_loop[back]) {
+        in_loop[back] = true;
+        work[work_count++] = back;
+    }
+    while (work_count > 0) {
+        int i = work[--work_count];
+        for (int edge = o->predecessor_start[i]; edge < o->predecessor_start[i + 1]; edge++) {
+            int predecessor = o->predecessors[edge];
+            if (!in_loop[predecessor] && o->heights[predecessor] >= 0) {
+                in_loop[predecessor] = true;
+                work[work_count++] = predecessor;
+            }
+        }
+    }
+    free(work);
+    return in_loop;
+}
+
+static void mark_writes(Optimizer *o, uint8_t *code, bool *written) {
+    int slot = -1;
+    int count = 1;
+    switch (code[0]) {
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            slot = code[1];
+            break;
+        case OP_SET_LOCAL_LONG:
+            slot = read_long(&code[1]);
+            break;
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            slot = code[1];
+            count = 3;
+            break;
+        case OP_FOR_RANGE_LONG:
+        case OP_FOR_LIST_LONG:
+            slot = read_long(&code[1]);
+            count = 3;
+            break;
+        default:
+            return;
+    }
+    for (int i = slot; i < slot + count && i <= o->max_height; i++) {
+        written[i] = true;
+    }
+}
+
+static bool invariant_slot(Optimizer *o, bool *written, int hidden, int slot) {
+    return slot < hidden && !written[slot] && !o->captured[slot];
+}
+
+// What an instruction pushes is a number whenever it doesn't fail: the
+// arithmetic operators either give one or report an error.
+static bool pushes_number(Optimizer *o, int index, bool *before) {
+    uint8_t *code = code_at(o, index);
+    int height = o->heights[index];
+    Value value;
+    switch (code[0]) {
+        case OP_GET_LOCAL:                  return before[code[1]];
+        case OP_GET_LOCAL_LONG:             return before[read_long(&code[1])];
+        case OP_GET_LOCAL_GET_LOCAL_ADD:    return before[code[1]] && before[code[2]];
+        case OP_GET_LOCAL_CONSTANT_ADD:
+            return before[code[1]] && IS_NUMBER(o->function->chunk.constants.values[code[2]]);
+        case OP_ADD:                        return before[height - 2] && before[height - 1];
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+        case OP_NEGATE:
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            return true;
+        default:
+            return constant_value(o, &o->code.instructions[index], &value) && IS_NUMBER(value);
+    }
+}
+
+// The slots below head's stack height that hold a number every time
+// control gets there. Slots a closure shares never count, as a call can
+// assign them.
+static bool* numeric_slots(Optimizer *o, int head) {
+    int count = o->code.count;
+    int width = o->max_height + 1;
+    bool *states = malloc((size_t) count * width * sizeof(bool));
+    bool *reached = calloc(count + 1, sizeof(bool));
+    bool *queued = calloc(count + 1, sizeof(bool));
+    int *work = malloc((count + 1) * sizeof(int));
+    bool *after = malloc(width * sizeof(bool));
+    bool *written = malloc(width * sizeof(bool));
+    if (states == NULL || reached == NULL || queued == NULL || work == NULL || after == NULL || written == NULL) {
+        exit(1);
+    }
+
+    int work_count = 0;
+    if (count > 0) {
+        for (int slot = 0; slot < width; slot++) states[slot] = false;
+        reached[0] = queued[0] = true;
+        work[work_count++] = 0;
+    }
+    while (work_count > 0) {
+        int i = work[--work_count];
+        queued[i] = false;
+        bool *before = &states[(size_t) i * width];
+        uint8_t *code = code_at(o, i);
+        int pops;
+        int pushes;
+        stack_effect(&o->view, o->code.instructions[i].start, &pops, &pushes);
+
+        int kept = o->heights[i] - pops;
+        memcpy(after, before, width * sizeof(bool));
+        for (int slot = kept; slot < width; slot++) after[slot] = false;
+        if (pushes > 0) after[kept] = pushes_number(o, i, before);
+        if (code[0] == OP_SET_LOCAL || code[0] == OP_SET_LOCAL_POP) {
+            after[code[1]] = before[o->heights[i] - 1];
+        } else if (code[0] == OP_SET_LOCAL_LONG) {
+            after[read_long(&code[1])] = before[o->heights[i] - 1];
+        } else if (is_for_step(code[0])) {
+            memset(written, 0, width * sizeof(bool));
+            mark_writes(o, code, written);
+            for (int slot = 0; slot < width; slot++) after[slot] &= !written[slot];
+        }
+        for (int slot = 0; slot < width; slot++) after[slot] &= !o->captured[slot];
+
+        for (int edge = o->successor_start[i]; edge < o->successor_start[i + 1]; edge++) {
+            int successor = o->successors[edge];
+            bool *state = &states[(size_t) successor * width];
+            bool changed = !reached[successor];
+            if (changed) {
+                memcpy(state, after, width * sizeof(bool));
+                reached[successor] = true;
+            } else {
+                for (int slot = 0; slot < width; slot++) {
+                    if (state[slot] && !after[slot]) {
+                        state[slot] = false;
+                        changed = true;
+                    }
+                }
+            }
+            if (changed && !queued[successor]) {
+                queued[successor] = true;
+                work[work_count++] = successor;
+            }
+        }
+    }
+
+    bool *numeric = calloc(width, sizeof(bool));
+    if (numeric == NULL) exit(1);
+    if (reached[head]) memcpy(numeric, &states[(size_t) head * width], o->heights[head] * sizeof(bool));
+    free(states);
+    free(reached);
+    free(queued);
+    free(work);
+    free(after);
+    free(written);
+    return numeric;
+}
+
+static void consider(Operand *best, Operand operand) {
+    if (operand.invariant && operand.computed && operand.movable && (best->start < 0 || operand.start < best->start)) {
+        *best = operand;
+    }
+}
+
+// Considers every operand still on the stack, which the search stops
+// following from here.
+static void consider_all(Operand *best, Operand *operands, int *depth) {
+    for (int p = 0; p < *depth; p++) {
+        consider(best, operands[p]);
+    }
+    *depth = 0;
+}
+
+// The first expression in the loop computed only from constants and from
+// locals the loop never assigns. One at the head of the loop may be
+// anything that ran before the loop could do anything else that would be
+// seen, as it ran first on every pass anyway. The head ends at the first
+// branch, and at the first thing that could fail and isn't invariant.
+// Anywhere else the expression has to be pure, so that computing it even
+// when the loop wouldn't have can't report an error out of order. Numbers
+// are what make arithmetic pure, so numeric says which locals hold them.
+static Operand find_invariant(Optimizer *o, int head, bool *in_loop, bool *written, bool *numeric, int hidden) {
+    Operand operands[OPERANDS_MAX];
+    int depth = 0;
+    bool at_head = true;
+    Operand best = {-1, -1, false, false, false, false, false};
+    Value *constants = o->function->chunk.constants.values;
+
+    for (int i = head; i < o->code.count; i++) {
+        if (!in_loop[i]) continue;
+        if (i != head && (o->code.instructions[i].label || !in_loop[i - 1])) {
+            consider_all(&best, operands, &depth);
+            at_head = false;
+        }
+
+        uint8_t *code = code_at(o, i);
+        Operand result = {i, i, false, false, false, true, false};
+        Value value;
+        int pops = 0;
+        switch (code[0]) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                result.invariant = true;
+                result.number = constant_value(o, &o->code.instructions[i], &value) && IS_NUMBER(value);
+                break;
+            case OP_GET_LOCAL:
+                result.invariant = invariant_slot(o, written, hidden, code[1]);
+                result.number = result.invariant && numeric[code[1]];
+                break;
+            case OP_GET_LOCAL_LONG:
+                result.invariant = invariant_slot(o, written, hidden, read_long(&code[1]));
+                result.number = result.invariant && numeric[read_long(&code[1])];
+                break;
+            case OP_GET_UPVALUE:
+                break;
+            case OP_GET_LOCAL_GET_LOCAL_ADD:
+                result.invariant = invariant_slot(o, written, hidden, code[1]) &&
+                                   invariant_slot(o, written, hidden, code[2]);
+                result.computed = true;
+                result.number = result.invariant && numeric[code[1]] && numeric[code[2]];
+                result.pure = result.number;
+                break;
+            case OP_GET_LOCAL_CONSTANT_ADD:
+            case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+                result.invariant = invariant_slot(o, written, hidden, code[1]);
+                result.computed = true;
+                result.number = result.invariant && numeric[code[1]] && IS_NUMBER(constants[code[2]]);
+                result.pure = result.number;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                pops = 1;
+                break;
+            default:
+                pops = is_binary(code[0]) ? 2 : -1;
+                break;
+        }
+
+        if (pops > 0 && pops <= depth) {
+            Operand *left = &operands[depth - pops];
+            Operand *right = &operands[depth - 1];
+            bool numbers = left->number && right->number;
+            result.start = left->start;
+            result.invariant = left->invariant && right->invariant;
+            result.computed = true;
+            result.pure = left->pure && right->pure;
+            switch (code[0]) {
+                case OP_NOT:
+                case OP_EQUAL:
+                    break;
+                case OP_NEGATE:
+                case OP_ADD:
+                case OP_SUBTRACT:
+                case OP_MULTIPLY:
+                case OP_DIVIDE:
+                case OP_MOD:
+                    result.number = numbers;
+                    result.pure &= numbers;
+                    break;
+                case OP_GREATER:
+                case OP_LESS:
+                    result.pure &= numbers;
+                    break;
+                default:
+                    result.pure = false;
+                    break;
+            }
+            if (!result.invariant) {
+                for (int p = depth - pops; p < depth; p++) {
+                    consider(&best, operands[p]);
+                }
+            }
+            depth -= pops;
+        } else if (pops != 0) {
+            // Something the search doesn't follow, which may fail, branch
+            // or have an effect.
+            consider_all(&best, operands, &depth);
+            at_head = false;
+            continue;
+        }
+
+        result.movable = at_head || result.pure;
+        if (!result.invariant && !result.pure) at_head = false;
+        if (depth == OPERANDS_MAX) consider_all(&best, operands, &depth);
+        operands[depth++] = result;
+    }
+
+    consider_all(&best, operands, &depth);
+    return best;
+}
+
+static bool shift_byte(uint8_t *slot, int from, int room) {
+    if (*slot < from) return true;
+    if (*slot + room >= UINT8_MAX) return false;
+    (*slot)++;
+    return true;
+}
+
+// Copies the instruction at index into code with every local slot from
+// `from` on moved up one. False if one no longer fits its operand.
+static bool shift_slots(Optimizer *o, int index, int from, uint8_t *code) {
+    Instruction *instruction = &o->code.instructions[index];
+    memcpy(code, &o->bytes[instruction->start], instruction->length);
+    switch (code[0]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_LOCAL_CONSTANT_ADD:
+        case OP_GET_LOCAL_CONSTANT_SUBTRACT:
+            return shift_byte(&code[1], from, 0);
+        case OP_FOR_RANGE:
+        case OP_FOR_LIST:
+            return shift_byte(&code[1], from, 2);
+        case OP_GET_LOCAL_GET_LOCAL_ADD:
+            return shift_byte(&code[1], from, 0) && shift_byte(&code[2], from, 0);
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_FOR_RANGE_LONG:
+        case OP_FOR_LIST_LONG: {
+            int slot = read_long(&code[1]);
+            if (slot < from) return true;
+            if (++slot + (is_for_step(code[0]) ? 2 : 0) > UINT24_MAX) return false;
+            code[1] = (slot >> 16) & 0xFF;
+            code[2] = (slot >> 8) & 0xFF;
+            code[3] = slot & 0xFF;
+            return true;
+        }
+        case OP_CLOSURE:
+            for (int p = 2; p < instruction->length; p += 2) {
+                if (code[p] != CAPTURE_UPVALUE && !shift_byte(&code[p + 1], from, 0)) return false;
+            }
+            return true;
+        case OP_CLOSURE_LONG:
+            for (int p = 4; p < instruction->length; p += 3) {
+                int slot = (code[p + 1] << 8) | code[p + 2];
+                if (code[p] == CAPTURE_UPVALUE || slot < from) continue;
+                if (++slot > UINT16_MAX) return false;
+                code[p + 1] = (slot >> 8) & 0xFF;
+                code[p + 2] = slot & 0xFF;
+            }
+            return true;
+        default:
+            return true;
+    }
+}
+
+// Moves the first invariant expression at the head of the loop closed
+// by the jump at back into a new local just in front of the loop. The
+// loop has to be entered by falling into its head and left through the
+// OP_POP of its condition, which pops the new local as well. Everything
+// the loop keeps on the stack above it moves up a slot.
+static bool hoist_from_loop(Optimizer *o, int head, int back) {
+    int count = o->code.count;
+    int hidden = o->heights[head];
+    bool *in_loop = find_loop(o, head, back);
+    bool *written = calloc(o->max_height + 1, sizeof(bool));
+    if (written == NULL) exit(1);
+
+    int exit = -1;
+    bool movable = hidden <= UINT8_MAX;
+    for (int i = 0; i < count && movable; i++) {
+        if (!in_loop[i]) continue;
+        if (o->heights[i] < hidden) movable = false;
+        for (int edge = o->predecessor_start[i]; edge < o->predecessor_start[i + 1]; edge++) {
+            int predecessor = o->predecessors[edge];
+            if (in_loop[predecessor] || o->heights[predecessor] < 0) continue;
+            if (i != head || predecessor != head - 1) movable = false;
+        }
+        for (int edge = o->successor_start[i]; edge < o->successor_start[i + 1]; edge++) {
+            int successor = o->successors[edge];
+            if (in_loop[successor]) continue;
+            if (exit >= 0 && exit != successor) movable = false;
+            exit = successor;
+        }
+        mark_writes(o, code_at(o, i), written);
+    }
+
+    movable = movable && exit >= 0 && code_at(o, exit)[0] == OP_POP && o->heights[exit] == hidden + 1;
+    for (int edge = movable ? o->predecessor_start[exit] : 0; movable && edge < o->predecessor_start[exit + 1]; edge++) {
+        int predecessor = o->predecessors[edge];
+        if (!in_loop[predecessor] && o->heights[predecessor] >= 0) movable = false;
+    }
+
+    Operand invariant = {-1, -1, false, false, false, false, false};
+    if (movable) {
+        bool *numeric = numeric_slots(o, head);
+        invariant = find_invariant(o, head, in_loop, written, numeric, hidden);
+        free(numeric);
+    }
+    movable = movable && invariant.start >= 0;
+
+    uint8_t code[INSTRUCTION_MAX];
+    for (int i = 0; i < count && movable; i++) {
+        if (in_loop[i] && !shift_slots(o, i, hidden, code)) movable = false;
+    }
+
+    if (movable) {
+        begin_rewrite(o);
+        for (int i = 0; i < count; i++) {
+            Instruction instruction = o->code.instructions[i];
+            if (i == head) {
+                for (int j = invariant.start; j <= invariant.end; j++) {
+                    Instruction copy = o->code.instructions[j];
+                    copy.origin = head - 1;
+                    copy.label = false;
+                    append(&o->next, copy);
+                }
+            }
+
+            if (i >= invariant.start && i <= invariant.end) {
+                uint8_t get[2] = {OP_GET_LOCAL, (uint8_t) hidden};
+                if (i == invariant.start) add(o, get, 2, instruction.line, -1, i, instruction.label);
+            } else if (in_loop[i] && shift_slots(o, i, hidden, code) &&
+                       memcmp(code, &o->bytes[instruction.start], instruction.length) != 0) {
+                add(o, code, instruction.length, instruction.line, instruction.target, i, instruction.label);
+            } else {
+                keep(o, i);
+            }
+
+            if (i == exit) {
+                uint8_t pop = OP_POP;
+                add(o, &pop, 1, instruction.line, -1, i, false);
+            }
+        }
+        end_rewrite(o);
+    }
+
+    free(in_loop);
+    free(written);
+    return movable;
+}
+
+static bool hoist_invariant(Optimizer *o) {
+    for (int back = 0; back < o->code.count; back++) {
+        Instruction *jump = &o->code.instructions[back];
+        if (o->heights[back] < 0 || code_at(o, back)[0] != OP_JUMP || jump->target > back) continue;
+        if (hoist_from_loop(o, jump->target, back)) return true;
+    }
+    return false;
+}
+
+// An OP_LESS_JUMP_IF_FALSE that can't reach comes apart into OP_LESS and
+// a long OP_JUMP_IF_FALSE, and an OP_JUMP_IF_TRUE into OP_NOT and one.
+static int encoded_length(Optimizer *o, int index, bool wide) {
+    switch (code_at(o, index)[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return wide ? 4 : 3;
+        case OP_JUMP_IF_TRUE:
+        case OP_LESS_JUMP_IF_FALSE:
+            return wide ? 5 : 3;
+        default:
+            return o->code.instructions[index].length;
+    }
+}
+
+static void write_jump(uint8_t *code, uint8_t op, int distance, bool wide) {
+    code[0] = op;
+    if (wide) {
+        code[1] = (distance >> 16) & 0xFF;
+        code[2] = (distance >> 8) & 0xFF;
+        code[3] = distance & 0xFF;
+    } else {
+        code[1] = (distance >> 8) & 0xFF;
+        code[2] = distance & 0xFF;
+    }
+}
+
+// Lays the instructions out with every jump short, and makes the ones
+// that don't reach long until they all do. Only conditional jumps going
+// forward and plain jumps have a long form to grow into; if anything else
+// can't reach, the chunk is left as the compiler wrote it and this is
+// false.
+static bool encode(Optimizer *o) {
+    int count = o->code.count;
+    int *offsets = malloc((count + 1) * sizeof(int));
+    bool *wide = calloc(count + 1, sizeof(bool));
+    if (offsets == NULL || wide == NULL) exit(1);
+
+    bool valid = true;
+    for (bool grew = true; grew && valid;) {
+        grew = false;
+        int offset = 0;
+        for (int i = 0; i < count; i++) {
+            offsets[i] = offset;
+            offset += encoded_length(o, i, wide[i]);
+        }
+        offsets[count] = offset;
+
+        for (int i = 0; i < count; i++) {
+            Instruction *instruction = &o->code.instructions[i];
+            if (instruction->target < 0) continue;
+            uint8_t op = code_at(o, i)[0];
+            int end = offsets[i] + encoded_length(o, i, wide[i]);
+            bool backward = instruction->target <= i;
+            int distance = backward ? end - offsets[instruction->target] : offsets[instruction->target] - end;
+            bool loops = is_for_step(op);
+            if (op != OP_JUMP && backward != loops) valid = false;
+            if (distance <= (wide[i] ? UINT24_MAX : UINT16_MAX)) continue;
+            if (wide[i] || loops) {
+                valid = false;
+            } else {
+                wide[i] = true;
+                grew = true;
+            }
+        }
+    }
+
+    Chunk *chunk = &o->function->chunk;
+    if (valid) {
+        int size = offsets[count];
+        uint8_t *code = GROW_ARRAY(uint8_t, NULL, 0, size);
+        int *lines = GROW_ARRAY(int, NULL, 0, size);
+        for (int i = 0; i < count; i++) {
+            Instruction *instruction = &o->code.instructions[i];
+            uint8_t *bytes = &code[offsets[i]];
+            int length = encoded_length(o, i, wide[i]);
+            int end = offsets[i] + length;
+            int target = instruction->target >= 0 ? offsets[instruction->target] : 0;
+            uint8_t op = code_at(o, i)[0];
+            memcpy(bytes, code_at(o, i), instruction->length);
+            switch (op) {
+                case OP_JUMP:
+                    if (instruction->target <= i) {
+                        write_jump(bytes, wide[i] ? OP_LOOP_LONG : OP_LOOP, end - target, wide[i]);
+                    } else {
+                        write_jump(bytes, wide[i] ? OP_JUMP_LONG : OP_JUMP, target - end, wide[i]);
+                    }
+                    break;
+                case OP_JUMP_IF_FALSE:
+                    write_jump(bytes, wide[i] ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_FALSE, target - end, wide[i]);
+                    break;
+                case OP_JUMP_IF_TRUE:
+                case OP_LESS_JUMP_IF_FALSE:
+                    if (wide[i]) {
+                        bytes[0] = op == OP_JUMP_IF_TRUE ? OP_NOT : OP_LESS;
+                        write_jump(bytes + 1, OP_JUMP_IF_FALSE_LONG, target - end, true);
+                    } else {
+                        write_jump(bytes, op, target - end, false);
+                    }
+                    break;
+                case OP_FOR_RANGE:
+                case OP_FOR_LIST:
+                    write_jump(bytes + 1, bytes[1], end - target, false);
+                    bytes[0] = op;
+                    break;
+                case OP_FOR_RANGE_LONG:
+                case OP_FOR_LIST_LONG:
+                    write_jump(bytes + 3, bytes[3], end - target, false);
+                    bytes[0] = op;
+                    break;
+            }
+            for (int byte = offsets[i]; byte < end; byte++) {
+                lines[byte] = instruction->line;
+            }
+        }
+
+        // Tables whose switch was removed keep arms that go nowhere.
+        for (int table = 0; table < chunk->switch_count; table++) {
+            SwitchTable *switches = &chunk->switches[table];
+            for (int arm = 0; arm < switches->arm_count; arm++) {
+                switches->targets[arm] = 0;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (code_at(o, i)[0] != OP_SWITCH) continue;
+            int table = switch_index(code_at(o, i));
+            SwitchTable *switches = &chunk->switches[table];
+            for (int arm = 0; arm < switches->arm_count; arm++) {
+                switches->targets[arm] = offsets[o->arms[table][arm]];
+            }
+        }
+
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        chunk->code = code;
+        chunk->lines = lines;
+        chunk->count = size;
+        chunk->capacity = size;
+    }
+
+    free(offsets);
+    free(wide);
+    return valid;
+}
+
+void optimize_function(ObjFunction *function) {
+    Optimizer o;
+    memset(&o, 0, sizeof(Optimizer));
+    o.function = function;
+
+    int removed = 0;
+    bool changed = false;
+    bool valid = decode(&o);
+    int round = 0;
+    for (; round < ROUNDS_MAX && valid; round++) {
+        bool progress = false;
+        valid = analyze(&o);
+        if (valid) progress |= peephole(&o, &removed);
+        if (vm.optimize_level >= 1) {
+            valid = valid && analyze(&o);
+            if (valid) progress |= fold_constants(&o);
+            valid = valid && analyze(&o);
+            if (valid) progress |= remove_dead_code(&o);
+            valid = valid && analyze(&o);
+            if (valid) progress |= propagate_copies(&o);
+        }
+        changed |= progress;
+        if (!progress) break;
+    }
+    // Each hoist leaves a local read where a computation was, and puts the
+    // computation outside the loop, so this ends once every invariant is
+    // outside its outermost loop or the slots run out.
+    while (valid && vm.optimize_level >= 2) {
+        valid = analyze(&o);
+        if (!valid || !hoist_invariant(&o)) break;
+        changed = true;
+    }
+    changed = valid && changed && encode(&o);
+
+#ifdef DEBUG_PRINT_CODE
+    if (round == ROUNDS_MAX) {
+        printf("%s: cleanup stopped after %d rounds\n",
+               function->name != NULL ? function->name->chars : "<script>", ROUNDS_MAX);
+    }
+    if (changed && removed > 0) {
+        printf("%s: peephole removed %d instructions\n",
+               function->name != NULL ? function->name->chars : "<script>", removed);
+    }
+#endif
+
+    free(o.bytes);
+    free(o.code.instructions);
+    free(o.next.instructions);
+    for (int table = 0; table < function->chunk.switch_count; table++) {
+        free(o.arms[table]);
+    }
+    free(o.arms);
+    free(o.heights);
+    free(o.successor_start);
+    free(o.successors);
+    free(o.predecessor_start);
+    free(o.predecessors);
+    free(o.captured);
+}
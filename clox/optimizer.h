@@ -0,0 +1,13 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "object.h"
+
+// A peephole pass always cleans up jumps, dead code and redundant stack
+// traffic. -O1 also folds constants, removes dead code and propagates
+// copies; -O2 also hoists loop-invariant expressions out of loops: any at
+// the head of the loop, and pure ones, which can't fail, from anywhere in
+// it.
+void optimize_function(ObjFunction *function);
+
+#endif
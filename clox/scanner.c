@@ -4,12 +4,6 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
 Scanner scanner;
 
 void init_scanner(const char *source) {
@@ -105,7 +99,15 @@ static TokenType check_keyword(int start, int length, const char *rest, TokenTyp
 static TokenType identifier_type(void) {
     switch (scanner.start[0]) {
         case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
+        case 'c':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'a': return check_keyword(2, 2, "se", TOKEN_CASE);
+                    case 'l': return check_keyword(2, 3, "ass", TOKEN_CLASS);
+                }
+            }
+            break;
+        case 'd': return check_keyword(1, 6, "efault", TOKEN_DEFAULT);
         case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
         case 'f':
             if (scanner.current - scanner.start > 1) {
@@ -116,12 +118,26 @@ static TokenType identifier_type(void) {
                 }
             }
             break;
-        case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
+        case 'i':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'f': return check_keyword(2, 0, "", TOKEN_IF);
+                    case 'n': return check_keyword(2, 0, "", TOKEN_IN);
+                }
+            }
+            break;
         case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
         case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
         case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
         case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
+        case 's':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'u': return check_keyword(2, 3, "per", TOKEN_SUPER);
+                    case 'w': return check_keyword(2, 4, "itch", TOKEN_SWITCH);
+                }
+            }
+            break;
         case 't':
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
@@ -184,19 +200,27 @@ Token scan_token(void) {
         case '}': return make_token(TOKEN_RIGHT_BRACE);
         case ';': return make_token(TOKEN_SEMICOLON);
         case ',': return make_token(TOKEN_COMMA);
-        case '.': return make_token(TOKEN_DOT);
+        case ':': return make_token(TOKEN_COLON);
+        case '.': return make_token(match('.') ? TOKEN_DOT_DOT : TOKEN_DOT);
         case '-': return make_token(TOKEN_MINUS);
         case '+': return make_token(TOKEN_PLUS);
         case '/': return make_token(TOKEN_SLASH);
         case '*': return make_token(TOKEN_STAR);
         case '!': return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>': return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '<':
+            if (match('<')) return make_token(TOKEN_LESS_LESS);
+            return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        case '>':
+            if (match('>')) return make_token(TOKEN_GREATER_GREATER);
+            return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         case '"': return string();
         case '[': return make_token(TOKEN_LEFT_SQUARE_BRACKET);
         case ']': return make_token(TOKEN_RIGHT_SQUARE_BRACKET);
         case '%': return make_token(TOKEN_MOD);
+        case '&': return make_token(TOKEN_AMPERSAND);
+        case '|': return make_token(TOKEN_PIPE);
+        case '^': return make_token(TOKEN_CARET);
     }
     
     return error_token("Unexpected character.");
@@ -18,6 +18,10 @@ typedef enum {
     TOKEN_ERROR, TOKEN_EOF,
     TOKEN_LEFT_SQUARE_BRACKET, TOKEN_RIGHT_SQUARE_BRACKET,
     TOKEN_MOD,
+    TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET,
+    TOKEN_LESS_LESS, TOKEN_GREATER_GREATER,
+    TOKEN_IN, TOKEN_DOT_DOT,
+    TOKEN_SWITCH, TOKEN_CASE, TOKEN_DEFAULT, TOKEN_COLON,
 } TokenType;
 
 typedef struct {
@@ -27,6 +31,14 @@ typedef struct {
     int line;
 } Token;
 
+typedef struct {
+    const char *start;
+    const char *current;
+    int line;
+} Scanner;
+
+extern Scanner scanner;
+
 void init_scanner(const char *source);
 Token scan_token(void);
 
@@ -33,8 +33,10 @@ void print_value(Value value) {
         printf(AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
         printf("nil");
-    } else if (IS_NUMBER(value)) {
-        printf("%g", AS_NUMBER(value));
+    } else if (IS_INT(value)) {
+        printf("%lld", (long long) AS_INT(value));
+    } else if (IS_DOUBLE(value)) {
+        printf("%g", AS_DOUBLE(value));
     } else if (IS_OBJ(value)) {
         print_object(value);
     }
@@ -42,24 +44,30 @@ void print_value(Value value) {
     switch (value.type) {
         case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
         case VAL_NIL:    printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: printf("%g", AS_DOUBLE(value)); break;
+        case VAL_INT:    printf("%lld", (long long) AS_INT(value)); break;
         case VAL_OBJ:    print_object(value); break;
     }
 #endif
 }
 
 bool values_equal(Value a, Value b) {
-#ifdef NAN_BOXING
-    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    // An integer equals the double with the same value.
+    if (IS_INT(a) != IS_INT(b) && IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
+#ifdef NAN_BOXING
+    if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+        return AS_DOUBLE(a) == AS_DOUBLE(b);
+    }
     return a == b;
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_NUMBER: return AS_DOUBLE(a) == AS_DOUBLE(b);
+        case VAL_INT:    return AS_INT(a) == AS_INT(b);
         case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
         default:         return false;
     }
@@ -16,23 +16,36 @@ typedef struct ObjString ObjString;
 #define TAG_NIL             1
 #define TAG_FALSE           2
 #define TAG_TRUE            3
+#define TAG_UNDEFINED       4   // Unset global slots, never on the stack
+
+// Integers live in the low 48 bits of a quiet NaN with bit 48 set, which
+// keeps them clear of the singletons above and of object pointers.
+#define TAG_INT             ((uint64_t)1 << 48)
+#define INT_MASK            ((uint64_t)0x0000ffffffffffff)
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value)       (((value) >> 48) == ((QNAN | TAG_INT) >> 48))
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
-#define AS_NUMBER(value)    value_to_num(value)
+#define AS_DOUBLE(value)    value_to_num(value)
+#define AS_INT(value)       ((int64_t)((value) << 16) >> 16)
+#define AS_NUMBER(value)    value_as_number(value)
 #define AS_OBJ(value)       ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num)     num_to_value(num)
+#define INT_VAL(i)          ((Value)(QNAN | TAG_INT | ((uint64_t)(i) & INT_MASK)))
 #define OBJ_VAL(obj)        (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline double value_to_num(Value value) {
@@ -47,12 +60,17 @@ static inline Value num_to_value(double num) {
     return value;
 }
 
+static inline double value_as_number(Value value) {
+    return IS_INT(value) ? (double) AS_INT(value) : value_to_num(value);
+}
+
 #else
 
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ,
 } ValueType;
 
@@ -61,26 +79,70 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;
 } Value;
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_NIL && (value).as.integer == 1)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_DOUBLE(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+#define AS_NUMBER(value)  value_as_number(value)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL     ((Value){VAL_NIL, {.integer = 1}})   // Unset global slots
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(value)    ((Value){VAL_OBJ, {.obj = (Obj*) value}})
 
+static inline double value_as_number(Value value) {
+    return IS_INT(value) ? (double) AS_INT(value) : AS_DOUBLE(value);
+}
+
 #endif
 
+// Both representations keep integers to 48 bits. Arithmetic that leaves
+// that range gives a double instead.
+#define INTEGER_MAX       ((int64_t)0x00007fffffffffff)
+#define INTEGER_MIN       (-INTEGER_MAX - 1)
+#define INTEGER_FITS(i)   ((i) >= INTEGER_MIN && (i) <= INTEGER_MAX)
+
+static inline Value integer_value(int64_t i) {
+    return INTEGER_FITS(i) ? INT_VAL(i) : NUMBER_VAL((double) i);
+}
+
+// Two 48-bit integers can multiply past 64 bits, so the range check is
+// done on the double product, which is exact whenever the result fits.
+static inline Value integer_multiply(int64_t a, int64_t b) {
+    double product = (double) a * (double) b;
+    if (product < (double) INTEGER_MIN || product > (double) INTEGER_MAX) return NUMBER_VAL(product);
+    return INT_VAL(a * b);
+}
+
+// An integer, or a double that holds one.
+static inline bool as_integer(Value value, int64_t *result) {
+    if (IS_INT(value)) {
+        *result = AS_INT(value);
+        return true;
+    }
+    if (!IS_DOUBLE(value)) return false;
+    double number = AS_DOUBLE(value);
+    if (!(number >= (double) INTEGER_MIN && number <= (double) INTEGER_MAX)) return false;
+    if (number != (double) (int64_t) number) return false;
+    *result = (int64_t) number;
+    return true;
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -1,12 +1,17 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
 
 #include "compiler.h"
 #include "common.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -16,14 +21,67 @@ static Value clock_native(int arg_count, Value *args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
-static Value sqrt_native(int arg_count, Value *args) {
-    return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+static double sqrt_number(double x) {
+    return sqrt(x);
+}
+
+static double floor_number(double x) {
+    return floor(x);
+}
+
+static double ceil_number(double x) {
+    return ceil(x);
+}
+
+static double abs_number(double x) {
+    return fabs(x);
+}
+
+static double sin_number(double x) {
+    return sin(x);
+}
+
+static double cos_number(double x) {
+    return cos(x);
+}
+
+static double tan_number(double x) {
+    return tan(x);
+}
+
+static double atan_number(double x) {
+    return atan(x);
+}
+
+static double exp_number(double x) {
+    return exp(x);
+}
+
+static double log_number(double x) {
+    return log(x);
+}
+
+static double pow_number(double x, double y) {
+    return pow(x, y);
+}
+
+static double atan2_number(double y, double x) {
+    return atan2(y, x);
+}
+
+static double min_number(double x, double y) {
+    return x < y ? x : y;
+}
+
+static double max_number(double x, double y) {
+    return x > y ? x : y;
 }
 
 static void reset_stack(void) {
     vm.stack_top = vm.stack;
     vm.frame_count = 0;
     vm.open_upvalues = NULL;
+    vm.tail_code = NULL;
 }
 
 static void runtime_error(const char *format, ...) {
@@ -36,8 +94,9 @@ static void runtime_error(const char *format, ...) {
     for (int i = vm.frame_count - 1; i >= 0; i--) {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        Chunk *chunk = frame->engine == ENGINE_REGISTERS ? &function->register_code : &function->chunk;
+        size_t instruction = frame->ip - chunk->code - 1;
+        fprintf(stderr, "[line %d] in ", chunk->lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -48,16 +107,58 @@ static void runtime_error(const char *format, ...) {
     reset_stack();
 }
 
-static void define_native(const char *name, NativeFn function) {
+static ObjNative* add_native(const char *name, int arity, NativeFn function,
+                             NativeNumberFn number_function, NativeBinaryFn binary_function) {
     push(OBJ_VAL(copy_string(name, (int) strlen(name))));
-    push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(new_native(arity, function, number_function, binary_function)));
+    define_global_slot(AS_STRING(vm.stack[0]));
+    vm.globals.values[AS_STRING(vm.stack[0])->global] = vm.stack[1];
+    ObjNative *native = AS_NATIVE(vm.stack[1]);
     pop();
     pop();
+    return native;
+}
+
+// Defines a native that takes arity arguments, or any number for -1.
+static ObjNative* define_native(const char *name, int arity, NativeFn function) {
+    return add_native(name, arity, function, NULL, NULL);
+}
+
+// Defines a native from a double -> double function, which call sites
+// can invoke directly without boxing the argument.
+static ObjNative* define_number_native(const char *name, NativeNumberFn function) {
+    return add_native(name, 1, NULL, function, NULL);
+}
+
+static ObjNative* define_binary_native(const char *name, NativeBinaryFn function) {
+    return add_native(name, 2, NULL, NULL, function);
+}
+
+// How much deeper than init_vm() the C stack can go, less the margin the
+// last call needs to report the overflow.
+static size_t c_stack_size(void) {
+    size_t size = C_STACK_DEFAULT;
+#if defined(__unix__) || defined(__APPLE__)
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) size = limit.rlim_cur;
+#endif
+    return size > 2 * C_STACK_MARGIN ? size - C_STACK_MARGIN : size / 2;
 }
 
 void init_vm(void) {
+    char base;
+    vm.c_stack_limit = (uintptr_t) &base - c_stack_size();
+    vm.frames = malloc(FRAMES_INITIAL * sizeof(CallFrame));
+    vm.frame_capacity = FRAMES_INITIAL;
+    vm.frames_max = FRAMES_MAX;
+    vm.stack = malloc(STACK_INITIAL * sizeof(Value));
+    vm.stack_end = vm.stack + STACK_INITIAL;
+    if (vm.frames == NULL || vm.stack == NULL) exit(1);
+    for (Value *slot = vm.stack; slot < vm.stack_end; slot++) *slot = NIL_VAL;
     reset_stack();
+    vm.use_registers = false;
+    vm.use_jit = true;
+    vm.optimize_level = 1;
     vm.objects = NULL;
     vm.bytes_allocated = 0;
     vm.next_gc = 1024 * 1024;
@@ -66,21 +167,58 @@ void init_vm(void) {
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
     
-    init_table(&vm.globals);
+    init_value_array(&vm.globals);
+    init_value_array(&vm.global_names);
     init_table(&vm.strings);
     
+    memset(vm.megamorphic_cache, 0, sizeof(vm.megamorphic_cache));
+    
     vm.init_string = NULL;
+    vm.empty_shape = NULL;
+    vm.selector_count = 0;
     vm.init_string = copy_string("init", 4);
+    vm.empty_shape = new_shape();
     
-    define_native("clock", clock_native);
-    define_native("sqrt", sqrt_native);
+    memset(vm.intrinsics, 0, sizeof(vm.intrinsics));
+    vm.intrinsics[INTRINSIC_CLOCK] = define_native("clock", 0, clock_native);
+    vm.intrinsics[INTRINSIC_SQRT] = define_number_native("sqrt", sqrt_number);
+    vm.intrinsics[INTRINSIC_FLOOR] = define_number_native("floor", floor_number);
+    vm.intrinsics[INTRINSIC_CEIL] = define_number_native("ceil", ceil_number);
+    vm.intrinsics[INTRINSIC_ABS] = define_number_native("abs", abs_number);
+    vm.intrinsics[INTRINSIC_SIN] = define_number_native("sin", sin_number);
+    vm.intrinsics[INTRINSIC_COS] = define_number_native("cos", cos_number);
+    vm.intrinsics[INTRINSIC_TAN] = define_number_native("tan", tan_number);
+    vm.intrinsics[INTRINSIC_ATAN] = define_number_native("atan", atan_number);
+    vm.intrinsics[INTRINSIC_EXP] = define_number_native("exp", exp_number);
+    vm.intrinsics[INTRINSIC_LOG] = define_number_native("log", log_number);
+    vm.intrinsics[INTRINSIC_POW] = define_binary_native("pow", pow_number);
+    vm.intrinsics[INTRINSIC_ATAN2] = define_binary_native("atan2", atan2_number);
+    vm.intrinsics[INTRINSIC_MIN] = define_binary_native("min", min_number);
+    vm.intrinsics[INTRINSIC_MAX] = define_binary_native("max", max_number);
+}
+
+// Frames are reserved against frame_capacity by machine code, so that never
+// goes past the ceiling either.
+void set_frames_max(int frames_max) {
+    vm.frames_max = frames_max;
+    if (vm.frame_capacity > frames_max) vm.frame_capacity = frames_max;
 }
 
 void free_vm(void) {
-    free_table(&vm.globals);
+#ifdef DEBUG_PROFILE_OPCODES
+    print_opcode_pairs(vm.opcode_pairs, 40);
+#endif
+#ifdef DEBUG_PROFILE_CACHES
+    print_cache_profile(vm.objects);
+#endif
+    free_value_array(&vm.globals);
+    free_value_array(&vm.global_names);
     free_table(&vm.strings);
     vm.init_string = NULL;
+    vm.empty_shape = NULL;
     free_objects();
+    free(vm.frames);
+    free(vm.stack);
 }
 
 void push(Value value) {
@@ -97,53 +235,303 @@ static Value peek(int distance) {
     return vm.stack_top[-1 - distance];
 }
 
+// Moves the value stack to a bigger allocation, along with everything
+// that points into it.
+static bool grow_stack(size_t needed) {
+    size_t capacity = vm.stack_end - vm.stack;
+    while (capacity < needed) capacity *= 2;
+    
+    Value *stack = malloc(capacity * sizeof(Value));
+    if (stack == NULL) return false;
+    memcpy(stack, vm.stack, (vm.stack_top - vm.stack) * sizeof(Value));
+    
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    vm.stack_top = stack + (vm.stack_top - vm.stack);
+    for (Value *slot = vm.stack_top; slot < stack + capacity; slot++) *slot = NIL_VAL;
+    
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stack_end = stack + capacity;
+    return true;
+}
+
+// Makes room for one more frame using slot_count slots from its callee
+// up. Growing either stack moves it, so callers have to reload any frame
+// or slot pointers they hold once the call is made.
+static bool reserve_frame(Value *callee, int slot_count) {
+    char here;
+    if ((uintptr_t) &here < vm.c_stack_limit - C_STACK_MARGIN / 2) return false;
+    if (vm.frame_count >= vm.frames_max) return false;
+    if (vm.frame_count == vm.frame_capacity) {
+        int capacity = GROW_CAPACITY(vm.frame_capacity);
+        if (capacity > vm.frames_max) capacity = vm.frames_max;
+        CallFrame *frames = realloc(vm.frames, capacity * sizeof(CallFrame));
+        if (frames == NULL) return false;
+        vm.frames = frames;
+        vm.frame_capacity = capacity;
+    }
+    
+    size_t needed = (callee - vm.stack) + slot_count;
+    if (needed > (size_t)(vm.stack_end - vm.stack)) return grow_stack(needed);
+    return true;
+}
+
 static bool call(ObjClosure *closure, int arg_count) {
     if (arg_count != closure->function->arity) {
         runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
         return false;
     }
     
-    if (vm.frame_count == FRAMES_MAX) {
+    if (!reserve_frame(vm.stack_top - arg_count - 1, closure->function->max_slots)) {
         runtime_error("Stack overflow.");
         return false;
     }
     
+    ObjFunction *function = closure->function;
+#ifdef JIT
+    // The count stops at the threshold, so a function the JIT couldn't
+    // compile isn't tried again.
+    if (vm.use_jit && function->native_code == NULL && function->hotness < JIT_THRESHOLD &&
+        ++function->hotness == JIT_THRESHOLD) {
+        jit_compile(function);
+    }
+#endif
+    
     CallFrame *frame = &vm.frames[vm.frame_count++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
     frame->slots = vm.stack_top - arg_count - 1;
+    frame->engine = ENGINE_STACK;
+    
+    // Machine code nests on the C stack, so once that runs low the callee
+    // runs in the interpreter, which only needs the frame array.
+    char here;
+    if (function->native_code != NULL && (uintptr_t) &here >= vm.c_stack_limit) {
+        frame->engine = ENGINE_NATIVE;
+        return true;
+    }
+    
+    if (vm.use_registers && function->register_code.count > 0) {
+        frame->engine = ENGINE_REGISTERS;
+        frame->ip = function->register_code.code;
+        vm.stack_top = frame->slots + function->register_count;
+    }
+    return true;
+}
+
+static ObjUpvalue* capture_upvalue(Value *local) {
+    ObjUpvalue *prev_upvalue = NULL;
+    ObjUpvalue *upvalue = vm.open_upvalues;
+    while (upvalue != NULL && upvalue->location > local) {
+        prev_upvalue = upvalue;
+        upvalue = upvalue->next;
+    }
+    
+    if (upvalue != NULL && upvalue->location == local) {
+        return upvalue;
+    }
+    
+    ObjUpvalue *created_upvalue = new_upvalue(local);
+    created_upvalue->next = upvalue;
+    
+    if (prev_upvalue == NULL) {
+        vm.open_upvalues = created_upvalue;
+    } else {
+        prev_upvalue->next = created_upvalue;
+    }
+    
+    return created_upvalue;
+}
+
+// Closures over a function without upvalues are all alike, so the
+// function hands out one. Otherwise locals captured by value, and the
+// upvalues the enclosing closure holds by value, are copied into cells of
+// the new closure, which dest keeps reachable while the rest are captured.
+static void make_closure(CallFrame *frame, ObjFunction *function, uint8_t *upvalues, bool wide, Value *dest) {
+    if (function->upvalue_count == 0) {
+        if (function->closure == NULL) function->closure = new_closure(function, 0);
+        *dest = OBJ_VAL(function->closure);
+        return;
+    }
+    
+    int stride = wide ? 3 : 2;
+    ObjClosure *enclosing = frame->closure;
+    int cell_count = 0;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        uint8_t *capture = &upvalues[stride * i];
+        int index = wide ? (capture[1] << 8) | capture[2] : capture[1];
+        if (capture[0] == CAPTURE_VALUE ||
+            (capture[0] == CAPTURE_UPVALUE && is_cell(enclosing, enclosing->upvalues[index]))) {
+            cell_count++;
+        }
+    }
+    
+    ObjClosure *closure = new_closure(function, cell_count);
+    *dest = OBJ_VAL(closure);
+    ObjUpvalue *cell = closure->cells;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        uint8_t *capture = &upvalues[stride * i];
+        int index = wide ? (capture[1] << 8) | capture[2] : capture[1];
+        switch (capture[0]) {
+            case CAPTURE_VALUE:
+                cell->closed = frame->slots[index];
+                closure->upvalues[i] = cell++;
+                break;
+            case CAPTURE_LOCAL:
+                closure->upvalues[i] = capture_upvalue(frame->slots + index);
+                break;
+            default: {
+                ObjUpvalue *upvalue = enclosing->upvalues[index];
+                if (is_cell(enclosing, upvalue)) {
+                    cell->closed = upvalue->closed;
+                    upvalue = cell++;
+                }
+                closure->upvalues[i] = upvalue;
+                break;
+            }
+        }
+    }
+}
+
+static void close_upvalues(Value *last) {
+    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
+        ObjUpvalue *upvalue = vm.open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm.open_upvalues = upvalue->next;
+    }
+}
+
+// Calls in tail position retire the calling frame. A Lox function that
+// accepts the arguments takes over its slots; anything else is called as
+// usual and its result returned from the frame.
+static void drop_frame(int arg_count) {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    close_upvalues(frame->slots);
+    memmove(frame->slots, vm.stack_top - arg_count - 1, (arg_count + 1) * sizeof(Value));
+    vm.stack_top = frame->slots + arg_count + 1;
+    vm.frame_count--;
+}
+
+static bool call_closure(ObjClosure *closure, int arg_count, bool tail) {
+    if (tail && arg_count == closure->function->arity) drop_frame(arg_count);
+    return call(closure, arg_count);
+}
+
+// Natives run on the caller's frame, replacing the callee and its
+// arguments with the result.
+static bool call_native(ObjNative *native, int arg_count) {
+    if (native->arity != -1 && arg_count != native->arity) {
+        runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+        return false;
+    }
+    
+    Value *args = vm.stack_top - arg_count;
+    Value result;
+    if (native->number_function != NULL || native->binary_function != NULL) {
+        for (int i = 0; i < arg_count; i++) {
+            if (!IS_NUMBER(args[i])) {
+                runtime_error("Arguments must be numbers.");
+                return false;
+            }
+        }
+        result = native->number_function != NULL
+            ? NUMBER_VAL(native->number_function(AS_NUMBER(args[0])))
+            : NUMBER_VAL(native->binary_function(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    } else {
+        result = native->function(arg_count, args);
+    }
+    vm.stack_top = args - 1;
+    push(result);
+    return true;
+}
+
+// OP_INTRINSIC computes the result itself as long as the callee below
+// args is still the built-in native and the arguments are numbers, and
+// otherwise makes the call after all.
+static inline bool intrinsic_result(Intrinsic intrinsic, Value *args, Value *result) {
+    Value callee = args[-1];
+    if (!IS_OBJ(callee) || AS_OBJ(callee) != (Obj *) vm.intrinsics[intrinsic]) return false;
+    if (intrinsic == INTRINSIC_CLOCK) {
+        *result = clock_native(0, args);
+        return true;
+    }
+    
+    if (!IS_NUMBER(args[0])) return false;
+    double x = AS_NUMBER(args[0]);
+    switch (intrinsic) {
+        case INTRINSIC_SQRT:  *result = NUMBER_VAL(sqrt_number(x)); return true;
+        case INTRINSIC_FLOOR: *result = NUMBER_VAL(floor_number(x)); return true;
+        case INTRINSIC_CEIL:  *result = NUMBER_VAL(ceil_number(x)); return true;
+        case INTRINSIC_ABS:   *result = NUMBER_VAL(abs_number(x)); return true;
+        case INTRINSIC_SIN:   *result = NUMBER_VAL(sin_number(x)); return true;
+        case INTRINSIC_COS:   *result = NUMBER_VAL(cos_number(x)); return true;
+        case INTRINSIC_TAN:   *result = NUMBER_VAL(tan_number(x)); return true;
+        case INTRINSIC_ATAN:  *result = NUMBER_VAL(atan_number(x)); return true;
+        case INTRINSIC_EXP:   *result = NUMBER_VAL(exp_number(x)); return true;
+        case INTRINSIC_LOG:   *result = NUMBER_VAL(log_number(x)); return true;
+        default: break;
+    }
+    
+    if (!IS_NUMBER(args[1])) return false;
+    double y = AS_NUMBER(args[1]);
+    switch (intrinsic) {
+        case INTRINSIC_POW:   *result = NUMBER_VAL(pow_number(x, y)); return true;
+        case INTRINSIC_ATAN2: *result = NUMBER_VAL(atan2_number(x, y)); return true;
+        case INTRINSIC_MIN:   *result = NUMBER_VAL(min_number(x, y)); return true;
+        case INTRINSIC_MAX:   *result = NUMBER_VAL(max_number(x, y)); return true;
+        default: return false;
+    }
+}
+
+int find_intrinsic(ObjString *name, int arg_count) {
+    Value value = vm.globals.values[name->global];
+    for (int i = 0; i < INTRINSIC_COUNT; i++) {
+        if (IS_OBJ(value) && AS_OBJ(value) == (Obj *) vm.intrinsics[i]) {
+            return vm.intrinsics[i]->arity == arg_count ? i : -1;
+        }
+    }
+    return -1;
+}
+
+// Runs the class's initializer, if it has one, on the instance that
+// takes the callee's place.
+static bool construct(ObjClass *klass, ObjInstance *instance, int arg_count, bool tail) {
+    vm.stack_top[-arg_count - 1] = OBJ_VAL(instance);
+    ObjClosure *initializer = klass->initializer;
+    if (initializer != NULL) {
+        return call_closure(initializer, arg_count, tail);
+    } else if (arg_count != 0) {
+        runtime_error("Expected 0 arguments but got %d.", arg_count);
+        return false;
+    }
+    if (tail) runtime_return(&vm.frames[vm.frame_count - 1]);
     return true;
 }
 
-static bool call_value(Value callee, int arg_count) {
+static bool call_value(Value callee, int arg_count, bool tail) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
                 vm.stack_top[-arg_count - 1] = bound->receiver;
-                return call(bound->method, arg_count);
+                return call_closure(bound->method, arg_count, tail);
             }
             case OBJ_CLASS: {
                 ObjClass *klass = AS_CLASS(callee);
-                vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
-                Value initializer;
-                if (table_get(&klass->methods, vm.init_string, &initializer)) {
-                    return call(AS_CLOSURE(initializer), arg_count);
-                } else if (arg_count != 0) {
-                    runtime_error("Expected 0 arguments but got %d.", arg_count);
-                    return false;
-                }
-                return true;
+                return construct(klass, new_instance(klass), arg_count, tail);
             }
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), arg_count);
-            case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count + 1;
-                push(result);
+                return call_closure(AS_CLOSURE(callee), arg_count, tail);
+            case OBJ_NATIVE:
+                if (!call_native(AS_NATIVE(callee), arg_count)) return false;
+                if (tail) runtime_return(&vm.frames[vm.frame_count - 1]);
                 return true;
-            }
             default:
                 break;
         }
@@ -153,16 +541,138 @@ static bool call_value(Value callee, int arg_count) {
     return false;
 }
 
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count) {
-    Value method;
-    if (!table_get(&klass->methods, name, &method)) {
+// The call that initialises a local which keeps its value to itself. An
+// instance made for it, as long as the initializer doesn't let this go
+// either, is scoped, and the class's spare is used instead of a new one.
+static bool call_scoped(Value callee, int arg_count) {
+    if (!IS_CLASS(callee)) return call_value(callee, arg_count, false);
+    ObjClass *klass = AS_CLASS(callee);
+    if (klass->initializer != NULL && klass->initializer->function->leaks_this) {
+        return call_value(callee, arg_count, false);
+    }
+    
+    ObjInstance *instance = klass->spare;
+    if (instance != NULL) {
+        klass->spare = NULL;
+    } else {
+        instance = new_instance(klass);
+    }
+    instance->scoped = true;
+    return construct(klass, instance, arg_count, false);
+}
+
+// A scoped local's value is going out of scope. Its instance is empty
+// again when its class hands it out next.
+static void recycle(Value value) {
+    if (!IS_INSTANCE(value)) return;
+    ObjInstance *instance = AS_INSTANCE(value);
+    if (!instance->scoped || instance->dictionary != NULL || instance->klass->spare != NULL) return;
+    instance->scoped = false;
+    instance->shape = vm.empty_shape;
+    instance->klass->spare = instance;
+}
+
+static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count, bool tail) {
+    ObjClosure *method = find_method(klass, name);
+    if (method == NULL) {
         runtime_error("Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), arg_count);
+    return call_closure(method, arg_count, tail);
+}
+
+#ifdef DEBUG_PROFILE_CACHES
+#define CACHE_HIT(cache) ((cache)->hits++)
+#define CACHE_MISS(cache) ((cache)->misses++)
+#else
+#define CACHE_HIT(cache) do { } while (false)
+#define CACHE_MISS(cache) do { } while (false)
+#endif
+
+static inline bool entry_matches(CacheEntry *entry, ObjInstance *instance) {
+    return entry->shape == instance->shape &&
+        (entry->kind != CACHE_METHOD || entry->klass == instance->klass);
+}
+
+static MegamorphicEntry* megamorphic_slot(ObjInstance *instance, ObjString *name, bool set) {
+    uintptr_t hash = ((uintptr_t) instance->shape >> 4) ^ ((uintptr_t) instance->klass >> 3) ^ name->hash ^ set;
+    return &vm.megamorphic_cache[hash & (MEGAMORPHIC_CACHE_SIZE - 1)];
+}
+
+// Works out what name means on an instance the slow way: a field, a
+// method, or for a store, a new field. Dictionary instances, unknown
+// names and stores that would outgrow the shape aren't cached. Finding a
+// new field's shape can allocate.
+static bool resolve_property(ObjInstance *instance, ObjString *name, bool set, CacheEntry *entry) {
+    if (instance->dictionary != NULL) return false;
+    
+    memset(entry, 0, sizeof(CacheEntry));
+    entry->shape = instance->shape;
+    entry->slot = shape_slot(instance->shape, name);
+    if (entry->slot != -1) {
+        entry->kind = CACHE_FIELD;
+        return true;
+    }
+    
+    if (set) {
+        if (instance->shape->field_count == SHAPE_FIELDS_MAX) return false;
+        entry->kind = CACHE_ADD_FIELD;
+        entry->transition = shape_transition(instance->shape, name);
+        entry->slot = instance->shape->field_count;
+        return true;
+    }
+    
+    ObjClosure *method = find_method(instance->klass, name);
+    if (method == NULL) return false;
+    entry->kind = CACHE_METHOD;
+    entry->klass = instance->klass;
+    entry->method = method;
+    return true;
+}
+
+// Copies the entry for the instance into entry, filling the cache on a
+// miss. The copy outlives a collection, which empties the megamorphic
+// cache.
+static bool find_property(InlineCache *cache, ObjInstance *instance, ObjString *name, bool set, CacheEntry *entry) {
+    if (cache == NULL) return resolve_property(instance, name, set, entry);
+    
+    for (int i = 0; i < cache->count; i++) {
+        if (entry_matches(&cache->entries[i], instance)) {
+            CACHE_HIT(cache);
+            *entry = cache->entries[i];
+            return true;
+        }
+    }
+    
+    MegamorphicEntry *shared = NULL;
+    if (cache->megamorphic) {
+        shared = megamorphic_slot(instance, name, set);
+        if (shared->name == name && shared->klass == instance->klass && shared->set == set &&
+            shared->entry.shape == instance->shape) {
+            CACHE_HIT(cache);
+            *entry = shared->entry;
+            return true;
+        }
+    }
+    
+    CACHE_MISS(cache);
+    if (!resolve_property(instance, name, set, entry)) return false;
+    
+    if (!cache->megamorphic && cache->count < INLINE_CACHE_WAYS) {
+        cache->entries[cache->count++] = *entry;
+        return true;
+    }
+    
+    cache->megamorphic = true;
+    if (shared == NULL) shared = megamorphic_slot(instance, name, set);
+    shared->name = name;
+    shared->klass = instance->klass;
+    shared->set = set;
+    shared->entry = *entry;
+    return true;
 }
 
-static bool invoke(ObjString *name, int arg_count) {
+static bool invoke(ObjString *name, int arg_count, bool tail, InlineCache *cache) {
     Value receiver = peek(arg_count);
     
     if (!IS_INSTANCE(receiver)) {
@@ -172,65 +682,90 @@ static bool invoke(ObjString *name, int arg_count) {
     
     ObjInstance *instance = AS_INSTANCE(receiver);
     
+    CacheEntry entry;
+    if (find_property(cache, instance, name, false, &entry)) {
+        if (entry.kind == CACHE_METHOD) return call_closure(entry.method, arg_count, tail);
+        Value value = instance->fields[entry.slot];
+        vm.stack_top[-arg_count - 1] = value;
+        return call_value(value, arg_count, tail);
+    }
+    
     Value value;
-    if (table_get(&instance->fields, name, &value)) {
+    if (instance_get_field(instance, name, &value)) {
         vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+        return call_value(value, arg_count, tail);
     }
     
-    return invoke_from_class(instance->klass, name, arg_count);
+    return invoke_from_class(instance->klass, name, arg_count, tail);
 }
 
 static bool bind_method(ObjClass *klass, ObjString *name) {
-    Value method;
-    if (!table_get(&klass->methods, name, &method)) {
+    ObjClosure *method = find_method(klass, name);
+    if (method == NULL) {
         runtime_error("Undefined property '%s'.", name->chars);
         return false;
     }
     
-    ObjBoundMethod *bound = new_bound_method(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod *bound = new_bound_method(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue* capture_upvalue(Value *local) {
-    ObjUpvalue *prev_upvalue = NULL;
-    ObjUpvalue *upvalue = vm.open_upvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prev_upvalue = upvalue;
-        upvalue = upvalue->next;
+// Replaces the instance on top of the stack with its property.
+static bool get_property(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtime_error("Only instances have properties.");
+        return false;
     }
     
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    CacheEntry entry;
+    if (find_property(cache, instance, name, false, &entry)) {
+        if (entry.kind == CACHE_FIELD) {
+            vm.stack_top[-1] = instance->fields[entry.slot];
+        } else {
+            ObjBoundMethod *bound = new_bound_method(peek(0), entry.method);
+            vm.stack_top[-1] = OBJ_VAL(bound);
+        }
+        return true;
     }
     
-    ObjUpvalue *created_upvalue = new_upvalue(local);
-    created_upvalue->next = upvalue;
-    
-    if (prev_upvalue == NULL) {
-        vm.open_upvalues = created_upvalue;
-    } else {
-        prev_upvalue->next = created_upvalue;
+    Value value;
+    if (instance_get_field(instance, name, &value)) {
+        vm.stack_top[-1] = value;
+        return true;
     }
-    
-    return created_upvalue;
+    return bind_method(instance->klass, name);
 }
 
-static void close_upvalues(Value *last) {
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
+// Stores the value on top of the stack in the instance under it, leaving
+// just the value.
+static bool set_property(ObjString *name, InlineCache *cache) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtime_error("Only instances have fields.");
+        return false;
     }
+    
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    CacheEntry entry;
+    if (!find_property(cache, instance, name, true, &entry)) {
+        instance_set_field(instance, name, peek(0));
+    } else if (entry.kind == CACHE_ADD_FIELD) {
+        instance_add_field(instance, entry.transition, peek(0));
+    } else {
+        instance->fields[entry.slot] = peek(0);
+    }
+    
+    Value value = pop();
+    vm.stack_top[-1] = value;
+    return true;
 }
 
 static void define_method(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
-    table_set(&klass->methods, name, method);
+    class_add_method(klass, name, AS_CLOSURE(method));
     pop();
 }
 
@@ -254,317 +789,2016 @@ static void concatinate(void) {
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run(void) {
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+// List indices may be integers or doubles. Indices are compared as 64-bit
+// integers so that big ones can't truncate back into range.
+static inline int64_t list_index(Value index) {
+    return IS_INT(index) ? AS_INT(index) : (int64_t) AS_DOUBLE(index);
+}
+
+// Arithmetic and comparison on two numbers, at least one of them an
+// integer. Two integers give an integer unless the result leaves their
+// range; division and anything involving a double give a double.
+static inline Value arithmetic(OpCode op, Value a, Value b) {
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        switch (op) {
+            case OP_GREATER:  return BOOL_VAL(x > y);
+            case OP_LESS:     return BOOL_VAL(x < y);
+            case OP_ADD:      return integer_value(x + y);
+            case OP_SUBTRACT: return integer_value(x - y);
+            case OP_MULTIPLY: return integer_multiply(x, y);
+            case OP_MOD:      if (y != 0) return INT_VAL(x % y); break;
+            default:          break;
+        }
+    }
     
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op) \
-    do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
-        } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
-    } while (false)
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_GREATER:  return BOOL_VAL(x > y);
+        case OP_LESS:     return BOOL_VAL(x < y);
+        case OP_ADD:      return NUMBER_VAL(x + y);
+        case OP_SUBTRACT: return NUMBER_VAL(x - y);
+        case OP_MULTIPLY: return NUMBER_VAL(x * y);
+        case OP_DIVIDE:   return NUMBER_VAL(x / y);
+        case OP_MOD:      return NUMBER_VAL(fmod(x, y));
+        default:          return NIL_VAL;
+    }
+}
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[ ");
-      print_value(*slot);
-      printf(" ]");
+// Shifts x left by count bits, or right by -count bits, within 48 bits.
+// Shifting 48 bits or more leaves 0, or -1 for a negative x shifted right.
+static int64_t shift(int64_t x, int64_t count) {
+    if (count >= 48) return 0;
+    if (count <= -48) return x < 0 ? -1 : 0;
+    if (count >= 0) return (int64_t) ((uint64_t) x << (count + 16)) >> 16;
+    return x >> -count;
+}
+
+// Operands are integers, or doubles that hold one. Results wrap to 48
+// bits.
+static bool bitwise(OpCode op, Value a, Value b, Value *result) {
+    int64_t x;
+    int64_t y;
+    if (!as_integer(a, &x) || !as_integer(b, &y)) return false;
+    
+    switch (op) {
+        case OP_BIT_AND:     *result = INT_VAL(x & y); break;
+        case OP_BIT_OR:      *result = INT_VAL(x | y); break;
+        case OP_BIT_XOR:     *result = INT_VAL(x ^ y); break;
+        case OP_SHIFT_LEFT:  *result = INT_VAL(shift(x, y)); break;
+        case OP_SHIFT_RIGHT: *result = INT_VAL(shift(x, -y)); break;
+        default:             *result = NIL_VAL; break;
     }
-    printf("\n");
-    disassemble_instruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+    return true;
+}
+
+static Value negate(Value value) {
+    if (IS_INT(value)) return integer_value(-AS_INT(value));
+    return NUMBER_VAL(-AS_DOUBLE(value));
+}
+
+bool fold_operator(OpCode op, Value a, Value b, Value *result) {
+    switch (op) {
+        case OP_EQUAL:
+            *result = BOOL_VAL(values_equal(a, b));
+            return true;
+        case OP_NOT:
+            *result = BOOL_VAL(is_falsey(a));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(a)) return false;
+            *result = negate(a);
+            return true;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MOD:
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+            *result = arithmetic(op, a, b);
+            return true;
+        case OP_BIT_AND:
+        case OP_BIT_OR:
+        case OP_BIT_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+            return bitwise(op, a, b, result);
+        default:
+            return false;
+    }
+}
+
+static void set_list(void) {
+    Value value = peek(0);
+    int64_t index = list_index(peek(1));
+    ObjList *list = AS_LIST(peek(2));
+    
+    if (index < list->elements.count) {
+        list->elements.values[index] = value;
+    } else {
+        write_value_array(&list->elements, value);
+    }
+    
+    vm.stack_top -= 3;
+    push(OBJ_VAL(list));
+}
+
+// Steps a loop over a range, whose counter and bound are in loop[0] and
+// loop[1], putting the next number in the loop variable at loop[2]. The
+// bound is never reached, so an integer counter can't overflow.
+static inline ForStep for_range(Value *loop) {
+    Value counter = loop[0];
+    Value bound = loop[1];
+    if (IS_INT(counter) && IS_INT(bound)) {
+        if (AS_INT(counter) >= AS_INT(bound)) return FOR_DONE;
+        loop[0] = INT_VAL(AS_INT(counter) + 1);
+    } else if (IS_NUMBER(counter) && IS_NUMBER(bound)) {
+        if (!(AS_NUMBER(counter) < AS_NUMBER(bound))) return FOR_DONE;
+        loop[0] = IS_INT(counter) ? integer_value(AS_INT(counter) + 1) : NUMBER_VAL(AS_DOUBLE(counter) + 1);
+    } else {
+        return FOR_ERROR;
+    }
+    loop[2] = counter;
+    return FOR_NEXT;
+}
+
+// Steps a loop over the list in loop[0], with the index of the next
+// element in loop[1]. The list is measured every time, so it may change
+// length while the loop runs.
+static inline ForStep for_list(Value *loop) {
+    if (!IS_LIST(loop[0])) return FOR_ERROR;
+    ValueArray *elements = &AS_LIST(loop[0])->elements;
+    int64_t index = AS_INT(loop[1]);
+    if (index >= elements->count) return FOR_DONE;
+    loop[1] = INT_VAL(index + 1);
+    loop[2] = elements->values[index];
+    return FOR_NEXT;
+}
+
+// The registers above the call slot are dead once the callee returns, and
+// the collector clears dead slots, so they need no filling in again.
+static void restore_registers(CallFrame *frame) {
+    vm.stack_top = frame->slots + frame->closure->function->register_count;
+}
+
+static InterpretResult run_registers(int exit_frame);
+static InterpretResult run_frame(int exit_frame);
+
+// GCC's global CSE and cross-jumping merge the per-handler indirect jumps
+// back into a single shared branch, which undoes the threaded dispatch.
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
+static InterpretResult run(int exit_frame) {
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *slots;
+    Value *constants;
+    Value *stack_top;
+    
+    // The hot interpreter state lives in locals so the compiler can keep it
+    // in machine registers. It is written back to the frame and the VM only
+    // where something else looks at it: calls, allocations and errors.
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        ip = frame->ip; \
+        slots = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+        stack_top = vm.stack_top; \
+    } while (false)
+#define SAVE_FRAME() \
+    do { \
+        frame->ip = ip; \
+        vm.stack_top = stack_top; \
+    } while (false)
+#define SYNC_STACK() (vm.stack_top = stack_top)
+#define RELOAD_STACK() (stack_top = vm.stack_top)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_LONG() (ip += 3, read_long(ip - 3))
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+#define READ_CACHE() (ip += 2, &frame->closure->function->chunk.caches[read_cache_index(ip - 2)])
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+#define RUNTIME_ERROR(...) \
+    do { \
+        frame->ip = ip; \
+        runtime_error(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define BINARY_OP(opcode, value_type, op) \
+    do { \
+        Value b = PEEK(0); \
+        Value a = PEEK(1); \
+        if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+            stack_top--; \
+            stack_top[-1] = value_type(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            stack_top--; \
+            stack_top[-1] = arithmetic(opcode, a, b); \
+        } else { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+    } while (false)
+#define BITWISE_OP(opcode) \
+    do { \
+        Value result; \
+        if (!bitwise(opcode, PEEK(1), PEEK(0), &result)) { \
+            RUNTIME_ERROR("Operands must be integers."); \
+        } \
+        stack_top--; \
+        stack_top[-1] = result; \
+    } while (false)
+#ifdef QUICKENING
+#define QUICKEN(op) (ip[-1] = (op))
+#else
+#define QUICKEN(op) do { } while (false)
+#endif
+#define DEOPTIMIZE(op) (*--ip = (op))
+// The long forms are rare enough to share the JIT's runtime helpers.
+#define RUNTIME_OP(call) \
+    do { \
+        SAVE_FRAME(); \
+        if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+        RELOAD_STACK(); \
+    } while (false)
+#define ADD_OP() \
+    do { \
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) { \
+            SYNC_STACK(); \
+            concatinate(); \
+            RELOAD_STACK(); \
+        } else if (IS_DOUBLE(PEEK(0)) && IS_DOUBLE(PEEK(1))) { \
+            double b = AS_DOUBLE(POP()); \
+            double a = AS_DOUBLE(POP()); \
+            PUSH(NUMBER_VAL(a + b)); \
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) { \
+            stack_top--; \
+            stack_top[-1] = arithmetic(OP_ADD, stack_top[-1], stack_top[0]); \
+        } else { \
+            RUNTIME_ERROR("Operands must be two numbers of two strings."); \
+        } \
+    } while (false)
+#define CALL_FRAME(call) \
+    do { \
+        SAVE_FRAME(); \
+        if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+        if (vm.frames[vm.frame_count - 1].engine != ENGINE_STACK) { \
+            if (run_frame(vm.frame_count - 1) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR; \
+        } \
+        LOAD_FRAME(); \
+    } while (false)
+// Advances the for-in loop whose hidden locals start at slot, jumping
+// back to its body while there are more values.
+#define FOR_STEP(step_function, slot, message) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        ForStep step = step_function(&slots[slot]); \
+        if (step == FOR_NEXT) { \
+            ip -= offset; \
+        } else if (step == FOR_ERROR) { \
+            RUNTIME_ERROR(message); \
+        } \
+    } while (false)
+// A tail call ends this frame: either the callee now sits in its place,
+// or the call has finished and returned from it.
+#define TAIL_CALL(call) \
+    do { \
+        int frames = vm.frame_count; \
+        SAVE_FRAME(); \
+        if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+        if (vm.frame_count == frames && vm.frames[frames - 1].engine != ENGINE_STACK) { \
+            if (run_frame(frames - 1) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if (vm.frame_count == exit_frame) return INTERPRET_OK; \
+        LOAD_FRAME(); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (Value *slot = vm.stack; slot < stack_top; slot++) { \
+            printf("[ "); \
+            print_value(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassemble_instruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() \
+    do { \
+        vm.opcode_pairs[vm.previous_opcode][*ip]++; \
+        vm.previous_opcode = *ip; \
+    } while (false)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CONSTANT]                    = &&TARGET_OP_CONSTANT,
+        [OP_NIL]                         = &&TARGET_OP_NIL,
+        [OP_TRUE]                        = &&TARGET_OP_TRUE,
+        [OP_FALSE]                       = &&TARGET_OP_FALSE,
+        [OP_POP]                         = &&TARGET_OP_POP,
+        [OP_GET_LOCAL]                   = &&TARGET_OP_GET_LOCAL,
+        [OP_SET_LOCAL]                   = &&TARGET_OP_SET_LOCAL,
+        [OP_GET_GLOBAL]                  = &&TARGET_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL]               = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]                  = &&TARGET_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE]                 = &&TARGET_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]                 = &&TARGET_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY]                = &&TARGET_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]                = &&TARGET_OP_SET_PROPERTY,
+        [OP_GET_SUPER]                   = &&TARGET_OP_GET_SUPER,
+        [OP_EQUAL]                       = &&TARGET_OP_EQUAL,
+        [OP_GREATER]                     = &&TARGET_OP_GREATER,
+        [OP_LESS]                        = &&TARGET_OP_LESS,
+        [OP_ADD]                         = &&TARGET_OP_ADD,
+        [OP_SUBTRACT]                    = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY]                    = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE]                      = &&TARGET_OP_DIVIDE,
+        [OP_NOT]                         = &&TARGET_OP_NOT,
+        [OP_NEGATE]                      = &&TARGET_OP_NEGATE,
+        [OP_PRINT]                       = &&TARGET_OP_PRINT,
+        [OP_JUMP]                        = &&TARGET_OP_JUMP,
+        [OP_JUMP_IF_FALSE]               = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                        = &&TARGET_OP_LOOP,
+        [OP_CALL]                        = &&TARGET_OP_CALL,
+        [OP_INVOKE]                      = &&TARGET_OP_INVOKE,
+        [OP_SUPER_INVOKE]                = &&TARGET_OP_SUPER_INVOKE,
+        [OP_CLOSURE]                     = &&TARGET_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE]               = &&TARGET_OP_CLOSE_UPVALUE,
+        [OP_RETURN]                      = &&TARGET_OP_RETURN,
+        [OP_CLASS]                       = &&TARGET_OP_CLASS,
+        [OP_INHERIT]                     = &&TARGET_OP_INHERIT,
+        [OP_METHOD]                      = &&TARGET_OP_METHOD,
+        [OP_NEW_LIST]                    = &&TARGET_OP_NEW_LIST,
+        [OP_GET_LIST]                    = &&TARGET_OP_GET_LIST,
+        [OP_SET_LIST]                    = &&TARGET_OP_SET_LIST,
+        [OP_MOD]                         = &&TARGET_OP_MOD,
+        [OP_GET_LOCAL_GET_LOCAL_ADD]     = &&TARGET_OP_GET_LOCAL_GET_LOCAL_ADD,
+        [OP_GET_LOCAL_CONSTANT_ADD]      = &&TARGET_OP_GET_LOCAL_CONSTANT_ADD,
+        [OP_GET_LOCAL_CONSTANT_SUBTRACT] = &&TARGET_OP_GET_LOCAL_CONSTANT_SUBTRACT,
+        [OP_LESS_JUMP_IF_FALSE]          = &&TARGET_OP_LESS_JUMP_IF_FALSE,
+        [OP_SET_LOCAL_POP]               = &&TARGET_OP_SET_LOCAL_POP,
+        [OP_ADD_NUM]                     = &&TARGET_OP_ADD_NUM,
+        [OP_LESS_NUM]                    = &&TARGET_OP_LESS_NUM,
+        [OP_GREATER_NUM]                 = &&TARGET_OP_GREATER_NUM,
+        [OP_GET_LIST_NUMIDX]             = &&TARGET_OP_GET_LIST_NUMIDX,
+        [OP_SET_LIST_NUMIDX]             = &&TARGET_OP_SET_LIST_NUMIDX,
+        [OP_TAIL_CALL]                   = &&TARGET_OP_TAIL_CALL,
+        [OP_TAIL_INVOKE]                 = &&TARGET_OP_TAIL_INVOKE,
+        [OP_TAIL_SUPER_INVOKE]           = &&TARGET_OP_TAIL_SUPER_INVOKE,
+        [OP_CONSTANT_LONG]               = &&TARGET_OP_CONSTANT_LONG,
+        [OP_GET_LOCAL_LONG]              = &&TARGET_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG]              = &&TARGET_OP_SET_LOCAL_LONG,
+        [OP_GET_GLOBAL_LONG]             = &&TARGET_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG]          = &&TARGET_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]             = &&TARGET_OP_SET_GLOBAL_LONG,
+        [OP_GET_PROPERTY_LONG]           = &&TARGET_OP_GET_PROPERTY_LONG,
+        [OP_SET_PROPERTY_LONG]           = &&TARGET_OP_SET_PROPERTY_LONG,
+        [OP_GET_SUPER_LONG]              = &&TARGET_OP_GET_SUPER_LONG,
+        [OP_JUMP_LONG]                   = &&TARGET_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE_LONG]          = &&TARGET_OP_JUMP_IF_FALSE_LONG,
+        [OP_LOOP_LONG]                   = &&TARGET_OP_LOOP_LONG,
+        [OP_CLOSURE_LONG]                = &&TARGET_OP_CLOSURE_LONG,
+        [OP_CLASS_LONG]                  = &&TARGET_OP_CLASS_LONG,
+        [OP_METHOD_LONG]                 = &&TARGET_OP_METHOD_LONG,
+        [OP_BIT_AND]                     = &&TARGET_OP_BIT_AND,
+        [OP_BIT_OR]                      = &&TARGET_OP_BIT_OR,
+        [OP_BIT_XOR]                     = &&TARGET_OP_BIT_XOR,
+        [OP_SHIFT_LEFT]                  = &&TARGET_OP_SHIFT_LEFT,
+        [OP_SHIFT_RIGHT]                 = &&TARGET_OP_SHIFT_RIGHT,
+        [OP_INTRINSIC]                   = &&TARGET_OP_INTRINSIC,
+        [OP_CALL_SCOPED]                 = &&TARGET_OP_CALL_SCOPED,
+        [OP_POP_SCOPED]                  = &&TARGET_OP_POP_SCOPED,
+        [OP_FOR_RANGE]                   = &&TARGET_OP_FOR_RANGE,
+        [OP_FOR_LIST]                    = &&TARGET_OP_FOR_LIST,
+        [OP_SWITCH]                      = &&TARGET_OP_SWITCH,
+        [OP_JUMP_IF_TRUE]                = &&TARGET_OP_JUMP_IF_TRUE,
+        [OP_FOR_RANGE_LONG]              = &&TARGET_OP_FOR_RANGE_LONG,
+        [OP_FOR_LIST_LONG]               = &&TARGET_OP_FOR_LIST_LONG,
+    };
+
+#define CASE(op) TARGET_##op: case op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+    LOAD_FRAME();
+    
+    for (;;) {
+        TRACE_INSTRUCTION();
+        PROFILE_INSTRUCTION();
+        switch (READ_BYTE()) {
+            CASE(OP_CONSTANT): {
+                Value constant = READ_CONSTANT();
+                PUSH(constant);
+                DISPATCH();
+            }
+            CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+            CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+            CASE(OP_POP): stack_top--; DISPATCH();
+            CASE(OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+                PUSH(slots[slot]);
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+                slots[slot] = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
+            CASE(OP_GET_GLOBAL): {
                 ObjString *name = READ_STRING();
-                Value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                Value value = vm.globals.values[name->global];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
                 }
-                push(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
+            CASE(OP_DEFINE_GLOBAL): {
                 ObjString *name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                pop();
-                break;
+                vm.globals.values[name->global] = PEEK(0);
+                stack_top--;
+                DISPATCH();
             }
-            case OP_SET_GLOBAL: {
+            CASE(OP_SET_GLOBAL): {
                 ObjString *name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                Value *global = &vm.globals.values[name->global];
+                if (IS_UNDEFINED(*global)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
                 }
-                break;
+                *global = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+                PUSH(*frame->closure->upvalues[slot]->location);
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                *frame->closure->upvalues[slot]->location = PEEK(0);
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtime_error("Only instances have properties.");
+            CASE(OP_GET_PROPERTY): {
+                ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
+                Value *field = cached_field(cache, PEEK(0));
+                if (field != NULL) {
+                    stack_top[-1] = *field;
+                    DISPATCH();
+                }
+                RUNTIME_OP(get_property(name, cache));
+                DISPATCH();
+            }
+            CASE(OP_SET_PROPERTY): {
+                ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
+                Value *field = cached_field(cache, PEEK(1));
+                if (field != NULL) {
+                    *field = PEEK(0);
+                    Value value = POP();
+                    stack_top[-1] = value;
+                    DISPATCH();
+                }
+                RUNTIME_OP(set_property(name, cache));
+                DISPATCH();
+            }
+            CASE(OP_GET_SUPER): {
+                ObjString *name = READ_STRING();
+                ObjClass *superclass = AS_CLASS(POP());
+                
+                SAVE_FRAME();
+                if (!bind_method(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_EQUAL): {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(values_equal(a, b)));
+                DISPATCH();
+            }
+            CASE(OP_GREATER):
+                BINARY_OP(OP_GREATER, BOOL_VAL, >);
+                QUICKEN(OP_GREATER_NUM);
+                DISPATCH();
+            CASE(OP_LESS):
+                BINARY_OP(OP_LESS, BOOL_VAL, <);
+                QUICKEN(OP_LESS_NUM);
+                DISPATCH();
+            CASE(OP_ADD):
+                if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(OP_ADD_NUM);
+                ADD_OP();
+                DISPATCH();
+            CASE(OP_SUBTRACT): BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -); DISPATCH();
+            CASE(OP_MULTIPLY): BINARY_OP(OP_MULTIPLY, NUMBER_VAL, *); DISPATCH();
+            CASE(OP_DIVIDE):   BINARY_OP(OP_DIVIDE, NUMBER_VAL, /); DISPATCH();
+            CASE(OP_NOT): stack_top[-1] = BOOL_VAL(is_falsey(PEEK(0))); DISPATCH();
+            CASE(OP_NEGATE):
+                if (!IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                stack_top[-1] = negate(PEEK(0));
+                DISPATCH();
+            CASE(OP_PRINT): {
+                print_value(POP());
+                printf("\n");
+                DISPATCH();
+            }
+            CASE(OP_JUMP): {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                if (is_falsey(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_TRUE): {
+                uint16_t offset = READ_SHORT();
+                if (!is_falsey(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_LOOP): {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(OP_CALL): {
+                int arg_count = READ_BYTE();
+                Value callee = PEEK(arg_count);
+                if (IS_CLOSURE(callee)) {
+                    CALL_FRAME(call(AS_CLOSURE(callee), arg_count));
+                } else if (IS_NATIVE(callee)) {
+                    RUNTIME_OP(call_native(AS_NATIVE(callee), arg_count));
+                } else {
+                    CALL_FRAME(call_value(callee, arg_count, false));
+                }
+                DISPATCH();
+            }
+            CASE(OP_CALL_SCOPED): {
+                int arg_count = READ_BYTE();
+                CALL_FRAME(call_scoped(PEEK(arg_count), arg_count));
+                DISPATCH();
+            }
+            CASE(OP_POP_SCOPED): {
+                recycle(POP());
+                DISPATCH();
+            }
+            CASE(OP_FOR_RANGE): {
+                uint8_t slot = READ_BYTE();
+                FOR_STEP(for_range, slot, "Range bounds must be numbers.");
+                DISPATCH();
+            }
+            CASE(OP_FOR_LIST): {
+                uint8_t slot = READ_BYTE();
+                FOR_STEP(for_list, slot, "Can only iterate over lists.");
+                DISPATCH();
+            }
+            CASE(OP_FOR_RANGE_LONG): {
+                int slot = READ_LONG();
+                FOR_STEP(for_range, slot, "Range bounds must be numbers.");
+                DISPATCH();
+            }
+            CASE(OP_FOR_LIST_LONG): {
+                int slot = READ_LONG();
+                FOR_STEP(for_list, slot, "Can only iterate over lists.");
+                DISPATCH();
+            }
+            CASE(OP_SWITCH): {
+                Chunk *chunk = &frame->closure->function->chunk;
+                SwitchTable *table = &chunk->switches[READ_SHORT()];
+                ip = chunk->code + table->targets[switch_arm(table, POP())];
+                DISPATCH();
+            }
+            CASE(OP_INTRINSIC): {
+                Intrinsic intrinsic = READ_BYTE();
+                int arg_count = READ_BYTE();
+                Value *args = stack_top - arg_count;
+                if (intrinsic_result(intrinsic, args, &args[-1])) {
+                    stack_top = args;
+                } else {
+                    CALL_FRAME(call_value(args[-1], arg_count, false));
+                }
+                DISPATCH();
+            }
+            CASE(OP_INVOKE): {
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                InlineCache *cache = READ_CACHE();
+                CALL_FRAME(invoke(method, arg_count, false, cache));
+                DISPATCH();
+            }
+            CASE(OP_SUPER_INVOKE): {
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                ObjClass *superclass = AS_CLASS(POP());
+                CALL_FRAME(invoke_from_class(superclass, method, arg_count, false));
+                DISPATCH();
+            }
+            CASE(OP_TAIL_CALL): {
+                int arg_count = READ_BYTE();
+                TAIL_CALL(call_value(PEEK(arg_count), arg_count, true));
+                DISPATCH();
+            }
+            CASE(OP_TAIL_INVOKE): {
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                InlineCache *cache = READ_CACHE();
+                TAIL_CALL(invoke(method, arg_count, true, cache));
+                DISPATCH();
+            }
+            CASE(OP_TAIL_SUPER_INVOKE): {
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                ObjClass *superclass = AS_CLASS(POP());
+                TAIL_CALL(invoke_from_class(superclass, method, arg_count, true));
+                DISPATCH();
+            }
+            CASE(OP_CLOSURE): {
+                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+                SYNC_STACK();
+                runtime_closure(frame, function, ip, false);
+                RELOAD_STACK();
+                ip += 2 * function->upvalue_count;
+                DISPATCH();
+            }
+            CASE(OP_CLOSE_UPVALUE):
+                close_upvalues(stack_top - 1);
+                stack_top--;
+                DISPATCH();
+            CASE(OP_RETURN): {
+                Value result = POP();
+                close_upvalues(slots);
+                vm.frame_count--;
+                if (vm.frame_count == 0) {
+                    vm.stack_top = slots;
+                    return INTERPRET_OK;
+                }
                 
-                ObjInstance *instance = AS_INSTANCE(peek(0));
+                slots[0] = result;
+                vm.stack_top = slots + 1;
+                if (vm.frame_count == exit_frame) return INTERPRET_OK;
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            CASE(OP_CLASS): {
                 ObjString *name = READ_STRING();
+                SYNC_STACK();
+                PUSH(OBJ_VAL(new_class(name)));
+                DISPATCH();
+            }
+            CASE(OP_INHERIT): {
+                Value superclass = PEEK(1);
+                if (!IS_CLASS((superclass))) {
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
                 
-                Value value;
-                if (table_get(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
+                class_inherit(AS_CLASS(PEEK(0)), AS_CLASS(superclass));
+                stack_top--;
+                DISPATCH();
+            }
+            CASE(OP_METHOD): {
+                ObjString *name = READ_STRING();
+                SYNC_STACK();
+                define_method(name);
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_NEW_LIST):
+                SYNC_STACK();
+                PUSH(OBJ_VAL(new_list()));
+                DISPATCH();
+            CASE(OP_GET_LIST): {
+                if (!IS_LIST(PEEK(1))) {
+                    RUNTIME_ERROR("Can only index lists.");
+                }
+                if (!IS_NUMBER(PEEK(0))) {
+                    RUNTIME_ERROR("List index must be a number.");
                 }
                 
-                if (!bind_method(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                int64_t index = list_index(PEEK(0));
+                ObjList *list = AS_LIST(PEEK(1));
+                if (index < 0 || index >= list->elements.count) {
+                    RUNTIME_ERROR("List index out of range.");
                 }
-                break;
+                
+                stack_top--;
+                stack_top[-1] = list->elements.values[index];
+                QUICKEN(OP_GET_LIST_NUMIDX);
+                DISPATCH();
+            }
+            CASE(OP_SET_LIST): {
+                if (!IS_LIST(PEEK(2))) {
+                    RUNTIME_ERROR("Can only index lists.");
+                }
+                if (!IS_NUMBER(PEEK(1)) || AS_NUMBER(PEEK(1)) < 0) {
+                    RUNTIME_ERROR("List index must be a non-negative number.");
+                }
+                
+                // Appends stay on the generic path so that a loop filling a list
+                // doesn't bounce between the two forms.
+                if (list_index(PEEK(1)) < AS_LIST(PEEK(2))->elements.count) {
+                    QUICKEN(OP_SET_LIST_NUMIDX);
+                }
+                SYNC_STACK();
+                set_list();
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_MOD): {
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                stack_top--;
+                stack_top[-1] = arithmetic(OP_MOD, stack_top[-1], stack_top[0]);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL_GET_LOCAL_ADD): {
+                Value a = slots[READ_BYTE()];
+                Value b = slots[READ_BYTE()];
+                if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+                    PUSH(NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)));
+                    DISPATCH();
+                }
+                if (IS_INT(a) && IS_INT(b)) {
+                    PUSH(integer_value(AS_INT(a) + AS_INT(b)));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                ADD_OP();
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL_CONSTANT_ADD): {
+                Value a = slots[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+                    PUSH(NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)));
+                    DISPATCH();
+                }
+                if (IS_INT(a) && IS_INT(b)) {
+                    PUSH(integer_value(AS_INT(a) + AS_INT(b)));
+                    DISPATCH();
+                }
+                PUSH(a);
+                PUSH(b);
+                ADD_OP();
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL_CONSTANT_SUBTRACT): {
+                Value a = slots[READ_BYTE()];
+                Value b = READ_CONSTANT();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                PUSH(IS_DOUBLE(a) && IS_DOUBLE(b) ? NUMBER_VAL(AS_DOUBLE(a) - AS_DOUBLE(b))
+                                                  : arithmetic(OP_SUBTRACT, a, b));
+                DISPATCH();
+            }
+            CASE(OP_LESS_JUMP_IF_FALSE): {
+                uint16_t offset = READ_SHORT();
+                BINARY_OP(OP_LESS, BOOL_VAL, <);
+                if (!AS_BOOL(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL_POP): {
+                uint8_t slot = READ_BYTE();
+                slots[slot] = POP();
+                DISPATCH();
+            }
+            CASE(OP_ADD_NUM): {
+                Value b = PEEK(0);
+                Value a = PEEK(1);
+                if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+                    stack_top--;
+                    stack_top[-1] = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+                    DISPATCH();
+                }
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    DEOPTIMIZE(OP_ADD);
+                    DISPATCH();
+                }
+                stack_top--;
+                stack_top[-1] = arithmetic(OP_ADD, a, b);
+                DISPATCH();
+            }
+            CASE(OP_LESS_NUM): {
+                Value b = PEEK(0);
+                Value a = PEEK(1);
+                if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+                    stack_top--;
+                    stack_top[-1] = BOOL_VAL(AS_DOUBLE(a) < AS_DOUBLE(b));
+                    DISPATCH();
+                }
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    DEOPTIMIZE(OP_LESS);
+                    DISPATCH();
+                }
+                stack_top--;
+                stack_top[-1] = arithmetic(OP_LESS, a, b);
+                DISPATCH();
+            }
+            CASE(OP_GREATER_NUM): {
+                Value b = PEEK(0);
+                Value a = PEEK(1);
+                if (IS_DOUBLE(a) && IS_DOUBLE(b)) {
+                    stack_top--;
+                    stack_top[-1] = BOOL_VAL(AS_DOUBLE(a) > AS_DOUBLE(b));
+                    DISPATCH();
+                }
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    DEOPTIMIZE(OP_GREATER);
+                    DISPATCH();
+                }
+                stack_top--;
+                stack_top[-1] = arithmetic(OP_GREATER, a, b);
+                DISPATCH();
+            }
+            CASE(OP_GET_LIST_NUMIDX): {
+                Value index = PEEK(0);
+                Value list = PEEK(1);
+                if (!IS_LIST(list) || !IS_NUMBER(index)) {
+                    DEOPTIMIZE(OP_GET_LIST);
+                    DISPATCH();
+                }
+                ValueArray *elements = &AS_LIST(list)->elements;
+                int64_t i = list_index(index);
+                if (i < 0 || i >= elements->count) {
+                    DEOPTIMIZE(OP_GET_LIST);
+                    DISPATCH();
+                }
+                stack_top--;
+                stack_top[-1] = elements->values[i];
+                DISPATCH();
+            }
+            CASE(OP_SET_LIST_NUMIDX): {
+                Value index = PEEK(1);
+                Value list = PEEK(2);
+                if (!IS_LIST(list) || !IS_NUMBER(index)) {
+                    DEOPTIMIZE(OP_SET_LIST);
+                    DISPATCH();
+                }
+                ValueArray *elements = &AS_LIST(list)->elements;
+                int64_t i = list_index(index);
+                if (i < 0 || i >= elements->count) {
+                    DEOPTIMIZE(OP_SET_LIST);
+                    DISPATCH();
+                }
+                elements->values[i] = PEEK(0);
+                stack_top -= 2;
+                stack_top[-1] = list;
+                DISPATCH();
+            }
+            CASE(OP_CONSTANT_LONG): {
+                Value constant = READ_CONSTANT_LONG();
+                PUSH(constant);
+                DISPATCH();
+            }
+            CASE(OP_GET_LOCAL_LONG): {
+                int slot = READ_LONG();
+                PUSH(slots[slot]);
+                DISPATCH();
+            }
+            CASE(OP_SET_LOCAL_LONG): {
+                int slot = READ_LONG();
+                slots[slot] = PEEK(0);
+                DISPATCH();
+            }
+            CASE(OP_GET_GLOBAL_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                RUNTIME_OP(runtime_get_global(name));
+                DISPATCH();
+            }
+            CASE(OP_DEFINE_GLOBAL_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                SYNC_STACK();
+                runtime_define_global(name);
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_SET_GLOBAL_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                RUNTIME_OP(runtime_set_global(name));
+                DISPATCH();
+            }
+            CASE(OP_GET_PROPERTY_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                InlineCache *cache = READ_CACHE();
+                RUNTIME_OP(get_property(name, cache));
+                DISPATCH();
+            }
+            CASE(OP_SET_PROPERTY_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                InlineCache *cache = READ_CACHE();
+                RUNTIME_OP(set_property(name, cache));
+                DISPATCH();
+            }
+            CASE(OP_GET_SUPER_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                RUNTIME_OP(runtime_get_super(name));
+                DISPATCH();
+            }
+            CASE(OP_JUMP_LONG): {
+                int offset = READ_LONG();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_JUMP_IF_FALSE_LONG): {
+                int offset = READ_LONG();
+                if (is_falsey(PEEK(0))) ip += offset;
+                DISPATCH();
+            }
+            CASE(OP_LOOP_LONG): {
+                int offset = READ_LONG();
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(OP_CLOSURE_LONG): {
+                ObjFunction *function = AS_FUNCTION(READ_CONSTANT_LONG());
+                SYNC_STACK();
+                runtime_closure(frame, function, ip, true);
+                RELOAD_STACK();
+                ip += 3 * function->upvalue_count;
+                DISPATCH();
+            }
+            CASE(OP_CLASS_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                SYNC_STACK();
+                runtime_class(name);
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_METHOD_LONG): {
+                ObjString *name = READ_STRING_LONG();
+                SYNC_STACK();
+                runtime_method(name);
+                RELOAD_STACK();
+                DISPATCH();
+            }
+            CASE(OP_BIT_AND):     BITWISE_OP(OP_BIT_AND); DISPATCH();
+            CASE(OP_BIT_OR):      BITWISE_OP(OP_BIT_OR); DISPATCH();
+            CASE(OP_BIT_XOR):     BITWISE_OP(OP_BIT_XOR); DISPATCH();
+            CASE(OP_SHIFT_LEFT):  BITWISE_OP(OP_SHIFT_LEFT); DISPATCH();
+            CASE(OP_SHIFT_RIGHT): BITWISE_OP(OP_SHIFT_RIGHT); DISPATCH();
+        }
+    }
+
+#undef LOAD_FRAME
+#undef SAVE_FRAME
+#undef SYNC_STACK
+#undef RELOAD_STACK
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef BITWISE_OP
+#undef ADD_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef RUNTIME_OP
+#undef CALL_FRAME
+#undef FOR_STEP
+#undef TAIL_CALL
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+}
+
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+static InterpretResult run_registers(int exit_frame) {
+    // Like run(), the hot state lives in locals. The ip goes back into the
+    // frame before anything that can report an error or make a call, and
+    // the registers are looked up again after a call, which may have moved
+    // the stack.
+    CallFrame *frame;
+    uint8_t *ip;
+    Value *regs;
+    Value *constants;
+    
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        ip = frame->ip; \
+        regs = frame->slots; \
+        constants = frame->closure->function->chunk.constants.values; \
+    } while (false)
+#define SAVE_IP() (frame->ip = ip)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (ip += 2, &frame->closure->function->chunk.caches[read_cache_index(ip - 2)])
+#define R(index) (regs[index])
+#define RUNTIME_ERROR(...) \
+    do { \
+        SAVE_IP(); \
+        runtime_error(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define BINARY_OP(opcode, value_type, op, read_right) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = R(READ_BYTE()); \
+        Value b = read_right; \
+        if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+            R(dest) = value_type(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            R(dest) = arithmetic(opcode, a, b); \
+        } else { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+    } while (false)
+#define BITWISE_OP(opcode) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = R(READ_BYTE()); \
+        Value b = R(READ_BYTE()); \
+        if (!bitwise(opcode, a, b, &R(dest))) { \
+            RUNTIME_ERROR("Operands must be integers."); \
+        } \
+    } while (false)
+#define ADD_OP(read_right) \
+    do { \
+        uint8_t dest = READ_BYTE(); \
+        Value a = R(READ_BYTE()); \
+        Value b = read_right; \
+        if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+            R(dest) = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b)); \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            R(dest) = arithmetic(OP_ADD, a, b); \
+        } else if (IS_STRING(a) && IS_STRING(b)) { \
+            push(a); \
+            push(b); \
+            concatinate(); \
+            R(dest) = pop(); \
+        } else { \
+            RUNTIME_ERROR("Operands must be two numbers of two strings."); \
+        } \
+    } while (false)
+// The comparison's result stays in its register for whoever reads it
+// after the jump.
+#define LESS_JUMP_IF_FALSE(read_right) \
+    do { \
+        uint8_t dest = ip[0]; \
+        BINARY_OP(OP_LESS, BOOL_VAL, <, read_right); \
+        uint16_t offset = READ_SHORT(); \
+        if (!AS_BOOL(R(dest))) ip += offset; \
+    } while (false)
+#define CALL_FRAME(call) \
+    do { \
+        int caller_frames = vm.frame_count; \
+        SAVE_IP(); \
+        if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+        if (vm.frame_count > caller_frames && vm.frames[vm.frame_count - 1].engine != ENGINE_REGISTERS) { \
+            if (run_frame(caller_frames) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR; \
+        } \
+        LOAD_FRAME(); \
+        if (vm.frame_count == caller_frames) restore_registers(frame); \
+    } while (false)
+#define TAIL_CALL(call) \
+    do { \
+        int frames = vm.frame_count; \
+        SAVE_IP(); \
+        if (!(call)) return INTERPRET_RUNTIME_ERROR; \
+        if (vm.frame_count == frames && vm.frames[frames - 1].engine != ENGINE_REGISTERS) { \
+            if (run_frame(frames - 1) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if (vm.frame_count == exit_frame) return INTERPRET_OK; \
+        LOAD_FRAME(); \
+        restore_registers(frame); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+        printf("          "); \
+        for (Value *slot = regs; slot < vm.stack_top; slot++) { \
+            printf("[ "); \
+            print_value(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassemble_register_instruction(frame->closure->function, (int)(ip - frame->closure->function->register_code.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [REG_MOVE]                = &&TARGET_REG_MOVE,
+        [REG_LOADK]               = &&TARGET_REG_LOADK,
+        [REG_LOADNIL]             = &&TARGET_REG_LOADNIL,
+        [REG_LOADTRUE]            = &&TARGET_REG_LOADTRUE,
+        [REG_LOADFALSE]           = &&TARGET_REG_LOADFALSE,
+        [REG_GET_GLOBAL]          = &&TARGET_REG_GET_GLOBAL,
+        [REG_DEFINE_GLOBAL]       = &&TARGET_REG_DEFINE_GLOBAL,
+        [REG_SET_GLOBAL]          = &&TARGET_REG_SET_GLOBAL,
+        [REG_GET_UPVALUE]         = &&TARGET_REG_GET_UPVALUE,
+        [REG_SET_UPVALUE]         = &&TARGET_REG_SET_UPVALUE,
+        [REG_GET_PROPERTY]        = &&TARGET_REG_GET_PROPERTY,
+        [REG_SET_PROPERTY]        = &&TARGET_REG_SET_PROPERTY,
+        [REG_GET_SUPER]           = &&TARGET_REG_GET_SUPER,
+        [REG_EQUAL]               = &&TARGET_REG_EQUAL,
+        [REG_GREATER]             = &&TARGET_REG_GREATER,
+        [REG_LESS]                = &&TARGET_REG_LESS,
+        [REG_ADD]                 = &&TARGET_REG_ADD,
+        [REG_SUBTRACT]            = &&TARGET_REG_SUBTRACT,
+        [REG_MULTIPLY]            = &&TARGET_REG_MULTIPLY,
+        [REG_DIVIDE]              = &&TARGET_REG_DIVIDE,
+        [REG_MOD]                 = &&TARGET_REG_MOD,
+        [REG_GREATERK]            = &&TARGET_REG_GREATERK,
+        [REG_LESSK]               = &&TARGET_REG_LESSK,
+        [REG_ADDK]                = &&TARGET_REG_ADDK,
+        [REG_SUBTRACTK]           = &&TARGET_REG_SUBTRACTK,
+        [REG_NOT]                 = &&TARGET_REG_NOT,
+        [REG_NEGATE]              = &&TARGET_REG_NEGATE,
+        [REG_PRINT]               = &&TARGET_REG_PRINT,
+        [REG_JUMP]                = &&TARGET_REG_JUMP,
+        [REG_JUMP_IF_FALSE]       = &&TARGET_REG_JUMP_IF_FALSE,
+        [REG_LOOP]                = &&TARGET_REG_LOOP,
+        [REG_CALL]                = &&TARGET_REG_CALL,
+        [REG_INVOKE]              = &&TARGET_REG_INVOKE,
+        [REG_SUPER_INVOKE]        = &&TARGET_REG_SUPER_INVOKE,
+        [REG_CLOSURE]             = &&TARGET_REG_CLOSURE,
+        [REG_CLOSE_UPVALUE]       = &&TARGET_REG_CLOSE_UPVALUE,
+        [REG_RETURN]              = &&TARGET_REG_RETURN,
+        [REG_CLASS]               = &&TARGET_REG_CLASS,
+        [REG_INHERIT]             = &&TARGET_REG_INHERIT,
+        [REG_METHOD]              = &&TARGET_REG_METHOD,
+        [REG_NEW_LIST]            = &&TARGET_REG_NEW_LIST,
+        [REG_GET_LIST]            = &&TARGET_REG_GET_LIST,
+        [REG_SET_LIST]            = &&TARGET_REG_SET_LIST,
+        [REG_TAIL_CALL]           = &&TARGET_REG_TAIL_CALL,
+        [REG_TAIL_INVOKE]         = &&TARGET_REG_TAIL_INVOKE,
+        [REG_TAIL_SUPER_INVOKE]   = &&TARGET_REG_TAIL_SUPER_INVOKE,
+        [REG_BIT_AND]             = &&TARGET_REG_BIT_AND,
+        [REG_BIT_OR]              = &&TARGET_REG_BIT_OR,
+        [REG_BIT_XOR]             = &&TARGET_REG_BIT_XOR,
+        [REG_SHIFT_LEFT]          = &&TARGET_REG_SHIFT_LEFT,
+        [REG_SHIFT_RIGHT]         = &&TARGET_REG_SHIFT_RIGHT,
+        [REG_INTRINSIC]           = &&TARGET_REG_INTRINSIC,
+        [REG_CALL_SCOPED]         = &&TARGET_REG_CALL_SCOPED,
+        [REG_POP_SCOPED]          = &&TARGET_REG_POP_SCOPED,
+        [REG_FOR_RANGE]           = &&TARGET_REG_FOR_RANGE,
+        [REG_FOR_LIST]            = &&TARGET_REG_FOR_LIST,
+        [REG_SWITCH]              = &&TARGET_REG_SWITCH,
+        [REG_JUMP_IF_TRUE]        = &&TARGET_REG_JUMP_IF_TRUE,
+        [REG_LESS_JUMP_IF_FALSE]  = &&TARGET_REG_LESS_JUMP_IF_FALSE,
+        [REG_LESSK_JUMP_IF_FALSE] = &&TARGET_REG_LESSK_JUMP_IF_FALSE,
+    };
+
+#define CASE(op) TARGET_##op: case op
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        goto *dispatch_table[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+    for (;;) {
+        TRACE_INSTRUCTION();
+        switch (READ_BYTE()) {
+            CASE(REG_MOVE): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = R(READ_BYTE());
+                DISPATCH();
+            }
+            CASE(REG_LOADK): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = READ_CONSTANT();
+                DISPATCH();
+            }
+            CASE(REG_LOADNIL): R(READ_BYTE()) = NIL_VAL; DISPATCH();
+            CASE(REG_LOADTRUE): R(READ_BYTE()) = BOOL_VAL(true); DISPATCH();
+            CASE(REG_LOADFALSE): R(READ_BYTE()) = BOOL_VAL(false); DISPATCH();
+            CASE(REG_GET_GLOBAL): {
+                uint8_t dest = READ_BYTE();
+                ObjString *name = READ_STRING();
+                Value value = vm.globals.values[name->global];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                R(dest) = value;
+                DISPATCH();
+            }
+            CASE(REG_DEFINE_GLOBAL): {
+                Value value = R(READ_BYTE());
+                vm.globals.values[READ_STRING()->global] = value;
+                DISPATCH();
+            }
+            CASE(REG_SET_GLOBAL): {
+                Value value = R(READ_BYTE());
+                ObjString *name = READ_STRING();
+                Value *global = &vm.globals.values[name->global];
+                if (IS_UNDEFINED(*global)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+                }
+                *global = value;
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtime_error("Only instances have fields.");
+            CASE(REG_GET_UPVALUE): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = *frame->closure->upvalues[READ_BYTE()]->location;
+                DISPATCH();
+            }
+            CASE(REG_SET_UPVALUE): {
+                Value value = R(READ_BYTE());
+                *frame->closure->upvalues[READ_BYTE()]->location = value;
+                DISPATCH();
+            }
+            CASE(REG_GET_PROPERTY): {
+                uint8_t dest = READ_BYTE();
+                Value object = R(READ_BYTE());
+                ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
+                Value *field = cached_field(cache, object);
+                if (field != NULL) {
+                    R(dest) = *field;
+                    DISPATCH();
+                }
+                
+                push(object);
+                SAVE_IP();
+                if (!get_property(name, cache)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                R(dest) = pop();
+                DISPATCH();
+            }
+            CASE(REG_SET_PROPERTY): {
+                uint8_t dest = READ_BYTE();
+                Value object = R(READ_BYTE());
+                Value value = R(READ_BYTE());
+                ObjString *name = READ_STRING();
+                InlineCache *cache = READ_CACHE();
+                Value *field = cached_field(cache, object);
+                if (field != NULL) {
+                    *field = value;
+                    R(dest) = value;
+                    DISPATCH();
+                }
                 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                table_set(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
+                push(object);
                 push(value);
-                break;
+                SAVE_IP();
+                if (!set_property(name, cache)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                R(dest) = pop();
+                DISPATCH();
             }
-            case OP_GET_SUPER: {
+            CASE(REG_GET_SUPER): {
+                uint8_t dest = READ_BYTE();
+                Value receiver = R(READ_BYTE());
+                ObjClass *superclass = AS_CLASS(R(READ_BYTE()));
                 ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
                 
+                push(receiver);
+                SAVE_IP();
                 if (!bind_method(superclass, name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                R(dest) = pop();
+                DISPATCH();
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
+            CASE(REG_EQUAL): {
+                uint8_t dest = READ_BYTE();
+                Value a = R(READ_BYTE());
+                Value b = R(READ_BYTE());
+                R(dest) = BOOL_VAL(values_equal(a, b));
+                DISPATCH();
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD:      {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatinate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtime_error("Operands must be two numbers of two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(REG_GREATER):   BINARY_OP(OP_GREATER, BOOL_VAL, >, R(READ_BYTE())); DISPATCH();
+            CASE(REG_LESS):      BINARY_OP(OP_LESS, BOOL_VAL, <, R(READ_BYTE())); DISPATCH();
+            CASE(REG_ADD):       ADD_OP(R(READ_BYTE())); DISPATCH();
+            CASE(REG_SUBTRACT):  BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -, R(READ_BYTE())); DISPATCH();
+            CASE(REG_MULTIPLY):  BINARY_OP(OP_MULTIPLY, NUMBER_VAL, *, R(READ_BYTE())); DISPATCH();
+            CASE(REG_DIVIDE):    BINARY_OP(OP_DIVIDE, NUMBER_VAL, /, R(READ_BYTE())); DISPATCH();
+            CASE(REG_MOD): {
+                uint8_t dest = READ_BYTE();
+                Value a = R(READ_BYTE());
+                Value b = R(READ_BYTE());
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
                 }
-                break;
+                R(dest) = arithmetic(OP_MOD, a, b);
+                DISPATCH();
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(is_falsey(pop()))); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(REG_GREATERK):  BINARY_OP(OP_GREATER, BOOL_VAL, >, READ_CONSTANT()); DISPATCH();
+            CASE(REG_LESSK):     BINARY_OP(OP_LESS, BOOL_VAL, <, READ_CONSTANT()); DISPATCH();
+            CASE(REG_ADDK):      ADD_OP(READ_CONSTANT()); DISPATCH();
+            CASE(REG_SUBTRACTK): BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -, READ_CONSTANT()); DISPATCH();
+            CASE(REG_BIT_AND):     BITWISE_OP(OP_BIT_AND); DISPATCH();
+            CASE(REG_BIT_OR):      BITWISE_OP(OP_BIT_OR); DISPATCH();
+            CASE(REG_BIT_XOR):     BITWISE_OP(OP_BIT_XOR); DISPATCH();
+            CASE(REG_SHIFT_LEFT):  BITWISE_OP(OP_SHIFT_LEFT); DISPATCH();
+            CASE(REG_SHIFT_RIGHT): BITWISE_OP(OP_SHIFT_RIGHT); DISPATCH();
+            CASE(REG_NOT): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = BOOL_VAL(is_falsey(R(READ_BYTE())));
+                DISPATCH();
+            }
+            CASE(REG_NEGATE): {
+                uint8_t dest = READ_BYTE();
+                Value value = R(READ_BYTE());
+                if (!IS_NUMBER(value)) {
+                    RUNTIME_ERROR("Operand must be a number.");
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                print_value(pop());
+                R(dest) = negate(value);
+                DISPATCH();
+            }
+            CASE(REG_PRINT): {
+                print_value(R(READ_BYTE()));
                 printf("\n");
-                break;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(REG_JUMP): {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+                ip += offset;
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(REG_JUMP_IF_FALSE): {
+                Value condition = R(READ_BYTE());
                 uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0))) frame->ip += offset;
-                break;
+                if (is_falsey(condition)) ip += offset;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(REG_JUMP_IF_TRUE): {
+                Value condition = R(READ_BYTE());
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+                if (!is_falsey(condition)) ip += offset;
+                DISPATCH();
+            }
+            CASE(REG_LESS_JUMP_IF_FALSE):  LESS_JUMP_IF_FALSE(R(READ_BYTE())); DISPATCH();
+            CASE(REG_LESSK_JUMP_IF_FALSE): LESS_JUMP_IF_FALSE(READ_CONSTANT()); DISPATCH();
+            CASE(REG_LOOP): {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(REG_CALL): {
+                uint8_t base = READ_BYTE();
                 int arg_count = READ_BYTE();
-                if (!call_value(peek(arg_count), arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                Value callee = R(base);
+                vm.stack_top = regs + base + arg_count + 1;
+                if (IS_CLOSURE(callee)) {
+                    CALL_FRAME(call(AS_CLOSURE(callee), arg_count));
+                } else {
+                    CALL_FRAME(call_value(callee, arg_count, false));
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                DISPATCH();
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
+            CASE(REG_CALL_SCOPED): {
+                uint8_t base = READ_BYTE();
                 int arg_count = READ_BYTE();
-                if (!invoke(method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                vm.stack_top = regs + base + arg_count + 1;
+                CALL_FRAME(call_scoped(R(base), arg_count));
+                DISPATCH();
+            }
+            CASE(REG_POP_SCOPED): {
+                recycle(R(READ_BYTE()));
+                DISPATCH();
+            }
+            CASE(REG_FOR_RANGE): {
+                uint8_t base = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                ForStep step = for_range(&R(base));
+                if (step == FOR_NEXT) {
+                    ip -= offset;
+                } else if (step == FOR_ERROR) {
+                    RUNTIME_ERROR("Range bounds must be numbers.");
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
+            CASE(REG_FOR_LIST): {
+                uint8_t base = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                ForStep step = for_list(&R(base));
+                if (step == FOR_NEXT) {
+                    ip -= offset;
+                } else if (step == FOR_ERROR) {
+                    RUNTIME_ERROR("Can only iterate over lists.");
+                }
+                DISPATCH();
+            }
+            CASE(REG_SWITCH): {
+                uint8_t value = READ_BYTE();
+                ObjFunction *function = frame->closure->function;
+                SwitchTable *table = &function->chunk.switches[READ_SHORT()];
+                ip = function->register_code.code + table->register_targets[switch_arm(table, R(value))];
+                DISPATCH();
+            }
+            CASE(REG_INTRINSIC): {
+                uint8_t base = READ_BYTE();
+                Intrinsic intrinsic = READ_BYTE();
                 int arg_count = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invoke_from_class(superclass, method, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                Value *args = regs + base + 1;
+                if (!intrinsic_result(intrinsic, args, &R(base))) {
+                    vm.stack_top = args + arg_count;
+                    CALL_FRAME(call_value(R(base), arg_count, false));
                 }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                DISPATCH();
+            }
+            CASE(REG_INVOKE): {
+                uint8_t base = READ_BYTE();
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                InlineCache *cache = READ_CACHE();
+                vm.stack_top = regs + base + arg_count + 1;
+                CALL_FRAME(invoke(method, arg_count, false, cache));
+                DISPATCH();
             }
-            case OP_CLOSURE: {
+            CASE(REG_SUPER_INVOKE): {
+                uint8_t base = READ_BYTE();
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                ObjClass *superclass = AS_CLASS(R(base + arg_count + 1));
+                vm.stack_top = regs + base + arg_count + 1;
+                CALL_FRAME(invoke_from_class(superclass, method, arg_count, false));
+                DISPATCH();
+            }
+            CASE(REG_TAIL_CALL): {
+                uint8_t base = READ_BYTE();
+                int arg_count = READ_BYTE();
+                vm.stack_top = regs + base + arg_count + 1;
+                TAIL_CALL(call_value(R(base), arg_count, true));
+                DISPATCH();
+            }
+            CASE(REG_TAIL_INVOKE): {
+                uint8_t base = READ_BYTE();
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                InlineCache *cache = READ_CACHE();
+                vm.stack_top = regs + base + arg_count + 1;
+                TAIL_CALL(invoke(method, arg_count, true, cache));
+                DISPATCH();
+            }
+            CASE(REG_TAIL_SUPER_INVOKE): {
+                uint8_t base = READ_BYTE();
+                ObjString *method = READ_STRING();
+                int arg_count = READ_BYTE();
+                ObjClass *superclass = AS_CLASS(R(base + arg_count + 1));
+                vm.stack_top = regs + base + arg_count + 1;
+                TAIL_CALL(invoke_from_class(superclass, method, arg_count, true));
+                DISPATCH();
+            }
+            CASE(REG_CLOSURE): {
+                uint8_t dest = READ_BYTE();
                 ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = new_closure(function);
-                push(OBJ_VAL(closure));
-                
-                for (int i = 0; i < closure->upvalue_count; i++) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
+                make_closure(frame, function, ip, false, &R(dest));
+                ip += 2 * function->upvalue_count;
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
-                close_upvalues(vm.stack_top - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                Value result = pop();
-                close_upvalues(frame->slots);
+            CASE(REG_CLOSE_UPVALUE):
+                close_upvalues(regs + READ_BYTE());
+                DISPATCH();
+            CASE(REG_RETURN): {
+                Value result = R(READ_BYTE());
+                close_upvalues(regs);
                 vm.frame_count--;
                 if (vm.frame_count == 0) {
-                    pop();
+                    vm.stack_top = vm.stack;
                     return INTERPRET_OK;
                 }
                 
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                regs[0] = result;
+                vm.stack_top = regs + 1;
+                if (vm.frame_count == exit_frame) return INTERPRET_OK;
+                LOAD_FRAME();
+                restore_registers(frame);
+                DISPATCH();
             }
-            case OP_CLASS:
-                push(OBJ_VAL(new_class(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS((superclass))) {
-                    runtime_error("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(REG_CLASS): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = OBJ_VAL(new_class(READ_STRING()));
+                DISPATCH();
+            }
+            CASE(REG_INHERIT): {
+                Value superclass = R(READ_BYTE());
+                ObjClass *subclass = AS_CLASS(R(READ_BYTE()));
+                if (!IS_CLASS(superclass)) {
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
                 
-                ObjClass *subclass = AS_CLASS(peek(0));
-                table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
+                class_inherit(subclass, AS_CLASS(superclass));
+                DISPATCH();
             }
-            case OP_METHOD:
-                define_method(READ_STRING());
-                break;
-            case OP_NEW_LIST:
-                push(OBJ_VAL(new_list()));
-                break;
-            case OP_GET_LIST: {
-                int index = (int) AS_NUMBER(pop());
-                ObjList *list = AS_LIST(pop());
-                push(list->elements.values[index]);
-                break;
+            CASE(REG_METHOD): {
+                ObjClass *klass = AS_CLASS(R(READ_BYTE()));
+                Value method = R(READ_BYTE());
+                class_add_method(klass, READ_STRING(), AS_CLOSURE(method));
+                DISPATCH();
+            }
+            CASE(REG_NEW_LIST): {
+                uint8_t dest = READ_BYTE();
+                R(dest) = OBJ_VAL(new_list());
+                DISPATCH();
             }
-            case OP_SET_LIST: {
-                Value value = pop();
-                int index = (int) AS_NUMBER(pop());
-                ObjList *list = AS_LIST(pop());
+            CASE(REG_GET_LIST): {
+                uint8_t dest = READ_BYTE();
+                Value list = R(READ_BYTE());
+                Value index = R(READ_BYTE());
+                if (!IS_LIST(list)) {
+                    RUNTIME_ERROR("Can only index lists.");
+                }
+                if (!IS_NUMBER(index)) {
+                    RUNTIME_ERROR("List index must be a number.");
+                }
                 
-                if (index < list->elements.count) {
-                    list->elements.values[index] = value;
-                } else {
-                    write_value_array(&list->elements, value);
+                ValueArray *elements = &AS_LIST(list)->elements;
+                int64_t i = list_index(index);
+                if (i < 0 || i >= elements->count) {
+                    RUNTIME_ERROR("List index out of range.");
                 }
                 
-                push(OBJ_VAL(list));
-                break;
+                R(dest) = elements->values[i];
+                DISPATCH();
             }
-            case OP_MOD: {
-                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-                    runtime_error("Operands must be numbers.");
-                    return INTERPRET_RUNTIME_ERROR; \
+            CASE(REG_SET_LIST): {
+                uint8_t dest = READ_BYTE();
+                Value list = R(READ_BYTE());
+                Value index = R(READ_BYTE());
+                Value value = R(READ_BYTE());
+                if (!IS_LIST(list)) {
+                    RUNTIME_ERROR("Can only index lists.");
                 }
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(fmod(a, b)));
-                break;
+                if (!IS_NUMBER(index) || AS_NUMBER(index) < 0) {
+                    RUNTIME_ERROR("List index must be a non-negative number.");
+                }
+                
+                ValueArray *elements = &AS_LIST(list)->elements;
+                int64_t i = list_index(index);
+                if (i < elements->count) {
+                    elements->values[i] = value;
+                } else {
+                    write_value_array(elements, value);
+                }
+                R(dest) = list;
+                DISPATCH();
             }
         }
     }
 
+#undef LOAD_FRAME
+#undef SAVE_IP
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef R
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef BITWISE_OP
+#undef ADD_OP
+#undef LESS_JUMP_IF_FALSE
+#undef CALL_FRAME
+#undef TAIL_CALL
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+// C emitted by --emit-c can't count on its compiler to turn tail calls
+// into jumps, so instead of making them it leaves the code to carry on
+// with in vm.tail_code and returns here. JIT code never sets it.
+InterpretResult run_native(CallFrame *frame) {
+    InterpretResult result = ((NativeCode) frame->closure->function->native_code)(frame);
+    while (vm.tail_code != NULL) {
+        NativeCode code = vm.tail_code;
+        vm.tail_code = NULL;
+        result = code(&vm.frames[vm.frame_count - 1]);
+    }
+    return result;
+}
+
+// Runs the frame on top of the stack, on whichever engine it was set up
+// for, until the frame count drops back to exit_frame.
+static InterpretResult run_frame(int exit_frame) {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    switch (frame->engine) {
+        case ENGINE_REGISTERS:
+            return run_registers(exit_frame);
+        case ENGINE_NATIVE:
+            return run_native(frame);
+        default:
+            return run(exit_frame);
+    }
+}
+
+static bool finish_call(int caller_frames) {
+    if (vm.frame_count == caller_frames) return true;
+    return run_frame(caller_frames) == INTERPRET_OK;
+}
+
+bool runtime_get_global(ObjString *name) {
+    Value value = vm.globals.values[name->global];
+    if (IS_UNDEFINED(value)) {
+        runtime_error("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+void runtime_define_global(ObjString *name) {
+    vm.globals.values[name->global] = pop();
+}
+
+bool runtime_set_global(ObjString *name) {
+    Value *global = &vm.globals.values[name->global];
+    if (IS_UNDEFINED(*global)) {
+        runtime_error("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    *global = peek(0);
+    return true;
+}
+
+
+bool runtime_set_property(ObjString *name, InlineCache *cache) {
+    return set_property(name, cache);
+}
+
+bool runtime_get_super(ObjString *name) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return bind_method(superclass, name);
+}
+
+bool runtime_binary_op(OpCode op, Feedback *feedback) {
+    Value b = peek(0);
+    Value a = peek(1);
+    if (feedback != NULL) feedback->types |= FEEDBACK_NOT_NUMBER;
+    
+    if (op == OP_EQUAL) {
+        vm.stack_top -= 2;
+        push(BOOL_VAL(values_equal(a, b)));
+        return true;
+    }
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        concatinate();
+        return true;
+    }
+    if (op >= OP_BIT_AND && op <= OP_SHIFT_RIGHT) {
+        Value result;
+        if (!bitwise(op, a, b, &result)) {
+            runtime_error("Operands must be integers.");
+            return false;
+        }
+        vm.stack_top--;
+        vm.stack_top[-1] = result;
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        runtime_error(op == OP_ADD ? "Operands must be two numbers of two strings." : "Operands must be numbers.");
+        return false;
+    }
+    
+    vm.stack_top--;
+    vm.stack_top[-1] = arithmetic(op, a, b);
+    return true;
+}
+
+bool runtime_negate(void) {
+    if (!IS_NUMBER(peek(0))) {
+        runtime_error("Operand must be a number.");
+        return false;
+    }
+    vm.stack_top[-1] = negate(peek(0));
+    return true;
+}
+
+void runtime_print(void) {
+    print_value(pop());
+    printf("\n");
+}
+
+// Remembers the first target seen at a call site and whether any other
+// ever showed up.
+static void record_target(Feedback *feedback, Obj *target) {
+    if (feedback == NULL) return;
+    if (target != NULL && feedback->target == NULL) {
+        feedback->target = target;
+    } else if (target == NULL || feedback->target != target) {
+        feedback->types |= FEEDBACK_POLYMORPHIC;
+    }
+}
+
+// Property reads note the receiver's shape. Instances that have moved
+// their fields into a dictionary have none, which counts as polymorphic.
+bool runtime_get_property(ObjString *name, InlineCache *cache, Feedback *feedback) {
+    Value receiver = peek(0);
+    record_target(feedback, IS_INSTANCE(receiver) ? (Obj *) AS_INSTANCE(receiver)->shape : NULL);
+    return get_property(name, cache);
+}
+
+bool runtime_call(int arg_count, Feedback *feedback) {
+    int caller_frames = vm.frame_count;
+    Value callee = peek(arg_count);
+    Obj *target = NULL;
+    if (IS_CLOSURE(callee)) {
+        target = (Obj *) AS_CLOSURE(callee)->function;
+    } else if (IS_NATIVE(callee)) {
+        target = AS_OBJ(callee);
+    }
+    record_target(feedback, target);
+    return call_value(callee, arg_count, false) && finish_call(caller_frames);
+}
+
+bool runtime_call_scoped(int arg_count) {
+    int caller_frames = vm.frame_count;
+    return call_scoped(peek(arg_count), arg_count) && finish_call(caller_frames);
+}
+
+void runtime_pop_scoped(void) {
+    recycle(pop());
+}
+
+bool runtime_intrinsic(Intrinsic intrinsic, int arg_count) {
+    Value *args = vm.stack_top - arg_count;
+    if (intrinsic_result(intrinsic, args, &args[-1])) {
+        vm.stack_top = args;
+        return true;
+    }
+    int caller_frames = vm.frame_count;
+    return call_value(args[-1], arg_count, false) && finish_call(caller_frames);
+}
+
+bool runtime_invoke(ObjString *name, int arg_count, Feedback *feedback, InlineCache *cache) {
+    int caller_frames = vm.frame_count;
+    Value receiver = peek(arg_count);
+    record_target(feedback, IS_INSTANCE(receiver) ? (Obj *) AS_INSTANCE(receiver)->klass : NULL);
+    return invoke(name, arg_count, false, cache) && finish_call(caller_frames);
+}
+
+#ifdef JIT
+// Invoke for a call site that has only ever seen one class. The method
+// was looked up when the code was compiled; the field shadowing check
+// still has to happen here.
+bool jit_invoke_known(ObjString *name, int arg_count, ObjClass *klass, ObjClosure *method) {
+    Value receiver = peek(arg_count);
+    Value value;
+    if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->klass != klass ||
+        instance_get_field(AS_INSTANCE(receiver), name, &value)) {
+        return runtime_invoke(name, arg_count, NULL, NULL);
+    }
     
+    int caller_frames = vm.frame_count;
+    return call(method, arg_count) && finish_call(caller_frames);
+}
+#endif
+
+bool runtime_super_invoke(ObjString *name, int arg_count) {
+    int caller_frames = vm.frame_count;
+    ObjClass *superclass = AS_CLASS(pop());
+    return invoke_from_class(superclass, name, arg_count, false) && finish_call(caller_frames);
+}
+
+// Machine code makes a tail call by jumping to the code these return,
+// passing the frame on top: the callee's own code when it took over the
+// frame, or a stand-in when the call has already finished.
+static InterpretResult tail_call_done(CallFrame *frame) {
+    return INTERPRET_OK;
+}
+
+static InterpretResult tail_call_failed(CallFrame *frame) {
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+static NativeCode finish_tail_call(int frames, bool ok) {
+    if (!ok) return tail_call_failed;
+    if (vm.frame_count < frames) return tail_call_done;
+    
+    CallFrame *frame = &vm.frames[frames - 1];
+    if (frame->engine == ENGINE_NATIVE) return (NativeCode) frame->closure->function->native_code;
+    return run_frame(frames - 1) == INTERPRET_OK ? tail_call_done : tail_call_failed;
+}
+
+NativeCode runtime_tail_call(int arg_count) {
+    int frames = vm.frame_count;
+    return finish_tail_call(frames, call_value(peek(arg_count), arg_count, true));
+}
+
+NativeCode runtime_tail_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    int frames = vm.frame_count;
+    return finish_tail_call(frames, invoke(name, arg_count, true, cache));
+}
+
+NativeCode runtime_tail_super_invoke(ObjString *name, int arg_count) {
+    int frames = vm.frame_count;
+    ObjClass *superclass = AS_CLASS(pop());
+    return finish_tail_call(frames, invoke_from_class(superclass, name, arg_count, true));
+}
+
+// The long form of OP_CLOSURE has two byte upvalue indexes.
+void runtime_closure(CallFrame *frame, ObjFunction *function, uint8_t *upvalues, bool wide) {
+    push(NIL_VAL);
+    make_closure(frame, function, upvalues, wide, vm.stack_top - 1);
+}
+
+void runtime_close_upvalue(void) {
+    close_upvalues(vm.stack_top - 1);
+    pop();
+}
+
+void runtime_return(CallFrame *frame) {
+    Value result = pop();
+    close_upvalues(frame->slots);
+    vm.frame_count--;
+    if (vm.frame_count == 0) {
+        vm.stack_top = frame->slots;
+        return;
+    }
+    
+    frame->slots[0] = result;
+    vm.stack_top = frame->slots + 1;
+}
+
+void runtime_class(ObjString *name) {
+    push(OBJ_VAL(new_class(name)));
+}
+
+bool runtime_inherit(void) {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtime_error("Superclass must be a class.");
+        return false;
+    }
+    
+    class_inherit(AS_CLASS(peek(0)), AS_CLASS(superclass));
+    pop();
+    return true;
+}
+
+void runtime_method(ObjString *name) {
+    define_method(name);
+}
+
+void runtime_new_list(void) {
+    push(OBJ_VAL(new_list()));
+}
+
+bool runtime_get_list(void) {
+    if (!IS_LIST(peek(1))) {
+        runtime_error("Can only index lists.");
+        return false;
+    }
+    if (!IS_NUMBER(peek(0))) {
+        runtime_error("List index must be a number.");
+        return false;
+    }
+    
+    int64_t index = list_index(peek(0));
+    ObjList *list = AS_LIST(peek(1));
+    if (index < 0 || index >= list->elements.count) {
+        runtime_error("List index out of range.");
+        return false;
+    }
+    
+    vm.stack_top--;
+    vm.stack_top[-1] = list->elements.values[index];
+    return true;
+}
+
+bool runtime_set_list(void) {
+    if (!IS_LIST(peek(2))) {
+        runtime_error("Can only index lists.");
+        return false;
+    }
+    if (!IS_NUMBER(peek(1)) || AS_NUMBER(peek(1)) < 0) {
+        runtime_error("List index must be a non-negative number.");
+        return false;
+    }
+    
+    set_list();
+    return true;
+}
+
+ForStep runtime_for_range(Value *loop) {
+    ForStep step = for_range(loop);
+    if (step == FOR_ERROR) runtime_error("Range bounds must be numbers.");
+    return step;
+}
+
+ForStep runtime_for_list(Value *loop) {
+    ForStep step = for_list(loop);
+    if (step == FOR_ERROR) runtime_error("Can only iterate over lists.");
+    return step;
+}
+
+int runtime_switch(SwitchTable *table) {
+    return switch_arm(table, pop());
+}
+
+#ifdef JIT
+// Called when a guard in optimized code fails. The frame carries on in the
+// interpreter from the start of the instruction that failed; functions
+// that keep failing go back to their baseline code for good.
+InterpretResult jit_deoptimize(CallFrame *frame, uint8_t *ip) {
+    ObjFunction *function = frame->closure->function;
+    if (++function->deopts == JIT_DEOPT_LIMIT) {
+        function->native_code = function->baseline_code;
+    }
+    
+    frame->ip = ip;
+    frame->engine = ENGINE_STACK;
+    return run(vm.frame_count - 1);
+}
+#endif
+
+static InterpretResult run_script(ObjFunction *function) {
     push(OBJ_VAL(function));
-    ObjClosure *closure = new_closure(function);
+    ObjClosure *closure = new_closure(function, 0);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
     
-    return run();
+    return run_frame(0);
+}
+
+InterpretResult interpret(const char *source) {
+    ObjFunction *function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    
+    return run_script(function);
+}
+
+// Hands out the functions in the order the compiler created them, which is
+// the order --emit-c numbers them in.
+static void attach_native_code(ObjFunction *function, NativeCode *functions, int function_count, int *index) {
+    if (*index < function_count) function->native_code = (void *) functions[*index];
+    (*index)++;
+    
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            attach_native_code(AS_FUNCTION(constants->values[i]), functions, function_count, index);
+        }
+    }
+}
+
+InterpretResult interpret_native(const char *source, NativeCode *functions, int function_count) {
+    ObjFunction *function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    
+    int count = 0;
+    attach_native_code(function, functions, function_count, &count);
+    if (count != function_count) {
+        fprintf(stderr, "Compiled code doesn't match its source.\n");
+        return INTERPRET_COMPILE_ERROR;
+    }
+    
+    return run_script(function);
 }
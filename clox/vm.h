@@ -5,24 +5,71 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Both stacks start small and grow as calls need them, up to a ceiling
+// of vm.frames_max frames, which defaults to FRAMES_MAX. Calls between
+// native functions also nest on the C stack, so once that comes within
+// C_STACK_MARGIN bytes of its limit further calls run in the interpreter
+// instead, and the ceiling is the same whichever engine runs the code.
+#define FRAMES_MAX 10000
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL 256
+#define C_STACK_DEFAULT (8 * 1024 * 1024)
+#define C_STACK_MARGIN (256 * 1024)
+
+// Megamorphic sites share one lookup cache, keyed by name and receiver.
+// It only holds entries between collections.
+#define MEGAMORPHIC_CACHE_SIZE 1024
+
+typedef struct {
+    ObjString *name;
+    ObjClass *klass;
+    bool set;
+    CacheEntry entry;
+} MegamorphicEntry;
+
+typedef enum {
+    ENGINE_STACK,
+    ENGINE_REGISTERS,
+    ENGINE_NATIVE,
+} Engine;
 
 typedef struct {
     ObjClosure *closure;
     uint8_t *ip;
     Value *slots;
+    Engine engine;
 } CallFrame;
 
+typedef enum {
+    INTERPRET_OK,
+    INTERPRET_COMPILE_ERROR,
+    INTERPRET_RUNTIME_ERROR
+} InterpretResult;
+
+typedef InterpretResult (*NativeCode)(CallFrame *frame);
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frame_count;
-    Value stack[STACK_MAX];
+    int frame_capacity;
+    int frames_max;
+    uintptr_t c_stack_limit;
+    Value *stack;
     Value *stack_top;
-    Table globals;
+    Value *stack_end;
+    ValueArray globals;
+    ValueArray global_names;
     Table strings;
     ObjString *init_string;
+    ObjShape *empty_shape;
+    ObjNative *intrinsics[INTRINSIC_COUNT];
+    int selector_count;
     ObjUpvalue *open_upvalues;
+    MegamorphicEntry megamorphic_cache[MEGAMORPHIC_CACHE_SIZE];
+    NativeCode tail_code;
+    bool use_registers;
+    bool use_jit;
+    int optimize_level;
     
     size_t bytes_allocated;
     size_t next_gc;
@@ -30,20 +77,123 @@ typedef struct {
     int gray_count;
     int gray_capacity;
     Obj **gray_stack;
+    
+#ifdef DEBUG_PROFILE_OPCODES
+    uint8_t previous_opcode;
+    uint64_t opcode_pairs[UINT8_COUNT][UINT8_COUNT];
+#endif
 } Vm;
 
+// What one step of a for-in loop did.
 typedef enum {
-    INTERPRET_OK,
-    INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
-} InterpretResult;
+    FOR_ERROR,
+    FOR_DONE,
+    FOR_NEXT,
+} ForStep;
 
 extern Vm vm;
 
 void init_vm(void);
 void free_vm(void);
+void set_frames_max(int frames_max);
 InterpretResult interpret(const char *source);
+InterpretResult interpret_native(const char *source, NativeCode *functions, int function_count);
 void push(Value value);
 Value pop(void);
 
+// What the operator instruction op makes of constant operands, b unused
+// for the unary ones. False where it would be a runtime error, or where
+// the operands need more than arithmetic, like concatenating strings.
+bool fold_operator(OpCode op, Value a, Value b, Value *result);
+
+// The intrinsic a call to the global name with arg_count arguments can
+// compile to, or -1.
+int find_intrinsic(ObjString *name, int arg_count);
+
+// Runs the machine code of the frame on top, then whatever code each tail
+// call it makes hands back through vm.tail_code.
+InterpretResult run_native(CallFrame *frame);
+
+// Entry points for machine code, both from the JIT and from C emitted by
+// --emit-c. They work on vm.stack_top and report errors through the
+// frame's ip like the interpreter does. Feedback and caches may be NULL.
+bool runtime_get_global(ObjString *name);
+void runtime_define_global(ObjString *name);
+bool runtime_set_global(ObjString *name);
+bool runtime_get_property(ObjString *name, InlineCache *cache, Feedback *feedback);
+bool runtime_set_property(ObjString *name, InlineCache *cache);
+bool runtime_get_super(ObjString *name);
+bool runtime_binary_op(OpCode op, Feedback *feedback);
+bool runtime_negate(void);
+void runtime_print(void);
+bool runtime_call(int arg_count, Feedback *feedback);
+bool runtime_intrinsic(Intrinsic intrinsic, int arg_count);
+bool runtime_call_scoped(int arg_count);
+void runtime_pop_scoped(void);
+bool runtime_invoke(ObjString *name, int arg_count, Feedback *feedback, InlineCache *cache);
+bool runtime_super_invoke(ObjString *name, int arg_count);
+NativeCode runtime_tail_call(int arg_count);
+NativeCode runtime_tail_invoke(ObjString *name, int arg_count, InlineCache *cache);
+NativeCode runtime_tail_super_invoke(ObjString *name, int arg_count);
+void runtime_closure(CallFrame *frame, ObjFunction *function, uint8_t *upvalues, bool wide);
+void runtime_close_upvalue(void);
+void runtime_return(CallFrame *frame);
+void runtime_class(ObjString *name);
+bool runtime_inherit(void);
+void runtime_method(ObjString *name);
+void runtime_new_list(void);
+bool runtime_get_list(void);
+bool runtime_set_list(void);
+ForStep runtime_for_range(Value *loop);
+ForStep runtime_for_list(Value *loop);
+int runtime_switch(SwitchTable *table);
+
+// The fast path of a property access, shared with compiled code: the
+// field the cache's first entry finds, or NULL if the receiver isn't an
+// instance of that entry's shape.
+static inline Value* cached_field(InlineCache *cache, Value receiver) {
+    if (!IS_INSTANCE(receiver)) return NULL;
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    CacheEntry *entry = &cache->entries[0];
+    if (entry->shape != instance->shape || entry->kind != CACHE_FIELD) return NULL;
+#ifdef DEBUG_PROFILE_CACHES
+    cache->hits++;
+#endif
+    return &instance->fields[entry->slot];
+}
+
+// The arm of a switch statement that value goes to.
+static inline int switch_arm(SwitchTable *table, Value value) {
+    int64_t integer;
+    if (IS_STRING(value)) {
+        if (table->string_capacity == 0) return table->fallback;
+        uint32_t mask = table->string_capacity - 1;
+        for (uint32_t index = AS_STRING(value)->hash & mask; ; index = (index + 1) & mask) {
+            SwitchCase *entry = &table->strings[index];
+            if (IS_NIL(entry->key)) return table->fallback;
+            if (AS_OBJ(entry->key) == AS_OBJ(value)) return entry->arm;
+        }
+    }
+    if (table->dense_count > 0 && as_integer(value, &integer)) {
+        uint64_t index = (uint64_t) (integer - table->low);
+        return index < (uint64_t) table->dense_count ? table->dense[index] : table->fallback;
+    }
+    if (!IS_NUMBER(value)) return table->fallback;
+    
+    double number = AS_NUMBER(value);
+    int low = 0;
+    int high = table->number_count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        double key = AS_NUMBER(table->numbers[middle].key);
+        if (key == number) return table->numbers[middle].arm;
+        if (key < number) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return table->fallback;
+}
+
 #endif
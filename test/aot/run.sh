@@ -0,0 +1,26 @@
+#!/bin/sh
+# Builds every test with --emit-c at each optimization level and runs the
+# result, checking it against the test's "// expect: " comments. Needs a
+# C compiler and the clox binary given as the first argument.
+
+clox=${1:?usage: test/aot/run.sh path/to/clox}
+root=$(cd "$(dirname "$0")/../.." && pwd)
+build=$(mktemp -d)
+failed=0
+
+for test in $(find "$root/test" -name '*.lox' | sort); do
+    grep -q '// flags:\|// expect runtime error:' "$test" && continue
+    expected=$(sed -n 's|.*// expect: ||p' "$test")
+    "$clox" --emit-c "$test" > "$build/program.c" || { echo "FAIL: $test"; failed=$((failed + 1)); continue; }
+    for level in -O0 -O2; do
+        cc -std=gnu99 $level -I "$root/clox" "$build/program.c" $(ls "$root"/clox/*.c | grep -v main.c) \
+            -lm -o "$build/program" && output=$("$build/program")
+        if [ $? -ne 0 ] || [ "$output" != "$expected" ]; then
+            echo "FAIL: $test $level"
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+rm -rf "$build"
+[ $failed -eq 0 ] && echo "All tests passed." || { echo "$failed failed."; exit 1; }
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs every test under this directory through the clox binary given as
+# the first argument, once per engine. A test's expected output is given
+# by its "// expect: " comments, in the style of the book's test suite,
+# and "// expect runtime error: " gives the first line of stderr for a
+# test that should fail. A "// flags: " line adds command line options.
+
+clox=${1:?usage: test/run.sh path/to/clox}
+dir=$(dirname "$0")
+failed=0
+
+for test in $(find "$dir" -name '*.lox' | sort); do
+    flags=$(sed -n 's|.*// flags: ||p' "$test")
+    expected=$(sed -n 's|.*// expect: ||p' "$test")
+    error=$(sed -n 's|.*// expect runtime error: ||p' "$test")
+    for engine in "" --no-jit --registers; do
+        output=$("$clox" $engine $flags "$test" 2>/tmp/clox_stderr)
+        status=$?
+        if [ "$output" != "$expected" ] ||
+           { [ -n "$error" ] && { [ $status -ne 70 ] || [ "$(head -n 1 /tmp/clox_stderr)" != "$error" ]; }; } ||
+           { [ -z "$error" ] && [ $status -ne 0 ]; }; then
+            echo "FAIL: $test $engine"
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+[ $failed -eq 0 ] && echo "All tests passed." || { echo "$failed failed."; exit 1; }